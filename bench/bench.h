@@ -0,0 +1,52 @@
+/*
+ * Shared by the benchmarks: a monotonic clock and one result line per
+ * measurement. The default output is aligned for reading; with -j every
+ * line is a JSON object with the same keys in the same order, so the
+ * results of two commits can be compared with diff or jq.
+ */
+#ifndef WS_BENCH_H
+#define	WS_BENCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static int benchJson = 0;
+
+static void benchInit(int argc, char **argv)
+{
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0)
+            benchJson = 1;
+    }
+}
+
+static double benchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * bytes is what one operation processes, 0 if throughput means nothing
+ * for it.
+ */
+static void benchReport(const char *bench, const char *variant, size_t iterations,
+                        double bytes, double elapsed)
+{
+    double nsPerOp = elapsed * 1e9 / iterations;
+    double gbPerSec = bytes * iterations / elapsed / 1e9;
+
+    if (benchJson)
+        printf("{\"bench\":\"%s\",\"case\":\"%s\",\"iterations\":%zu,\"bytes\":%.0f,"
+               "\"ns_per_op\":%.2f,\"gb_per_s\":%.4f}\n",
+               bench, variant, iterations, bytes, nsPerOp, gbPerSec);
+    else if (bytes > 0)
+        printf("%-14s %-16s %10.1f ns/op %8.3f GB/s\n", bench, variant, nsPerOp, gbPerSec);
+    else
+        printf("%-14s %-16s %10.1f ns/op %10.0f op/s\n", bench, variant, nsPerOp, iterations / elapsed);
+}
+
+#endif	/* WS_BENCH_H */
@@ -0,0 +1,265 @@
+/*
+ * Measures server and client framing and frame parsing over batches of frames whose payload
+ * sizes follow a few typical workloads, from small telemetry messages to
+ * large binary transfers. ns/op is per frame, GB/s counts payload bytes.
+ *
+ *   gcc -O2 -I../include bench_frame.c ../websocket.c ../ws_mask.c ../ws_utf8.c ../ws_sha1.c \
+ *       -o bench_frame && ./bench_frame [-j]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "websocket.h"
+#include "bench.h"
+
+#define MIN_SECONDS 0.3 // every measurement runs at least this long
+
+struct workload {
+    const char *name;
+    size_t frames; // in one batch
+    size_t minSize;
+    size_t maxSize;
+    enum wsFrameType frameType;
+};
+
+static const struct workload workloads[] = {
+    { "telemetry", 4096, 2, 125, WS_TEXT_FRAME }, // sensor readings and acks, 7 bit lengths
+    { "chat", 1024, 126, 4096, WS_TEXT_FRAME }, // 16 bit lengths
+    { "64k", 32, 65535, 65535, WS_BINARY_FRAME }, // largest 16 bit length
+    { "binary", 4, 1 << 20, 1 << 20, WS_BINARY_FRAME } // 64 bit lengths
+};
+
+/*
+ * One workload laid out twice: the plain payloads, and the masked client
+ * frames carrying them back to back as they arrive from a socket.
+ */
+struct batch {
+    size_t frames;
+    size_t *sizes;
+    uint8_t *payload;
+    size_t payloadLength;
+    uint8_t *input;
+    uint8_t *masked; // copy of input, parsing unmasks it in place
+    size_t *offsets; // of every frame in input, and the end of input
+    uint8_t *output; // room for the payload framed by the server
+};
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t nextRandom(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void buildBatch(const struct workload *workload, struct batch *batch)
+{
+    size_t i, j, position = 0;
+
+    batch->frames = workload->frames;
+    batch->sizes = malloc(batch->frames * sizeof(size_t));
+    batch->offsets = malloc((batch->frames + 1) * sizeof(size_t));
+    batch->payloadLength = 0;
+    for (i = 0; i < batch->frames; i++) {
+        batch->sizes[i] = workload->minSize + nextRandom() % (workload->maxSize - workload->minSize + 1);
+        batch->payloadLength += batch->sizes[i];
+    }
+    batch->payload = malloc(batch->payloadLength);
+    batch->input = malloc(batch->payloadLength + batch->frames * WS_MAX_FRAME_HEADER);
+    batch->output = malloc(batch->payloadLength + batch->frames * WS_MAX_FRAME_HEADER);
+    // printable, text frames stay valid UTF-8
+    for (i = 0; i < batch->payloadLength; i++)
+        batch->payload[i] = (uint8_t)(' ' + nextRandom() % 95);
+
+    const uint8_t *payload = batch->payload;
+    for (i = 0; i < batch->frames; i++) {
+        uint8_t *frame = batch->input + position;
+        size_t headerLength = wsMakeFrameHeader(batch->sizes[i], frame, workload->frameType);
+        uint8_t *maskingKey = frame + headerLength;
+
+        frame[1] |= 0x80; // clients mask every frame
+        for (j = 0; j < 4; j++)
+            maskingKey[j] = (uint8_t)nextRandom();
+        for (j = 0; j < batch->sizes[i]; j++)
+            maskingKey[4 + j] = payload[j] ^ maskingKey[j & 3];
+        batch->offsets[i] = position;
+        position += headerLength + 4 + batch->sizes[i];
+        payload += batch->sizes[i];
+    }
+    batch->offsets[batch->frames] = position;
+    batch->masked = malloc(position);
+    memcpy(batch->masked, batch->input, position);
+}
+
+// outside the measured time
+static void restoreInput(struct batch *batch)
+{
+    memcpy(batch->input, batch->masked, batch->offsets[batch->frames]);
+}
+
+static void freeBatch(struct batch *batch)
+{
+    free(batch->sizes);
+    free(batch->offsets);
+    free(batch->payload);
+    free(batch->input);
+    free(batch->masked);
+    free(batch->output);
+}
+
+static void benchMake(const struct workload *workload, struct batch *batch)
+{
+    size_t batches = 0, i;
+    double start = benchNow(), elapsed;
+
+    do {
+        const uint8_t *payload = batch->payload;
+        uint8_t *out = batch->output;
+        for (i = 0; i < batch->frames; i++) {
+            size_t outLength = batch->sizes[i] + WS_MAX_FRAME_HEADER;
+            wsMakeFrame(payload, batch->sizes[i], out, &outLength, workload->frameType);
+            payload += batch->sizes[i];
+            out += outLength;
+        }
+        batches++;
+    } while ((elapsed = benchNow() - start) < MIN_SECONDS);
+
+    benchReport("make", workload->name, batches * batch->frames,
+                (double)batch->payloadLength / batch->frames, elapsed);
+}
+
+// client frames: a fresh masking key for every frame, payload copied and masked
+static void benchMakeMasked(const struct workload *workload, struct batch *batch)
+{
+    struct wsRandom random;
+    size_t batches = 0, i;
+    double start = benchNow(), elapsed;
+
+    wsInitRandom(&random, 1);
+    do {
+        const uint8_t *payload = batch->payload;
+        uint8_t *out = batch->output;
+        for (i = 0; i < batch->frames; i++) {
+            size_t outLength = batch->sizes[i] + WS_MAX_FRAME_HEADER;
+            wsMakeMaskedFrame(payload, batch->sizes[i], out, &outLength, workload->frameType, &random);
+            payload += batch->sizes[i];
+            out += outLength;
+        }
+        batches++;
+    } while ((elapsed = benchNow() - start) < MIN_SECONDS);
+
+    benchReport("make_masked", workload->name, batches * batch->frames,
+                (double)batch->payloadLength / batch->frames, elapsed);
+}
+
+// every frame on its own, text is validated
+static int benchParseInput(const struct workload *workload, struct batch *batch)
+{
+    size_t batches = 0, i;
+    double elapsed = 0;
+
+    do {
+        restoreInput(batch);
+        double start = benchNow();
+        for (i = 0; i < batch->frames; i++) {
+            uint8_t *data;
+            size_t dataLength;
+            size_t frameLength = batch->offsets[i + 1] - batch->offsets[i];
+            if (wsParseInputFrame(batch->input + batch->offsets[i], frameLength, &data, &dataLength)
+                    != workload->frameType || dataLength != batch->sizes[i]) {
+                fprintf(stderr, "%s: frame %zu not parsed\n", workload->name, i);
+                return 0;
+            }
+        }
+        elapsed += benchNow() - start;
+        batches++;
+    } while (elapsed < MIN_SECONDS);
+
+    benchReport("parse_input", workload->name, batches * batch->frames,
+                (double)batch->payloadLength / batch->frames, elapsed);
+    return 1;
+}
+
+/*
+ * The whole batch as one buffer of pipelined frames, the way the server
+ * reads them; with validateUtf8 text is checked as the server does it.
+ */
+static int benchParseStream(const struct workload *workload, struct batch *batch, int validateUtf8)
+{
+    struct wsFrameParser parser;
+    size_t batches = 0;
+    double elapsed = 0;
+
+    wsInitFrameParser(&parser, 0);
+    parser.validateUtf8 = validateUtf8;
+    do {
+        restoreInput(batch);
+        double start = benchNow();
+        uint8_t *input = batch->input;
+        size_t inputLength = batch->offsets[batch->frames];
+        size_t frames = 0;
+        while (inputLength > 0) {
+            uint8_t *data;
+            size_t dataLength, consumed;
+            if (wsParseFrame(&parser, input, inputLength, &consumed, &data, &dataLength)
+                    != workload->frameType) {
+                fprintf(stderr, "%s: frame %zu not parsed\n", workload->name, frames);
+                return 0;
+            }
+            input += consumed;
+            inputLength -= consumed;
+            frames++;
+        }
+        elapsed += benchNow() - start;
+        batches++;
+    } while (elapsed < MIN_SECONDS);
+
+    benchReport(validateUtf8 ? "parse_utf8" : "parse_stream", workload->name, batches * batch->frames,
+                (double)batch->payloadLength / batch->frames, elapsed);
+    return 1;
+}
+
+static int verify(struct batch *batch)
+{
+    const uint8_t *payload = batch->payload;
+    size_t i;
+
+    for (i = 0; i < batch->frames; i++) {
+        uint8_t *data;
+        size_t dataLength;
+        size_t frameLength = batch->offsets[i + 1] - batch->offsets[i];
+        wsParseInputFrame(batch->input + batch->offsets[i], frameLength, &data, &dataLength);
+        if (dataLength != batch->sizes[i] || memcmp(data, payload, dataLength) != 0) {
+            fprintf(stderr, "frame %zu: payload differs\n", i);
+            return 0;
+        }
+        payload += dataLength;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    size_t w;
+
+    benchInit(argc, argv);
+    for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        struct batch batch;
+        buildBatch(&workloads[w], &batch);
+        if (!verify(&batch)) {
+            freeBatch(&batch);
+            return EXIT_FAILURE;
+        }
+        benchMake(&workloads[w], &batch);
+        benchMakeMasked(&workloads[w], &batch);
+        if (!benchParseInput(&workloads[w], &batch) || !benchParseStream(&workloads[w], &batch, 0)
+                || (workloads[w].frameType == WS_TEXT_FRAME && !benchParseStream(&workloads[w], &batch, 1))) {
+            freeBatch(&batch);
+            return EXIT_FAILURE;
+        }
+        freeBatch(&batch);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,209 @@
+/*
+ * Checks the SHA-1 kernels against known digests, then measures the accept
+ * key, and parsing and answering requests of a few typical shapes.
+ *
+ *   gcc -O2 -I../include bench_handshake.c ../websocket.c ../ws_mask.c ../ws_utf8.c ../ws_sha1.c \
+ *       -o bench_handshake && ./bench_handshake [-j]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "websocket.h"
+#include "bench.h"
+
+static const char request[] =
+    "GET /chat HTTP/1.1\r\n"
+    "Host: server.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Origin: http://example.com\r\n"
+    "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Connection: keep-alive, Upgrade\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Upgrade: websocket\r\n"
+    "\r\n";
+
+// just what RFC 6455 requires, as sent by small clients and devices
+static const char minimal[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: 10.0.0.2\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "\r\n";
+
+// behind a proxy, with cookies and every extension parameter
+static const char heavy[] =
+    "GET /api/v2/stream?token=4f1c9a7e2b8d4c6f9e0a1b2c3d4e5f60&channel=telemetry HTTP/1.1\r\n"
+    "Host: gateway.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: de-DE,de;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Pragma: no-cache\r\n"
+    "Cookie: session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIxMjM0NTY3ODkwIiwibmFtZSI6"
+    "IkpvaG4gRG9lIiwiaWF0IjoxNTE2MjM5MDIyfQ.SflKxwRJSMeKKF2QT4fwpMeJf36POk6yJV_adQssw5c; "
+    "theme=dark; _ga=GA1.2.1234567890.1234567890; _gid=GA1.2.0987654321.0987654321\r\n"
+    "Origin: https://app.example.com\r\n"
+    "X-Forwarded-For: 203.0.113.195, 70.41.3.18, 150.172.238.178\r\n"
+    "X-Forwarded-Proto: https\r\n"
+    "X-Request-Id: 9b2e4c1a-7f3d-4e8b-a6c5-1d0f2e3b4a59\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits; server_max_window_bits=10, "
+    "permessage-deflate; client_max_window_bits\r\n"
+    "Connection: keep-alive, Upgrade\r\n"
+    "Upgrade: websocket\r\n"
+    "\r\n";
+
+static const struct {
+    const char *name;
+    const char *text;
+    size_t length;
+} shapes[] = {
+    { "minimal", minimal, sizeof(minimal) - 1 },
+    { "browser", request, sizeof(request) - 1 },
+    { "heavy", heavy, sizeof(heavy) - 1 }
+};
+
+static int checkDigest(const char *name, const uint8_t *data, size_t length, const char *expected)
+{
+    uint8_t digest[WS_SHA1_LENGTH];
+    char hex[2 * WS_SHA1_LENGTH + 1];
+    int i, kernel;
+
+    // every bundled kernel, or the one backend
+    for (kernel = 0; kernel < 2; kernel++) {
+#ifdef WS_CRYPTO_BUNDLED
+        if (!wsSha1KernelSupported(kernel))
+            continue;
+        wsSha1Kernel(kernel, data, length, digest);
+#else
+        if (kernel > 0)
+            break;
+        wsSha1(data, length, digest);
+#endif
+        for (i = 0; i < WS_SHA1_LENGTH; i++) {
+            sprintf(hex + 2 * i, "%02x", digest[i]);
+        }
+        if (strcmp(hex, expected) != 0) {
+            fprintf(stderr, "sha1 %s: got %s, expected %s\n", name, hex, expected);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int verify(void)
+{
+    static uint8_t million[1000000];
+    memset(million, 'a', sizeof(million));
+
+    if (!checkDigest("empty", (const uint8_t *)"", 0, "da39a3ee5e6b4b0d3255bfef95601890afd80709")
+        || !checkDigest("abc", (const uint8_t *)"abc", 3, "a9993e364706816aba3e25717850c26c9cd0d89d")
+        || !checkDigest("448 bits", (const uint8_t *)"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+                        56, "84983e441c3bd26ebaae4aa1f95129e5e54670f1")
+        || !checkDigest("million a", million, sizeof(million), "34aa973cd4c4daa4f61eeb2bdbad27316534016f"))
+        return 0;
+
+    // RFC 6455 section 1.3 example, every shape uses its key
+    size_t s;
+    for (s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        struct handshake hs;
+        uint8_t answer[WS_MAX_HANDSHAKE_ANSWER];
+        size_t answerLength = sizeof(answer);
+        nullHandshake(&hs);
+        if (wsParseHandshake((const uint8_t *)shapes[s].text, shapes[s].length, &hs) != WS_OPENING_FRAME) {
+            fprintf(stderr, "%s: handshake not parsed\n", shapes[s].name);
+            return 0;
+        }
+        wsGetHandshakeAnswer(&hs, answer, &answerLength);
+        freeHandshake(&hs);
+        if (!strstr((const char *)answer, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n")) {
+            fprintf(stderr, "%s: wrong answer:\n%.*s", shapes[s].name, (int)answerLength, answer);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    const size_t iterations = 1000000;
+    uint8_t key[WS_KEY_LENGTH + 36];
+    uint8_t digest[WS_SHA1_LENGTH];
+    size_t i, s;
+    double start, elapsed;
+
+    benchInit(argc, argv);
+    if (!verify())
+        return EXIT_FAILURE;
+
+    memcpy(key, "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11", sizeof(key));
+#ifdef WS_CRYPTO_BUNDLED
+    static const char *kernelNames[] = { "portable", "shani" };
+    int kernel;
+    for (kernel = WS_SHA1_PORTABLE; kernel <= WS_SHA1_SHANI; kernel++) {
+        if (!wsSha1KernelSupported(kernel))
+            continue;
+        start = benchNow();
+        for (i = 0; i < iterations; i++) {
+            key[0] = (uint8_t)i;
+            wsSha1Kernel(kernel, key, sizeof(key), digest);
+        }
+        elapsed = benchNow() - start;
+        benchReport("sha1", kernelNames[kernel], iterations, 0, elapsed);
+    }
+#else
+    start = benchNow();
+    for (i = 0; i < iterations; i++) {
+        key[0] = (uint8_t)i;
+        wsSha1(key, sizeof(key), digest);
+    }
+    elapsed = benchNow() - start;
+    benchReport("sha1", "backend", iterations, 0, elapsed);
+#endif
+
+    for (s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        const uint8_t *text = (const uint8_t *)shapes[s].text;
+        struct handshake hs;
+        uint8_t answer[WS_MAX_HANDSHAKE_ANSWER];
+        size_t answerLength;
+
+        start = benchNow();
+        for (i = 0; i < iterations; i++) {
+            nullHandshake(&hs);
+            wsParseHandshake(text, shapes[s].length, &hs);
+        }
+        elapsed = benchNow() - start;
+        benchReport("hs_parse", shapes[s].name, iterations, shapes[s].length, elapsed);
+
+        // answering only reads the parsed request
+        start = benchNow();
+        for (i = 0; i < iterations; i++) {
+            answerLength = sizeof(answer);
+            wsGetHandshakeAnswer(&hs, answer, &answerLength);
+        }
+        elapsed = benchNow() - start;
+        benchReport("hs_answer", shapes[s].name, iterations, 0, elapsed);
+
+        start = benchNow();
+        for (i = 0; i < iterations; i++) {
+            answerLength = sizeof(answer);
+            nullHandshake(&hs);
+            wsParseHandshake(text, shapes[s].length, &hs);
+            wsGetHandshakeAnswer(&hs, answer, &answerLength);
+        }
+        elapsed = benchNow() - start;
+        benchReport("handshake", shapes[s].name, iterations, 0, elapsed);
+    }
+
+    return EXIT_SUCCESS;
+}
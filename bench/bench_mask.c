@@ -0,0 +1,73 @@
+/*
+ * Checks every masking kernel against the scalar loop, then measures them.
+ *
+ *   gcc -O2 -I../include bench_mask.c ../ws_mask.c -o bench_mask && ./bench_mask [-j]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ws_mask.h"
+#include "bench.h"
+
+static const char *kernelNames[] = { "scalar", "word", "sse2", "avx2" };
+
+static int verify(enum wsMaskKernel kernel)
+{
+    static uint8_t expected[1024 + 64];
+    static uint8_t actual[1024 + 64];
+    const uint8_t maskingKey[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    size_t head, length, offset, i;
+
+    for (head = 0; head < 33; head++) {
+        for (length = 0; length <= 1024; length += (length < 80 ? 1 : 37)) {
+            for (offset = 0; offset < 4; offset++) {
+                for (i = 0; i < length; i++) {
+                    expected[head + i] = actual[head + i] = (uint8_t)(i * 131 + head);
+                }
+                wsApplyMaskKernel(WS_MASK_SCALAR, expected + head, length, maskingKey, offset);
+                wsApplyMaskKernel(kernel, actual + head, length, maskingKey, offset);
+                if (memcmp(expected + head, actual + head, length) != 0) {
+                    fprintf(stderr, "%s: mismatch head=%zu length=%zu offset=%zu\n",
+                            kernelNames[kernel], head, length, offset);
+                    return 0;
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    const size_t sizes[] = { 64, 1024, 65536, 4 << 20 };
+    const uint8_t maskingKey[4] = { 0x12, 0x34, 0x56, 0x78 };
+    const size_t total = 256 << 20;
+    uint8_t *buffer = malloc((4 << 20) + 1);
+    int kernel;
+    size_t s;
+
+    benchInit(argc, argv);
+    memset(buffer, 0xA5, (4 << 20) + 1);
+    for (kernel = WS_MASK_SCALAR; kernel <= WS_MASK_AVX2; kernel++) {
+        if (!wsMaskKernelSupported(kernel))
+            continue;
+        if (!verify(kernel))
+            return EXIT_FAILURE;
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            size_t iterations = total / sizes[s];
+            size_t i;
+            char variant[32];
+            double start = benchNow();
+            for (i = 0; i < iterations; i++) {
+                // +1 keeps the payload unaligned, as it is behind a frame header
+                wsApplyMaskKernel(kernel, buffer + 1, sizes[s], maskingKey, 0);
+            }
+            double elapsed = benchNow() - start;
+            snprintf(variant, sizeof(variant), "%s/%zu", kernelNames[kernel], sizes[s]);
+            benchReport("mask", variant, iterations, sizes[s], elapsed);
+        }
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
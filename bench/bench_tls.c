@@ -0,0 +1,288 @@
+/*
+ * Runs a wss:// echo server on loopback with a self-signed certificate made
+ * on the spot, and measures it from an OpenSSL client in the same process:
+ * connections with a full handshake and with a resumed session (TLS, upgrade
+ * and one echo each), then echoes of a few sizes over one connection. Every
+ * echo is compared, so this is also the local end-to-end check of TLS. -k
+ * asks for kTLS, the summary line tells whether the kernel took it; the
+ * server's own log goes to /dev/null.
+ *
+ *   gcc -O2 -DWS_TLS -I../include bench_tls.c ../websocket.c ../ws*.c -o bench_tls \
+ *       -lssl -lcrypto -lpthread && ./bench_tls [-j] [-k] [-p port]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include "ws_wrapper_server.h"
+#include "bench.h"
+
+#define MIN_SECONDS 0.3 // every measurement runs at least this long
+
+static int port = 9443;
+static SSL_CTX *clientContext;
+static struct wsRandom generator;
+
+static void onMessage(int clientSocket, void *context, enum wsFrameType frameType,
+                      const uint8_t *data, size_t dataSize)
+{
+    struct iovec iov = { (void *)data, dataSize };
+    (void)context;
+    websocket_sendv(clientSocket, frameType, &iov, 1);
+}
+
+// a P-256 key and a certificate for localhost signed by it, as PEM files
+static int makeCertificate(char *certificateFile, char *keyFile)
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *certificate = X509_new();
+    int ok = 0;
+
+    if (key != NULL && certificate != NULL) {
+        X509_set_version(certificate, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+        X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+        X509_gmtime_adj(X509_getm_notAfter(certificate), 86400);
+        X509_set_pubkey(certificate, key);
+        X509_NAME *name = X509_get_subject_name(certificate);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(certificate, name);
+        ok = X509_sign(certificate, key, EVP_sha256()) > 0;
+    }
+    int certificateFd = mkstemp(certificateFile);
+    int keyFd = mkstemp(keyFile);
+    FILE *certificateOut = certificateFd != -1 ? fdopen(certificateFd, "w") : NULL;
+    FILE *keyOut = keyFd != -1 ? fdopen(keyFd, "w") : NULL;
+    ok = ok && certificateOut && keyOut && PEM_write_X509(certificateOut, certificate)
+         && PEM_write_PrivateKey(keyOut, key, NULL, NULL, 0, NULL, NULL);
+    if (certificateOut)
+        fclose(certificateOut);
+    if (keyOut)
+        fclose(keyOut);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+static int readFull(SSL *ssl, uint8_t *buffer, size_t length)
+{
+    size_t readed;
+    while (length > 0) {
+        if (SSL_read_ex(ssl, buffer, length, &readed) != 1)
+            return 0;
+        buffer += readed;
+        length -= readed;
+    }
+    return 1;
+}
+
+static int writeFull(SSL *ssl, const uint8_t *buffer, size_t length)
+{
+    size_t written;
+    return SSL_write_ex(ssl, buffer, length, &written) == 1 && written == length;
+}
+
+// sends data as one masked binary frame and checks the unmasked frame coming back
+static int echo(SSL *ssl, const uint8_t *data, size_t length, uint8_t *frame, uint8_t *reply)
+{
+    size_t frameLength = length + WS_MAX_FRAME_HEADER;
+    uint8_t header[10];
+    uint64_t replyLength;
+
+    wsMakeMaskedFrame(data, length, frame, &frameLength, WS_BINARY_FRAME, &generator);
+    if (!writeFull(ssl, frame, frameLength) || !readFull(ssl, header, 2) || header[0] != 0x82)
+        return 0;
+    replyLength = header[1] & 0x7f;
+    if (replyLength == 126) {
+        if (!readFull(ssl, header + 2, 2))
+            return 0;
+        replyLength = (uint64_t)header[2] << 8 | header[3];
+    } else if (replyLength == 127) {
+        return 0;
+    }
+    return replyLength == length && readFull(ssl, reply, length) && memcmp(reply, data, length) == 0;
+}
+
+// TLS and the upgrade; session, if not NULL, is offered for resumption
+static SSL *connectClient(SSL_SESSION *session)
+{
+    struct sockaddr_in address;
+    struct wsClientHandshake hs;
+    uint8_t buffer[512];
+    size_t length = sizeof(buffer);
+    size_t received = 0;
+    int noDelay = 1;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    SSL *ssl = SSL_new(clientContext);
+    SSL_set_fd(ssl, fd);
+    if (session != NULL)
+        SSL_set_session(ssl, session);
+    if (SSL_connect(ssl) != 1)
+        goto fail;
+
+    wsMakeClientHandshake(&hs, &generator, "localhost", "/echo", buffer, &length);
+    if (!writeFull(ssl, buffer, length))
+        goto fail;
+    while (1) {
+        size_t readed;
+        if (received == sizeof(buffer) || SSL_read_ex(ssl, buffer + received, sizeof(buffer) - received, &readed) != 1)
+            goto fail;
+        received += readed;
+        enum wsFrameType type = wsParseHandshakeAnswer(buffer, received, &hs);
+        if (type == WS_OPENING_FRAME)
+            return ssl;
+        if (type != WS_INCOMPLETE_FRAME)
+            goto fail;
+    }
+
+fail:
+    SSL_free(ssl);
+    close(fd);
+    return NULL;
+}
+
+static void closeClient(SSL *ssl)
+{
+    int fd = SSL_get_fd(ssl);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+}
+
+/*
+ * Connects, echoes once and closes until MIN_SECONDS have passed. With
+ * resume, every connection offers the session of the one before.
+ */
+static int benchConnections(const char *variant, int resume, uint8_t *frame, uint8_t *reply)
+{
+    const uint8_t hello[] = "hello";
+    SSL_SESSION *session = NULL;
+    size_t iterations = 0;
+    size_t resumed = 0;
+    double start = benchNow();
+    double elapsed;
+
+    do {
+        SSL *ssl = connectClient(resume ? session : NULL);
+        if (ssl == NULL || !echo(ssl, hello, sizeof(hello), frame, reply)) {
+            printf("%s: connection %zu FAILED\n", variant, iterations);
+            return 0;
+        }
+        resumed += SSL_session_reused(ssl);
+        SSL_SESSION_free(session);
+        session = SSL_get1_session(ssl);
+        closeClient(ssl);
+        iterations++;
+        elapsed = benchNow() - start;
+    } while (elapsed < MIN_SECONDS);
+    SSL_SESSION_free(session);
+
+    if (resume && resumed + 1 < iterations) {
+        printf("%s: only %zu of %zu connections resumed\n", variant, resumed, iterations);
+        return 0;
+    }
+    benchReport("tls", variant, iterations, 0, elapsed);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    const size_t sizes[] = { 64, 1024, 16384, 60000 };
+    char certificateFile[] = "/tmp/bench_tls_cert_XXXXXX";
+    char keyFile[] = "/tmp/bench_tls_key_XXXXXX";
+    struct websocket_config config;
+    struct websocket_callbacks callbacks;
+    struct websocket_metrics metrics;
+    int ktls = 0;
+    int ok;
+
+    benchInit(argc, argv);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-k") == 0)
+            ktls = 1;
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            port = atoi(argv[++i]);
+    }
+    wsInitRandom(&generator, 0);
+
+    ok = makeCertificate(certificateFile, keyFile);
+    ok = ok && websocket_tls(certificateFile, keyFile, 1024, ktls) == EXIT_SUCCESS;
+    unlink(certificateFile);
+    unlink(keyFile);
+    if (!ok) {
+        fprintf(stderr, "certificate or key FAILED\n");
+        return EXIT_FAILURE;
+    }
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.onMessage = onMessage;
+    websocket_config_init(&config, port);
+    if (!freopen("/dev/null", "w", stderr) || websocket_start(&config, &callbacks) != EXIT_SUCCESS) {
+        printf("server on port %d FAILED\n", port);
+        return EXIT_FAILURE;
+    }
+
+    // the certificate is the one just made, nothing to verify it against
+    clientContext = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(clientContext, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(clientContext, SSL_SESS_CACHE_CLIENT);
+
+    uint8_t *payload = malloc(sizes[3]);
+    uint8_t *frame = malloc(sizes[3] + WS_MAX_FRAME_HEADER);
+    uint8_t *reply = malloc(sizes[3]);
+    for (size_t i = 0; i < sizes[3]; i++)
+        payload[i] = (uint8_t)(i * 131);
+
+    ok = benchConnections("connect/full", 0, frame, reply)
+         && benchConnections("connect/resumed", 1, frame, reply);
+
+    SSL *ssl = ok ? connectClient(NULL) : NULL;
+    for (size_t s = 0; ssl != NULL && s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t iterations = 0;
+        char variant[32];
+        double start = benchNow();
+        double elapsed;
+        do {
+            if (!echo(ssl, payload, sizes[s], frame, reply)) {
+                printf("echo of %zu bytes FAILED\n", sizes[s]);
+                return EXIT_FAILURE;
+            }
+            iterations++;
+            elapsed = benchNow() - start;
+        } while (elapsed < MIN_SECONDS);
+        snprintf(variant, sizeof(variant), "echo/%zu", sizes[s]);
+        // both ways
+        benchReport("tls", variant, iterations, 2.0 * sizes[s], elapsed);
+    }
+    if (ssl == NULL)
+        return EXIT_FAILURE;
+    closeClient(ssl);
+
+    websocket_metrics(&metrics);
+    if (!benchJson)
+        printf("handshakes %llu, resumed %llu, kernel tls %llu\n",
+               (unsigned long long)metrics.total.tlsHandshakes, (unsigned long long)metrics.total.tlsResumed,
+               (unsigned long long)metrics.total.tlsKernel);
+    free(payload);
+    free(frame);
+    free(reply);
+    SSL_CTX_free(clientContext);
+    return EXIT_SUCCESS;
+}
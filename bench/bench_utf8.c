@@ -0,0 +1,222 @@
+/*
+ * Checks every UTF-8 kernel against the scalar state machine, on valid and
+ * damaged text cut at every position, then measures them. "validate" only
+ * reads the payload; "unmask" unmasks and validates it and masks it again
+ * for the next round, to be compared with "mask", which masks it twice.
+ * "word", the kernel of every target without SSSE3, should beat "scalar"
+ * on every content from 4096 bytes up, not only on ASCII.
+ *
+ *   gcc -O2 -I../include bench_utf8.c ../ws_utf8.c ../ws_mask.c -o bench_utf8 && ./bench_utf8 [-j]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ws_mask.h"
+#include "ws_utf8.h"
+#include "bench.h"
+
+#define MIN_SECONDS 0.2 // every measurement runs at least this long
+
+static const char *kernelNames[] = { "scalar", "word", "ssse3", "avx2" };
+
+static uint32_t seed = 2463534242u;
+
+static uint32_t nextRandom(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static size_t encode(uint32_t codePoint, uint8_t *out)
+{
+    if (codePoint < 0x80) {
+        out[0] = (uint8_t)codePoint;
+        return 1;
+    }
+    if (codePoint < 0x800) {
+        out[0] = (uint8_t)(0xC0 | codePoint >> 6);
+        out[1] = (uint8_t)(0x80 | (codePoint & 0x3F));
+        return 2;
+    }
+    if (codePoint < 0x10000) {
+        out[0] = (uint8_t)(0xE0 | codePoint >> 12);
+        out[1] = (uint8_t)(0x80 | (codePoint >> 6 & 0x3F));
+        out[2] = (uint8_t)(0x80 | (codePoint & 0x3F));
+        return 3;
+    }
+    out[0] = (uint8_t)(0xF0 | codePoint >> 18);
+    out[1] = (uint8_t)(0x80 | (codePoint >> 12 & 0x3F));
+    out[2] = (uint8_t)(0x80 | (codePoint >> 6 & 0x3F));
+    out[3] = (uint8_t)(0x80 | (codePoint & 0x3F));
+    return 4;
+}
+
+/*
+ * Fills text with printable ASCII and, one character in multiByte, a code
+ * point of 2 to 4 bytes; multiByte 0 gives ASCII only, 1 CJK only. Never
+ * ends inside a sequence.
+ */
+static void makeText(uint8_t *text, size_t length, unsigned multiByte)
+{
+    size_t i = 0;
+    while (i + 4 <= length) {
+        uint32_t codePoint;
+        if (multiByte == 0)
+            codePoint = ' ' + nextRandom() % 95;
+        else if (multiByte == 1)
+            codePoint = 0x4E00 + nextRandom() % 0x5000;
+        else if (nextRandom() % multiByte)
+            codePoint = ' ' + nextRandom() % 95;
+        else if (nextRandom() % 3 == 0)
+            codePoint = 0x80 + nextRandom() % 0x780;
+        else if (nextRandom() % 2)
+            codePoint = 0x10000 + nextRandom() % 0x100000;
+        else
+            codePoint = 0xE000 + nextRandom() % 0x2000;
+        i += encode(codePoint, &text[i]);
+    }
+    while (i < length)
+        text[i++] = 'a';
+}
+
+static int validParts(enum wsUtf8Kernel kernel, uint8_t *data, size_t length, size_t cut,
+                      const uint8_t *maskingKey)
+{
+    struct wsUtf8State state;
+    wsInitUtf8(&state);
+    return wsUnmaskUtf8Kernel(kernel, &state, data, cut, maskingKey, 0)
+        && wsUnmaskUtf8Kernel(kernel, &state, data + cut, length - cut, maskingKey, cut)
+        && wsUtf8Complete(&state);
+}
+
+static int verify(enum wsUtf8Kernel kernel)
+{
+    static uint8_t text[300 + 64];
+    static uint8_t masked[300 + 64];
+    static uint8_t actual[300 + 64];
+    const uint8_t maskingKey[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    size_t round, cut, i;
+
+    for (round = 0; round < 3000; round++) {
+        size_t length = nextRandom() % 300;
+        size_t head = nextRandom() % 33;
+        makeText(text + head, length, nextRandom() % 9);
+        // damage half of them: a random byte, or one of the tricky lead bytes
+        if (round & 1 && length) {
+            static const uint8_t damage[] = { 0xC0, 0xC1, 0xE0, 0xED, 0xF0, 0xF4, 0xF5, 0xFF, 0x80, 0xBF };
+            text[head + nextRandom() % length] = nextRandom() % 2 ?
+                (uint8_t)nextRandom() : damage[nextRandom() % sizeof(damage)];
+        }
+        for (i = 0; i < length; i++)
+            masked[head + i] = text[head + i] ^ maskingKey[i & 3];
+        memcpy(actual + head, text + head, length);
+        int expected = validParts(WS_UTF8_SCALAR, actual + head, length, 0, NULL);
+
+        for (cut = 0; cut <= length; cut++) {
+            memcpy(actual + head, text + head, length);
+            if (validParts(kernel, actual + head, length, cut, NULL) != expected) {
+                fprintf(stderr, "%s: wrong result round=%zu length=%zu cut=%zu\n",
+                        kernelNames[kernel], round, length, cut);
+                return 0;
+            }
+            memcpy(actual + head, masked + head, length);
+            if (validParts(kernel, actual + head, length, cut, maskingKey) != expected
+                    || (expected && memcmp(actual + head, text + head, length) != 0)) {
+                fprintf(stderr, "%s: wrong unmasked result round=%zu length=%zu cut=%zu\n",
+                        kernelNames[kernel], round, length, cut);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static void measure(enum wsUtf8Kernel kernel, const char *content, uint8_t *text, size_t size)
+{
+    const uint8_t maskingKey[4] = { 0x12, 0x34, 0x56, 0x78 };
+    struct wsUtf8State state;
+    size_t repeat = (1 << 20) / size; // keeps the clock out of small measurements
+    size_t iterations = 0, i;
+    double start, elapsed;
+    char variant[48];
+
+    snprintf(variant, sizeof(variant), "%s/%s/%zu", kernelNames[kernel], content, size);
+
+    start = benchNow();
+    do {
+        for (i = 0; i < repeat; i++) {
+            wsInitUtf8(&state);
+            if (!wsUnmaskUtf8Kernel(kernel, &state, text, size, NULL, 0))
+                abort();
+        }
+        iterations += repeat;
+    } while ((elapsed = benchNow() - start) < MIN_SECONDS);
+    benchReport("validate", variant, iterations, size, elapsed);
+
+    wsApplyMask(text, size, maskingKey, 0);
+    iterations = 0;
+    start = benchNow();
+    do {
+        for (i = 0; i < repeat; i++) {
+            wsInitUtf8(&state);
+            if (!wsUnmaskUtf8Kernel(kernel, &state, text, size, maskingKey, 0))
+                abort();
+            wsApplyMask(text, size, maskingKey, 0);
+        }
+        iterations += repeat;
+    } while ((elapsed = benchNow() - start) < MIN_SECONDS);
+    benchReport("unmask", variant, iterations, size, elapsed);
+    wsApplyMask(text, size, maskingKey, 0);
+}
+
+int main(int argc, char **argv)
+{
+    const size_t sizes[] = { 64, 4096, 1 << 20 };
+    const struct {
+        const char *name;
+        unsigned multiByte;
+    } contents[] = { { "ascii", 0 }, { "mixed", 8 }, { "cjk", 1 } };
+    const uint8_t maskingKey[4] = { 0x12, 0x34, 0x56, 0x78 };
+    // +1 keeps the payload unaligned, as it is behind a frame header
+    uint8_t *buffer = malloc((1 << 20) + 1);
+    uint8_t *text = buffer + 1;
+    int kernel;
+    size_t c, s;
+
+    benchInit(argc, argv);
+    for (kernel = WS_UTF8_SCALAR; kernel <= WS_UTF8_AVX2; kernel++) {
+        if (wsUtf8KernelSupported(kernel) && !verify(kernel)) {
+            free(buffer);
+            return EXIT_FAILURE;
+        }
+    }
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t repeat = (1 << 20) / sizes[s];
+        size_t iterations = 0, i;
+        double start = benchNow(), elapsed;
+        char variant[32];
+        do {
+            for (i = 0; i < repeat; i++) {
+                wsApplyMask(text, sizes[s], maskingKey, 0);
+                wsApplyMask(text, sizes[s], maskingKey, 0);
+            }
+            iterations += repeat;
+        } while ((elapsed = benchNow() - start) < MIN_SECONDS);
+        snprintf(variant, sizeof(variant), "%zu", sizes[s]);
+        benchReport("mask", variant, iterations, sizes[s], elapsed);
+    }
+    for (c = 0; c < sizeof(contents) / sizeof(contents[0]); c++) {
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            makeText(text, sizes[s], contents[c].multiByte);
+            for (kernel = WS_UTF8_SCALAR; kernel <= WS_UTF8_AVX2; kernel++) {
+                if (wsUtf8KernelSupported(kernel))
+                    measure(kernel, contents[c].name, text, sizes[s]);
+            }
+        }
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
@@ -32,7 +32,7 @@
 #include "websocket.h"
 
 #define PACKET_DUMP
-#include "ws_wrapper.h"
+#include "ws_wrapper_server.h"
 
  /* The examples use simple WiFi configuration that you can set via
    'make menuconfig'.
@@ -99,44 +99,31 @@ static void initialize_wifi(void)
     ESP_ERROR_CHECK( esp_wifi_start() );
 }
 
-void onRecv(const int clientSocket, const char *resource, const char *data, int dataSize, int *returnCode)
+// bound to the connection at the handshake, no resource comparison per message
+static void onEcho(int clientSocket, void *context, enum wsFrameType frameType, const uint8_t *data, size_t dataSize)
 {
-    if (data != NULL)
-    {
-        ESP_LOGI(TAG, "Received data:\n%s", data);
-    }
+    ESP_LOGI(TAG, "Received %d bytes", (int)dataSize);
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = dataSize };
+    websocket_sendv(clientSocket, frameType, &iov, 1);
+}
 
-    if (strcmp(resource, "/echo") == 0)
-    {
-        if (data != NULL)
-        {
-            websocket_send(clientSocket, data, dataSize);
-            
-            /*char* message[20] = {0};
-            sprintf(message, "%f ms", xTaskGetTickCount() / (portTICK_RATE_MS * 1.0));
-            websocket_send(clientSocket, message, strlen(message)+1);*/
-        }
-    }
-    else if (strcmp(resource, "/notecho") == 0)
-    {
-        if (data != NULL)
-        {
-            char *text = "Holà";
-            websocket_send(clientSocket, text, strlen(text));
-        }
-    }
-    else
-    {
-        ESP_LOGE(TAG, "resource %s not supported", resource);
-        *returnCode = EXIT_FAILURE;
-    }
-    
-    *returnCode = EXIT_SUCCESS;
+static void onNotEcho(int clientSocket, void *context, enum wsFrameType frameType, const uint8_t *data, size_t dataSize)
+{
+    char *text = "Holà";
+    websocket_send(clientSocket, text, strlen(text));
 }
 
+static const struct websocket_callbacks echo = { .onMessage = onEcho };
+static const struct websocket_callbacks notEcho = { .onMessage = onNotEcho };
+
 void app_main()
 {
     nvs_flash_init();
     initialize_wifi();
-    websocket_init(PORT, &onRecv);  // Warning: This function creates three FreeRTOS tasks.
+    // other resources get a 404 before the upgrade
+    websocket_route("/echo", &echo);
+    websocket_route("/notecho", &notEcho);
+    struct websocket_config config;
+    websocket_config_init(&config, PORT);
+    websocket_start(&config, NULL);  // Warning: This function creates three FreeRTOS tasks.
 }
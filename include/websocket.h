@@ -36,8 +36,9 @@ extern "C" {
 #include <stdio.h> /* sscanf */
 #include <ctype.h> /* isdigit */
 //#include <stddef.h> /* size_t */
-#include "mbedtls/sha1.h"
-#include "mbedtls/base64.h"
+#include "ws_sha1.h"
+#include "ws_mask.h"
+#include "ws_utf8.h"
 #ifdef __AVR__
     #include <avr/pgmspace.h>
 #else
@@ -68,13 +69,23 @@ static const char originField[] PROGMEM = "Origin: ";
 static const char keyField[] PROGMEM = "Sec-WebSocket-Key: ";
 static const char protocolField[] PROGMEM = "Sec-WebSocket-Protocol: ";
 static const char versionField[] PROGMEM = "Sec-WebSocket-Version: ";
+static const char extensionsField[] PROGMEM = "Sec-WebSocket-Extensions: ";
+static const char permessageDeflate[] PROGMEM = "permessage-deflate";
 static const char version[] PROGMEM = "13";
 static const char secret[] PROGMEM = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
+#define WS_MAX_FRAME_HEADER 14 // 2 + 8 extended payload length + 4 masking key
+#define WS_MAX_HEADERS 32 // header lines kept by wsParseHandshake(), more are parsed but dropped
+#define WS_KEY_LENGTH 24 // base64 of the 16 byte Sec-WebSocket-Key nonce
+#define WS_ACCEPT_LENGTH 28 // base64 of the SHA-1 digest
+#define WS_MAX_HANDSHAKE_ANSWER 320 // 101 response with every permessage-deflate parameter
+#define WS_CLIENT_HANDSHAKE_LENGTH 138 // upgrade request without host and resource
+
 enum wsFrameType { // errors starting from 0xF0
     WS_EMPTY_FRAME = 0xF0,
     WS_ERROR_FRAME = 0xF1,
     WS_INCOMPLETE_FRAME = 0xF2,
+    WS_CONTINUATION_FRAME = 0x00,
     WS_TEXT_FRAME = 0x01,
     WS_BINARY_FRAME = 0x02,
     WS_PING_FRAME = 0x09,
@@ -89,15 +100,106 @@ enum wsState {
     WS_STATE_CLOSING
 };
 
+/*
+ * Resumable frame parser state. Header bytes are copied in as they arrive;
+ * payload bytes stay in the caller's buffer and are unmasked only once.
+ */
+struct wsFrameParser {
+    uint8_t header[WS_MAX_FRAME_HEADER];
+    uint8_t headerLength;
+    uint8_t headerNeeded;
+    uint8_t opcode;
+    uint8_t fin; // of the last frame returned
+    uint8_t fragmentOpcode; // type of the unfinished fragmented message, 0 if none
+    uint8_t rsvAllowed; // RSV bits a negotiated extension may set
+    uint8_t compressed; // RSV1 of the current message
+    uint8_t unmasked; // set after init on the client side: frames come from a server, without key
+    uint8_t validateUtf8; // set after init to check text payloads while they are unmasked
+    uint8_t textMessage; // current message is text
+    struct wsUtf8State utf8; // of the current text message
+    size_t maxPayloadLength;
+    uint64_t payloadLength;
+    uint64_t payloadUnmasked;
+};
+
+/*
+ * Piece of a frame payload handed out by wsParseFrameChunk(), unmasked in
+ * place. The chunk is the last one when offset + length == total.
+ */
+struct wsFrameChunk {
+    uint8_t *data;
+    size_t length;
+    uint64_t offset;
+    uint64_t total;
+};
+
+/*
+ * permessage-deflate parameters (RFC 7692). Used both as the server limits
+ * and as the result of the negotiation.
+ */
+struct wsDeflateParams {
+    uint8_t enabled;
+    uint8_t serverNoContextTakeover;
+    uint8_t clientNoContextTakeover;
+    uint8_t serverMaxWindowBits;
+    uint8_t clientMaxWindowBits;
+    uint8_t serverWindowBitsOffered; // client sent server_max_window_bits
+    uint8_t clientWindowBitsOffered; // client sent client_max_window_bits
+};
+
+/*
+ * Piece of the parsed input, not NUL terminated. Valid as long as the input
+ * buffer given to wsParseHandshake() is.
+ */
+struct wsSlice {
+    const char *data;
+    size_t length;
+};
+
+struct wsHeader {
+    struct wsSlice name;
+    struct wsSlice value; // without surrounding white space
+};
+
+/*
+ * xoshiro128** generator for masking keys and handshake nonces: a few
+ * instructions per key, never blocks. Not thread safe, keep one per thread
+ * or connection.
+ */
+struct wsRandom {
+    uint32_t state[4];
+};
+
+/*
+ * Client side of the opening handshake. The key goes out with the request
+ * and is kept to check the server's answer.
+ */
+struct wsClientHandshake {
+    char key[WS_KEY_LENGTH + 1];
+    char accept[WS_ACCEPT_LENGTH + 1]; // Sec-WebSocket-Accept the server has to send
+    uint16_t status; // of the answer, 101 if the server switched
+    size_t length; // bytes of the answer including the empty line
+};
+
 struct handshake {
-    char *host;
-    char *origin;
-    char *key;
-    char *resource;
+    struct wsSlice method;
+    struct wsSlice resource;
+    struct wsSlice host;
+    struct wsSlice origin;
+    struct wsSlice key;
+    struct wsHeader headers[WS_MAX_HEADERS]; // header lines in order; past the cap Sec-WebSocket-* ones replace the last others
+    uint8_t headerCount;
+    size_t length; // bytes of the request including the empty line
+    struct wsDeflateParams deflate; // accepted offer, answered by wsGetHandshakeAnswer()
     enum wsFrameType frameType;
 };
 
     /**
+     * Parses the upgrade request in one pass, without allocating: every field
+     * of hs points into inputFrame. Header names match in any case. Any
+     * number of header lines is accepted; beyond WS_MAX_HEADERS they are
+     * checked but only Sec-WebSocket-* ones are kept. A Sec-WebSocket-Key
+     * that isn't the base64 of 16 bytes is a WS_ERROR_FRAME.
      * @param inputFrame Pointer to input frame
      * @param inputLength Length of input frame
      * @param hs Cleared with nullHandshake() handshake structure
@@ -107,9 +209,51 @@ struct handshake {
                                       struct handshake *hs);
 	
     /**
+     * @param random Generator to seed
+     * @param seed Any value but 0 for a repeatable sequence; 0 takes the seed
+     * from the platform (hardware RNG on the ESP32, getrandom() on Linux)
+     */
+    void wsInitRandom(struct wsRandom *random, uint64_t seed);
+
+    /**
+     * @param random Seeded generator
+     * @return Next 32 random bits
+     */
+    uint32_t wsNextRandom(struct wsRandom *random);
+
+    /**
+     * Writes the upgrade request of a client, without allocating, and keeps
+     * the key in hs.
+     * @param hs Client handshake to fill
+     * @param random Seeded generator for the key
+     * @param host Host header value, "name:port" unless the port is 80
+     * @param resource Requested path, e.g. "/"
+     * @param outFrame Pointer to frame buffer
+     * @param outLength Length of frame buffer, at least WS_CLIENT_HANDSHAKE_LENGTH plus the
+     * lengths of host and resource. Return length of out frame
+     */
+    void wsMakeClientHandshake(struct wsClientHandshake *hs, struct wsRandom *random,
+                               const char *host, const char *resource,
+                               uint8_t *outFrame, size_t *outLength);
+
+    /**
+     * Checks the server's answer to wsMakeClientHandshake(): status 101, the
+     * upgrade headers and the accept key. As no extension or subprotocol was
+     * asked for, an answer selecting one is refused.
+     * @param inputFrame Pointer to received bytes, frames may follow the answer
+     * @param inputLength Length of received bytes
+     * @param hs Client handshake of the request, status and length are set
+     * once the answer is complete
+     * @return WS_OPENING_FRAME, WS_INCOMPLETE_FRAME or WS_ERROR_FRAME
+     */
+    enum wsFrameType wsParseHandshakeAnswer(const uint8_t *inputFrame, size_t inputLength,
+                                            struct wsClientHandshake *hs);
+
+    /**
+     * Writes the 101 response, without allocating.
      * @param hs Filled handshake structure
      * @param outFrame Pointer to frame buffer
-     * @param outLength Length of frame buffer. Return length of out frame
+     * @param outLength Length of frame buffer, at least WS_MAX_HANDSHAKE_ANSWER. Return length of out frame
      */
     void wsGetHandshakeAnswer(const struct handshake *hs, uint8_t *outFrame,
                               size_t *outLength);
@@ -125,7 +269,48 @@ struct handshake {
                      uint8_t *outFrame, size_t *outLength, enum wsFrameType frameType);
 
     /**
-     *
+     * Builds only the frame header, so the payload can be sent from where it lies.
+     * @param dataLength Length of payload that will follow the header
+     * @param outHeader Pointer to header buffer of at least WS_MAX_FRAME_HEADER bytes
+     * @param frameType [WS_TEXT_FRAME] frame type to build
+     * @return Length of header, 2 to 10 bytes
+     */
+    size_t wsMakeFrameHeader(size_t dataLength, uint8_t *outHeader,
+                             enum wsFrameType frameType);
+
+    /**
+     * Same as wsMakeFrameHeader() for one fragment of a message: the first
+     * fragment has the message type, the following ones WS_CONTINUATION_FRAME.
+     * @param fin TRUE for the last fragment
+     */
+    size_t wsMakeFragmentHeader(size_t dataLength, uint8_t *outHeader,
+                                enum wsFrameType frameType, uint8_t fin);
+
+    /**
+     * Header of a client frame, whose payload has to be masked: the last 4
+     * bytes are a fresh masking key, apply it with
+     * wsApplyMask(payload, dataLength, outHeader + headerLength - 4, 0).
+     * @param dataLength Length of payload that will follow the header
+     * @param outHeader Pointer to header buffer of at least WS_MAX_FRAME_HEADER bytes
+     * @param frameType Message type for the first fragment, WS_CONTINUATION_FRAME afterwards
+     * @param fin TRUE for the last fragment
+     * @param random Seeded generator for the masking key
+     * @return Length of header, 6 to 14 bytes
+     */
+    size_t wsMakeMaskedFragmentHeader(size_t dataLength, uint8_t *outHeader,
+                                      enum wsFrameType frameType, uint8_t fin,
+                                      struct wsRandom *random);
+
+    /**
+     * Same as wsMakeFrame() for a client: the payload is copied and masked.
+     * @param random Seeded generator for the masking key
+     */
+    void wsMakeMaskedFrame(const uint8_t *data, size_t dataLength,
+                           uint8_t *outFrame, size_t *outLength, enum wsFrameType frameType,
+                           struct wsRandom *random);
+
+    /**
+     * Parses one complete, unfragmented frame. Text must be UTF-8.
      * @param inputFrame Pointer to input frame. Frame will be modified.
      * @param inputLen Length of input frame
      * @param outDataPtr Return pointer to extracted data in input frame
@@ -135,13 +320,88 @@ struct handshake {
     enum wsFrameType wsParseInputFrame(uint8_t *inputFrame, size_t inputLength,
                                        uint8_t **dataPtr, size_t *dataLength);
 
+    /**
+     * @param parser Parser to reset before the first frame of a connection
+     * @param maxPayloadLength Frames with bigger payload are rejected as WS_ERROR_FRAME
+     */
+    void wsInitFrameParser(struct wsFrameParser *parser, size_t maxPayloadLength);
+
+    /**
+     * Completes the header of the current frame. Returns at once with nothing
+     * consumed when the header is already complete, so the payload length in
+     * parser->payloadLength can be inspected before choosing how to read it.
+     * @param parser Parser state kept between calls
+     * @param input Pointer to received bytes
+     * @param inputLength Length of received bytes
+     * @param consumed Return number of header bytes taken from input
+     * @return Type of frame, WS_INCOMPLETE_FRAME or WS_ERROR_FRAME
+     */
+    enum wsFrameType wsParseFrameHeader(struct wsFrameParser *parser, const uint8_t *input,
+                                        size_t inputLength, size_t *consumed);
+
+    /**
+     * Parses at most one frame and can be called again with any amount of new
+     * data. Header bytes are consumed as soon as they are seen. Payload bytes
+     * are not consumed until the frame is complete: input must then start at
+     * the first payload byte, and bytes already unmasked are skipped.
+     * Call repeatedly until WS_INCOMPLETE_FRAME to drain pipelined frames.
+     * Fragments come back as their own frames, WS_CONTINUATION_FRAME after
+     * the first one; parser->fin tells whether the message is complete.
+     * With parser->validateUtf8 set, a text message that isn't UTF-8 and a
+     * closing frame whose reason isn't are WS_ERROR_FRAME, found in the same
+     * pass that unmasks them. Compressed messages are left to the caller,
+     * only their inflated bytes can be checked.
+     * @param parser Parser state kept between calls
+     * @param input Pointer to received bytes. Payload will be unmasked in place.
+     * @param inputLength Length of received bytes
+     * @param consumed Return number of bytes the caller may drop from input
+     * @param dataPtr Return pointer to payload of a complete frame
+     * @param dataLength Return length of payload of a complete frame
+     * @return Type of complete frame, WS_INCOMPLETE_FRAME or WS_ERROR_FRAME
+     */
+    enum wsFrameType wsParseFrame(struct wsFrameParser *parser, uint8_t *input,
+                                  size_t inputLength, size_t *consumed,
+                                  uint8_t **dataPtr, size_t *dataLength);
+
+    /**
+     * Streaming variant of wsParseFrame(): every payload byte in input is
+     * unmasked and returned at once, so a frame never has to fit in memory.
+     * maxPayloadLength is not applied. Text is validated as with wsParseFrame(),
+     * a chunk may end inside a sequence the next one finishes.
+     * @param parser Parser state kept between calls
+     * @param input Pointer to received bytes. Payload will be unmasked in place.
+     * @param inputLength Length of received bytes
+     * @param consumed Return number of bytes the caller may drop from input
+     * @param chunk Return payload bytes with their offset and the total payload length
+     * @return Type of frame the chunk belongs to, WS_INCOMPLETE_FRAME or WS_ERROR_FRAME
+     */
+    enum wsFrameType wsParseFrameChunk(struct wsFrameParser *parser, uint8_t *input,
+                                       size_t inputLength, size_t *consumed,
+                                       struct wsFrameChunk *chunk);
+
+    /**
+     * @param hs Parsed handshake structure
+     * @param name Header name, any case
+     * @return Value of the first header called name, NULL if there is none
+     */
+    const struct wsSlice *wsGetHeader(const struct handshake *hs, const char *name);
+
+    /**
+     * Picks the first acceptable permessage-deflate offer of the
+     * Sec-WebSocket-Extensions headers and stores it in hs->deflate.
+     * @param hs Parsed handshake structure
+     * @param limits Largest window sizes the server accepts and its context takeover wishes
+     * @return TRUE if an offer was accepted, hs->deflate.enabled is FALSE otherwise
+     */
+    int wsNegotiateDeflate(struct handshake *hs, const struct wsDeflateParams *limits);
+
     /**
      * @param hs NULL handshake structure
      */
     void nullHandshake(struct handshake *hs);
 
     /**
-     * @param hs free and NULL handshake structure
+     * @param hs NULL handshake structure, nothing is allocated by the parser
      */
     void freeHandshake(struct handshake *hs);
 
@@ -0,0 +1,105 @@
+#ifndef WS_DEFLATE_H
+#define	WS_DEFLATE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#ifdef WS_DEFLATE
+
+#include <zlib.h>
+#ifdef ESP_PLATFORM
+#include "lwip/sockets.h"
+#else
+#include <sys/uio.h>
+#endif
+#include "websocket.h"
+#include "ws_pool.h"
+
+#define WS_DEFLATE_WINDOW 32768 // history a stream refers back to, at most
+
+/*
+ * permessage-deflate state of one connection: a raw deflate stream for
+ * outgoing messages and a raw inflate stream for incoming ones. Memory of
+ * all streams together is limited by the budget given to ws_deflate_init().
+ */
+struct ws_deflate {
+    z_stream deflater;
+    z_stream inflater;
+    uint8_t deflaterReady;
+    uint8_t inflaterReady;
+    size_t reserved; // bytes counted against the global budget
+    struct wsDeflateParams params;
+};
+
+    /**
+     * @param deflate Zeroed state to set up
+     * @param params Negotiated parameters, see wsNegotiateDeflate()
+     * @param memLevel zlib memLevel of the compressor, 1..9
+     * @param memoryBudget Limit for the estimated zlib memory of all connections, 0 for none
+     * @return 0 on success, -1 if the budget is exhausted or zlib failed
+     */
+    int ws_deflate_init(struct ws_deflate *deflate, const struct wsDeflateParams *params,
+                        int memLevel, size_t memoryBudget);
+
+    /**
+     * @param deflate State to free, zeroed afterwards; no-op if never set up
+     */
+    void ws_deflate_free(struct ws_deflate *deflate);
+
+    /**
+     * Compresses one whole message, without the trailing 00 00 ff ff.
+     * @param deflate Connection state
+     * @param pool Pool the output storage comes from
+     * @param iov Message buffers
+     * @param iovcnt Number of buffers
+     * @param out Return compressed payload, zero initialized; release with ws_buffer_release()
+     * @return 0 on success, -1 on error
+     */
+    int ws_deflate_compress(struct ws_deflate *deflate, struct ws_pool *pool,
+                            const struct iovec *iov, int iovcnt, struct ws_buffer *out);
+
+    /**
+     * Decompresses the payload of one frame of a compressed message and appends it.
+     * @param deflate Connection state
+     * @param pool Pool the output storage comes from
+     * @param data Unmasked frame payload
+     * @param dataLength Length of payload
+     * @param fin TRUE for the last frame of the message
+     * @param maxLength Limit for the whole decompressed message
+     * @param out Buffer the message is collected in
+     * @return 0 on success, -1 on corrupt data or if the message grows over maxLength
+     */
+    int ws_deflate_decompress(struct ws_deflate *deflate, struct ws_pool *pool,
+                              const uint8_t *data, size_t dataLength, int fin,
+                              size_t maxLength, struct ws_buffer *out);
+
+    /**
+     * Copies the history one stream refers back to, so that another process
+     * can continue it. Only between messages.
+     * @param deflate Connection state
+     * @param compressor TRUE for the outgoing stream, FALSE for the incoming one
+     * @param window Return up to WS_DEFLATE_WINDOW bytes
+     * @param length Return number of bytes in window
+     * @return 0 on success, -1 if zlib is older than 1.2.9 and can't hand it out
+     */
+    int ws_deflate_get_window(struct ws_deflate *deflate, int compressor, uint8_t *window, size_t *length);
+
+    /**
+     * Continues a stream from history ws_deflate_get_window() copied, right
+     * after ws_deflate_init().
+     * @param deflate Connection state with the same parameters
+     * @param compressor TRUE for the outgoing stream, FALSE for the incoming one
+     * @param window History
+     * @param length Number of bytes in window
+     * @return 0 on success, -1 on error
+     */
+    int ws_deflate_set_window(struct ws_deflate *deflate, int compressor, const uint8_t *window, size_t length);
+
+#endif /* WS_DEFLATE */
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_DEFLATE_H */
@@ -0,0 +1,77 @@
+#ifndef WS_FDTABLE_H
+#define	WS_FDTABLE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WS_FDTABLE_PAGE_BITS 8 // 256 descriptors per page
+#define WS_FDTABLE_PAGE (1 << WS_FDTABLE_PAGE_BITS)
+#ifdef ESP_PLATFORM
+#define WS_FDTABLE_PAGES 1 // lwIP numbers its sockets from LWIP_SOCKET_OFFSET, a few dozen at most
+#else
+#define WS_FDTABLE_PAGES 4096 // 2^20, the most open files Linux allows by default (fs.nr_open)
+#endif
+#define WS_FDTABLE_SIZE (WS_FDTABLE_PAGES * WS_FDTABLE_PAGE)
+
+/*
+ * Pointers indexed by file descriptor. Pages are allocated the first time
+ * one of their descriptors is set and never move or go away before the
+ * table does, so lookups from any thread take two loads and no lock while
+ * other threads set entries. The table costs a pointer per page up front
+ * and a page for every 256 descriptors in use.
+ */
+struct ws_fdtable {
+    void **pages[WS_FDTABLE_PAGES];
+    int end; // descriptors below this may be set
+};
+
+    /**
+     * @param table Table to empty
+     */
+    void ws_fdtable_init(struct ws_fdtable *table);
+
+    /**
+     * @param table Table whose pages are freed, no lookups may run any more
+     */
+    void ws_fdtable_destroy(struct ws_fdtable *table);
+
+    /**
+     * @param table Table to store in
+     * @param fd Descriptor, below WS_FDTABLE_SIZE
+     * @param value Pointer to store, NULL to clear
+     * @return 0, -1 if fd is out of range or its page can't be allocated
+     */
+    int ws_fdtable_set(struct ws_fdtable *table, int fd, void *value);
+
+    /**
+     * Clears the entry of fd only if it still holds value, so a descriptor
+     * number taken over by someone else meanwhile keeps its new entry.
+     * @param table Table to clear in
+     * @param fd Descriptor
+     * @param value Pointer expected in the entry
+     */
+    void ws_fdtable_clear(struct ws_fdtable *table, int fd, void *value);
+
+    /**
+     * Safe from any thread.
+     * @param table Table to look in
+     * @param fd Descriptor, any value
+     * @return Pointer stored for fd, NULL if none
+     */
+    void *ws_fdtable_get(struct ws_fdtable *table, int fd);
+
+    /**
+     * @param table Table to look at
+     * @return Bound of the descriptors set so far, to walk the table
+     */
+    int ws_fdtable_end(struct ws_fdtable *table);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_FDTABLE_H */
@@ -0,0 +1,125 @@
+#ifndef WS_HANDOFF_H
+#define	WS_HANDOFF_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#ifndef ESP_PLATFORM
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "websocket.h"
+
+#define WS_HANDOFF_MAGIC 0x57534846 // "WSHF"
+#define WS_HANDOFF_VERSION 1 // raised whenever a record below changes
+#define WS_HANDOFF_MAX_FDS 253 // descriptors one message carries, the kernel's SCM_MAX_FD
+
+/*
+ * First message from the process handing over, sent with the listening
+ * sockets, one per worker. The connection records follow.
+ */
+struct ws_handoff_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t listeners;
+    uint32_t connections;
+};
+
+/*
+ * One connection, sent with its socket and followed by its sections in the
+ * order of their lengths here. Fixed-width fields, so processes built
+ * from other sources can still read it as long as the version matches.
+ */
+struct ws_handoff_connection {
+    uint64_t payloadLength; // of the frame being parsed
+    uint64_t payloadUnmasked;
+    uint64_t maxMessageSize;
+    uint64_t streamOffset;
+    uint64_t age; // ms since it was accepted
+    uint32_t rxLength; // received bytes not parsed yet
+    uint32_t messageLength; // fragments of the current message
+    uint32_t resourceLength;
+    uint32_t topicsLength; // NUL terminated names
+    uint32_t inflaterLength; // history of the decompressor, see ws_deflate_get_window()
+    uint8_t state; // enum wsState
+    uint8_t established; // onOpen accepted it
+    uint8_t messageType;
+    uint8_t streaming;
+    uint8_t congested;
+    uint8_t closeReason;
+    uint8_t header[WS_MAX_FRAME_HEADER]; // struct wsFrameParser, field by field
+    uint8_t headerLength;
+    uint8_t headerNeeded;
+    uint8_t opcode;
+    uint8_t fin;
+    uint8_t fragmentOpcode;
+    uint8_t rsvAllowed;
+    uint8_t compressed;
+    uint8_t validateUtf8;
+    uint8_t textMessage;
+    uint8_t utf8[3]; // needed, low, high
+    uint8_t deflate[7]; // struct wsDeflateParams, enabled first
+};
+
+/*
+ * Second pass, once the successor acknowledged the first: what each
+ * connection still had to send, in the order of the records. The history
+ * of the compressor follows, then the queued bytes.
+ */
+struct ws_handoff_queue {
+    uint64_t queued;
+    uint32_t deflaterLength;
+    uint32_t reserved;
+};
+
+    /**
+     * Replaces whatever is at path.
+     * @param path Unix socket to listen on
+     * @return Listening socket, -1 on failure
+     */
+    int ws_handoff_listen(const char *path);
+
+    /**
+     * Waits for the successor. Only a process of the same user is accepted.
+     * @param listenSocket Socket from ws_handoff_listen()
+     * @return Channel to the successor, -1 on failure
+     */
+    int ws_handoff_accept(int listenSocket);
+
+    /**
+     * @param path Unix socket the running process listens on
+     * @return Channel to it, -1 if nobody listens there
+     */
+    int ws_handoff_connect(const char *path);
+
+    /**
+     * Sends all of iov, blocking.
+     * @param channel Connected channel
+     * @param iov Data
+     * @param iovcnt Number of iov entries
+     * @param fds Descriptors to pass along with the first byte, duplicated into the receiver
+     * @param fdCount Number of fds, at most WS_HANDOFF_MAX_FDS
+     * @return 0 on success, -1 on failure
+     */
+    int ws_handoff_send(int channel, const struct iovec *iov, int iovcnt, const int *fds, int fdCount);
+
+    /**
+     * Receives exactly length bytes, blocking.
+     * @param channel Connected channel
+     * @param data Where the bytes go
+     * @param length Bytes to receive
+     * @param fds Return descriptors passed with them, close-on-exec
+     * @param maxFds Size of fds; more are closed and fail the call
+     * @return Number of descriptors received, -1 on failure or end of stream
+     */
+    int ws_handoff_recv(int channel, void *data, size_t length, int *fds, int maxFds);
+
+#endif /* ESP_PLATFORM */
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_HANDOFF_H */
@@ -0,0 +1,57 @@
+#ifndef WS_HISTOGRAM_H
+#define	WS_HISTOGRAM_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define WS_HISTOGRAM_SUB_BITS 3 // 8 buckets per power of two, 12.5% apart
+#define WS_HISTOGRAM_MAX_BITS 36 // values up to 2^36, 68 s in nanoseconds
+#define WS_HISTOGRAM_BUCKETS ((WS_HISTOGRAM_MAX_BITS - WS_HISTOGRAM_SUB_BITS + 1) << WS_HISTOGRAM_SUB_BITS)
+
+/*
+ * Log-linear histogram in the style of HdrHistogram: small values are
+ * counted exactly, bigger ones in buckets a fixed fraction apart, so
+ * quantiles keep the same relative precision over the whole range.
+ * Recording is a few instructions and never allocates. Not thread safe,
+ * every event loop records into its own and snapshots merge them.
+ */
+struct ws_histogram {
+    uint64_t counts[WS_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+    /**
+     * @param histogram Histogram to empty
+     */
+    void ws_histogram_init(struct ws_histogram *histogram);
+
+    /**
+     * @param histogram Histogram to count value in
+     * @param value Value, bigger than 2^WS_HISTOGRAM_MAX_BITS goes into the last bucket
+     */
+    void ws_histogram_record(struct ws_histogram *histogram, uint64_t value);
+
+    /**
+     * @param into Histogram to add to
+     * @param from Histogram to add
+     */
+    void ws_histogram_merge(struct ws_histogram *into, const struct ws_histogram *from);
+
+    /**
+     * @param histogram Histogram to look at
+     * @param quantile 0 to 1, e.g. 0.99
+     * @return Upper bound of the bucket holding that quantile, at most the
+     * biggest value recorded; 0 if nothing was recorded
+     */
+    uint64_t ws_histogram_quantile(const struct ws_histogram *histogram, double quantile);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_HISTOGRAM_H */
@@ -0,0 +1,46 @@
+#ifndef WS_MASK_H
+#define	WS_MASK_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum wsMaskKernel {
+    WS_MASK_SCALAR,
+    WS_MASK_WORD,
+    WS_MASK_SSE2,
+    WS_MASK_AVX2
+};
+
+    /**
+     * XORs data with the 4 byte masking key in place, using the fastest
+     * kernel the CPU supports. Masking and unmasking are the same operation.
+     * @param data Pointer to payload bytes, any alignment
+     * @param dataLength Length of payload
+     * @param maskingKey Pointer to the 4 byte masking key
+     * @param keyOffset Position of data[0] in the payload, selects the key byte to start with
+     */
+    void wsApplyMask(uint8_t *data, size_t dataLength, const uint8_t *maskingKey,
+                     size_t keyOffset);
+
+    /**
+     * @param kernel Kernel to check
+     * @return TRUE if kernel is compiled in and supported by this CPU
+     */
+    int wsMaskKernelSupported(enum wsMaskKernel kernel);
+
+    /**
+     * Same as wsApplyMask() with a forced kernel, for tests and benchmarks.
+     * @param kernel Supported kernel, see wsMaskKernelSupported()
+     */
+    void wsApplyMaskKernel(enum wsMaskKernel kernel, uint8_t *data, size_t dataLength,
+                           const uint8_t *maskingKey, size_t keyOffset);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_MASK_H */
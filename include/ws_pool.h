@@ -0,0 +1,115 @@
+#ifndef WS_POOL_H
+#define	WS_POOL_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WS_POOL_MIN_SHIFT 8 // smallest block is 256 bytes
+#define WS_POOL_CLASSES 17 // up to 16 MB, power of two steps
+#define WS_POOL_CACHED 4 // free blocks kept per class
+#define WS_POOL_SLACK 8 // every block is this much bigger than its class, room for a terminator
+
+/*
+ * Size-classed buffer pool. Released blocks are kept on a free list of
+ * their class and handed out again without going through malloc.
+ * Not thread safe, every event loop owns its pool. The memory of all pools
+ * together is counted and can be limited.
+ */
+struct ws_pool {
+    void *freeList[WS_POOL_CLASSES];
+    uint8_t cached[WS_POOL_CLASSES];
+};
+
+/*
+ * Memory of all pools, in bytes.
+ */
+struct ws_pool_stats {
+    size_t used; // blocks handed out
+    size_t cached; // free blocks kept for reuse
+    size_t highWater; // most used and cached at any time
+    size_t budget; // limit of used and cached, 0 for none
+    uint64_t heapAllocs; // blocks that had to come from malloc
+    uint64_t failed; // allocations refused by the budget or malloc
+};
+
+/*
+ * Growable byte buffer whose storage comes from a ws_pool.
+ */
+struct ws_buffer {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+};
+
+    /**
+     * @param pool Pool to initialize
+     */
+    void ws_pool_init(struct ws_pool *pool);
+
+    /**
+     * @param pool Pool whose cached blocks are freed
+     */
+    void ws_pool_destroy(struct ws_pool *pool);
+
+    /**
+     * Cached blocks of the pool are freed first when the budget is reached.
+     * @param pool Pool to take the block from, NULL for a block straight from
+     *             malloc, for threads without a pool of their own
+     * @param size Minimum size of block
+     * @param capacity Return real size of block, to be passed to ws_pool_free()
+     * @return Pointer to block, NULL if size is too big, over budget or out of memory
+     */
+    void *ws_pool_alloc(struct ws_pool *pool, size_t size, size_t *capacity);
+
+    /**
+     * @param pool Pool the block was taken from, NULL to free it right away
+     * @param block Pointer to block, may be NULL
+     * @param capacity Size of block returned by ws_pool_alloc()
+     */
+    void ws_pool_free(struct ws_pool *pool, void *block, size_t capacity);
+
+    /**
+     * @param budget Bytes all pools together may hold, 0 for no limit
+     */
+    void ws_pool_budget(size_t budget);
+
+    /**
+     * @param stats Return memory of all pools
+     */
+    void ws_pool_stats(struct ws_pool_stats *stats);
+
+    /**
+     * Makes room for size bytes in total, keeping the content.
+     * @param pool Pool the buffer storage comes from
+     * @param buffer Buffer, zero initialized before first use
+     * @param size Minimum capacity
+     * @return 0 on success, -1 if out of memory
+     */
+    int ws_buffer_reserve(struct ws_pool *pool, struct ws_buffer *buffer, size_t size);
+
+    /**
+     * Appends data, moving the buffer to a bigger class when needed.
+     * @param pool Pool the buffer storage comes from
+     * @param buffer Buffer, zero initialized before first use
+     * @param data Pointer to data to append
+     * @param length Length of data
+     * @return 0 on success, -1 if out of memory
+     */
+    int ws_buffer_append(struct ws_pool *pool, struct ws_buffer *buffer,
+                         const uint8_t *data, size_t length);
+
+    /**
+     * @param pool Pool the buffer storage comes from
+     * @param buffer Buffer to give back and zero
+     */
+    void ws_buffer_release(struct ws_pool *pool, struct ws_buffer *buffer);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_POOL_H */
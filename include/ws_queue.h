@@ -0,0 +1,114 @@
+#ifndef WS_QUEUE_H
+#define	WS_QUEUE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#ifdef ESP_PLATFORM
+#include "lwip/sockets.h"
+#else
+#include <sys/uio.h>
+#endif
+
+/*
+ * Immutable bytes shared by reference, e.g. one framed broadcast message
+ * sitting in the queues of many connections. Freed with the last reference.
+ */
+struct ws_shared {
+    uint32_t refs;
+    size_t length;
+    size_t capacity; // a queue may append to a buffer nobody else references
+    uint8_t data[];
+};
+
+struct ws_queue_item {
+    struct ws_shared *buffer;
+    size_t offset; // bytes of buffer already written
+    struct ws_queue_item *next;
+};
+
+/*
+ * Outbound queue of one connection: what the socket didn't take yet, in order.
+ * Drained items and one copy buffer are kept for reuse until the queue is
+ * cleared, so a connection that keeps falling behind doesn't call malloc.
+ */
+struct ws_queue {
+    struct ws_queue_item *head;
+    struct ws_queue_item *tail;
+    size_t bytes; // not yet written
+    struct ws_queue_item *spare;
+    int spareCount;
+    struct ws_shared *spareBuffer;
+};
+
+    /**
+     * @param length Size of data
+     * @return Buffer with one reference, NULL if out of memory
+     */
+    struct ws_shared *ws_shared_alloc(size_t length);
+
+    /**
+     * @param shared Buffer to take another reference on
+     * @return shared
+     */
+    struct ws_shared *ws_shared_ref(struct ws_shared *shared);
+
+    /**
+     * @param shared Buffer to drop a reference on, may be NULL
+     */
+    void ws_shared_unref(struct ws_shared *shared);
+
+    /**
+     * @param queue Queue to initialize
+     */
+    void ws_queue_init(struct ws_queue *queue);
+
+    /**
+     * Appends buffer, taking a new reference on it.
+     * @param queue Queue to append to
+     * @param buffer Shared buffer
+     * @param offset Bytes at the start of buffer that are already written
+     * @return 0 on success, -1 if out of memory
+     */
+    int ws_queue_push(struct ws_queue *queue, struct ws_shared *buffer, size_t offset);
+
+    /**
+     * Appends a copy of iov without its first skip bytes. Small copies go
+     * into the room left in the last buffer, so frames queued one by one
+     * are written with few iov entries.
+     * @param queue Queue to append to
+     * @param iov Data to copy
+     * @param iovcnt Number of iov entries
+     * @param skip Bytes at the start of iov that are already written
+     * @return 0 on success, -1 if out of memory
+     */
+    int ws_queue_copy(struct ws_queue *queue, const struct iovec *iov, int iovcnt, size_t skip);
+
+    /**
+     * @param queue Queue to look at
+     * @param iov Return unwritten bytes, oldest first
+     * @param iovcnt Size of iov
+     * @return Number of iov entries filled
+     */
+    int ws_queue_iov(const struct ws_queue *queue, struct iovec *iov, int iovcnt);
+
+    /**
+     * Drops written bytes from the head, releasing finished buffers.
+     * @param queue Queue to consume from
+     * @param written Bytes the socket took
+     */
+    void ws_queue_consume(struct ws_queue *queue, size_t written);
+
+    /**
+     * @param queue Queue to empty, releasing every buffer and what is kept for reuse
+     */
+    void ws_queue_clear(struct ws_queue *queue);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_QUEUE_H */
@@ -0,0 +1,92 @@
+#ifndef WS_RINGBUF_H
+#define	WS_RINGBUF_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ws_pool.h"
+
+/*
+ * Byte ring with free-running head/tail indices over a power of two capacity.
+ * Data is written by recv() straight into the free region and read in place,
+ * so nothing is copied or cleared between messages. Storage comes from a
+ * ws_pool.
+ */
+struct ws_ringbuf {
+    struct ws_pool *pool;
+    uint8_t *buffer;
+    size_t blockSize; // of buffer, capacity and the NUL
+    size_t capacity;
+    size_t maxCapacity;
+    size_t head;
+    size_t tail;
+};
+
+    /**
+     * @param rb Ring buffer to initialize
+     * @param pool Pool the storage comes from, used by the owner's thread only
+     * @param capacity Initial capacity, rounded up to a power of two
+     * @param maxCapacity Capacity the buffer may grow to, rounded up to a power of two
+     * @return 0 on success, -1 if the allocation failed
+     */
+    int ws_ringbuf_init(struct ws_ringbuf *rb, struct ws_pool *pool, size_t capacity, size_t maxCapacity);
+
+    /**
+     * @param rb Ring buffer to release
+     */
+    void ws_ringbuf_free(struct ws_ringbuf *rb);
+
+    /**
+     * @param rb Ring buffer
+     * @return Number of readable bytes
+     */
+    static inline size_t ws_ringbuf_used(const struct ws_ringbuf *rb)
+    {
+        return rb->tail - rb->head;
+    }
+
+    /**
+     * Grows the buffer when it is full and still below maxCapacity.
+     * @param rb Ring buffer
+     * @param length Return length of the contiguous free region, 0 if full at maxCapacity
+     * @return Pointer to the free region
+     */
+    uint8_t *ws_ringbuf_write_ptr(struct ws_ringbuf *rb, size_t *length);
+
+    /**
+     * @param rb Ring buffer
+     * @param length Number of bytes written into the region returned by ws_ringbuf_write_ptr()
+     */
+    void ws_ringbuf_commit(struct ws_ringbuf *rb, size_t length);
+
+    /**
+     * @param rb Ring buffer
+     * @param length Return length of the contiguous readable region
+     * @return Pointer to the readable region
+     */
+    uint8_t *ws_ringbuf_read_ptr(const struct ws_ringbuf *rb, size_t *length);
+
+    /**
+     * Makes every readable byte contiguous, moving them to the start in
+     * place only when they wrap around; the cost depends on the readable
+     * bytes, not the capacity. A NUL byte is kept after the data.
+     * @param rb Ring buffer
+     * @param length Return number of readable bytes
+     * @return Pointer to the readable bytes
+     */
+    uint8_t *ws_ringbuf_linearize(struct ws_ringbuf *rb, size_t *length);
+
+    /**
+     * @param rb Ring buffer
+     * @param length Number of bytes to drop from the head
+     */
+    void ws_ringbuf_consume(struct ws_ringbuf *rb, size_t length);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_RINGBUF_H */
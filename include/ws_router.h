@@ -0,0 +1,84 @@
+#ifndef WS_ROUTER_H
+#define	WS_ROUTER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WS_ROUTER_PARAMS 4 // ":name" segments of one pattern
+
+/*
+ * Node of the route trie, one per path segment. Children are literal
+ * segments, or a parameter matching any one segment.
+ */
+struct ws_route_node {
+    char *segment; // literal, or the parameter name without ':'
+    size_t length;
+    uint8_t param;
+    struct ws_route_node *child; // first child
+    struct ws_route_node *next; // next sibling
+    void *exact; // value of the pattern ending here
+    void *prefix; // value of the pattern ending here with a "*" segment, for this path and all below
+};
+
+struct ws_router {
+    struct ws_route_node root; // above the first segment
+    int count; // patterns added
+};
+
+/*
+ * Where the parameters of a matched pattern are in the path.
+ */
+struct ws_route_param {
+    const char *name; // NUL terminated, owned by the router
+    size_t offset;
+    size_t length;
+};
+
+struct ws_route_match {
+    int params;
+    struct ws_route_param param[WS_ROUTER_PARAMS];
+};
+
+    /**
+     * @param router Router to empty
+     */
+    void ws_router_init(struct ws_router *router);
+
+    /**
+     * @param router Router whose nodes are freed
+     */
+    void ws_router_free(struct ws_router *router);
+
+    /**
+     * Adds a pattern: "/echo" matches that path only; a last segment "*"
+     * makes the pattern match every path below it as well; ":name"
+     * segments, as in "/rooms/:room/chat", match any one segment, which the
+     * match reports. Literal segments win over parameters, and both over a
+     * "*" higher up.
+     * @param router Router to add to
+     * @param pattern Pattern starting with '/'
+     * @param value Value the pattern matches to, not NULL
+     * @return 0, -1 if the pattern is malformed or already added, or out of memory
+     */
+    int ws_router_add(struct ws_router *router, const char *pattern, void *value);
+
+    /**
+     * Matches a path, ignoring a query string, without allocating.
+     * @param router Router to look in
+     * @param path Path starting with '/', need not be NUL terminated
+     * @param length Length of path
+     * @param match Receives the parameters, offsets into path
+     * @return Value of the most specific pattern matching path, NULL if none
+     */
+    void *ws_router_match(const struct ws_router *router, const char *path, size_t length,
+                          struct ws_route_match *match);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_ROUTER_H */
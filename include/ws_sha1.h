@@ -0,0 +1,67 @@
+#ifndef WS_SHA1_H
+#define	WS_SHA1_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * SHA-1 and Base64 for the Sec-WebSocket-Accept key. Pick one backend at
+ * build time: WS_CRYPTO_ESP32 (hardware SHA engine), WS_CRYPTO_MBEDTLS,
+ * WS_CRYPTO_OPENSSL or WS_CRYPTO_BUNDLED (portable, SHA-NI when the CPU
+ * has it). Default is the ESP32 engine on ESP-IDF and bundled elsewhere.
+ */
+#if !defined(WS_CRYPTO_ESP32) && !defined(WS_CRYPTO_MBEDTLS) && \
+    !defined(WS_CRYPTO_OPENSSL) && !defined(WS_CRYPTO_BUNDLED)
+    #ifdef ESP_PLATFORM
+        #define WS_CRYPTO_ESP32
+    #else
+        #define WS_CRYPTO_BUNDLED
+    #endif
+#endif
+
+#define WS_SHA1_LENGTH 20
+
+    /**
+     * @param data Pointer to input data
+     * @param dataLength Length of input data
+     * @param digest Return 20 byte digest
+     */
+    void wsSha1(const uint8_t *data, size_t dataLength, uint8_t *digest);
+
+    /**
+     * @param data Pointer to input data
+     * @param dataLength Length of input data
+     * @param out Return NUL terminated text, 4 * ((dataLength + 2) / 3) + 1 bytes
+     * @return Length of text without the NUL
+     */
+    size_t wsBase64Encode(const uint8_t *data, size_t dataLength, char *out);
+
+#ifdef WS_CRYPTO_BUNDLED
+enum wsSha1Kernel {
+    WS_SHA1_PORTABLE,
+    WS_SHA1_SHANI
+};
+
+    /**
+     * @param kernel Kernel to check
+     * @return TRUE if kernel is compiled in and supported by this CPU
+     */
+    int wsSha1KernelSupported(enum wsSha1Kernel kernel);
+
+    /**
+     * Same as wsSha1() with a forced kernel, for tests and benchmarks.
+     * @param kernel Supported kernel, see wsSha1KernelSupported()
+     */
+    void wsSha1Kernel(enum wsSha1Kernel kernel, const uint8_t *data, size_t dataLength,
+                      uint8_t *digest);
+#endif
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_SHA1_H */
@@ -0,0 +1,88 @@
+#ifndef WS_TIMER_H
+#define	WS_TIMER_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define WS_TIMER_BITS 6 // 64 slots per level
+#define WS_TIMER_SLOTS (1 << WS_TIMER_BITS)
+#define WS_TIMER_LEVELS 6 // 2^36 ticks, two years in milliseconds
+
+/*
+ * Timer embedded in the object it belongs to, pending while linked into
+ * a wheel.
+ */
+struct ws_timer {
+    struct ws_timer *next;
+    struct ws_timer **pprev; // NULL if not pending
+    uint64_t expires; // tick
+    uint8_t level;
+    uint8_t slot;
+};
+
+/*
+ * Hierarchical timer wheel: level n has 64 slots of 64^n ticks each. A
+ * timer goes into the coarsest slot that still tells it apart from now and
+ * moves one level down whenever time reaches the start of its slot, so
+ * adding, cancelling and expiring are O(1) no matter how many timers there
+ * are. Bitmaps of the occupied slots let time skip over empty stretches.
+ * Not thread safe, every event loop owns its wheel.
+ */
+struct ws_timers {
+    uint64_t now; // last tick expired
+    uint64_t occupied[WS_TIMER_LEVELS];
+    struct ws_timer *slots[WS_TIMER_LEVELS][WS_TIMER_SLOTS];
+    struct ws_timer *expired; // due, not yet returned by ws_timer_expire()
+    unsigned count;
+};
+
+    /**
+     * @param timers Wheel to initialize
+     * @param now Current tick
+     */
+    void ws_timer_init(struct ws_timers *timers, uint64_t now);
+
+    /**
+     * Moves the timer if it is already pending.
+     * @param timers Wheel
+     * @param timer Timer to add
+     * @param expires Tick it is due at, ticks already passed mean the next one
+     */
+    void ws_timer_add(struct ws_timers *timers, struct ws_timer *timer, uint64_t expires);
+
+    /**
+     * @param timers Wheel the timer was added to
+     * @param timer Timer to remove, nothing happens if it isn't pending
+     */
+    void ws_timer_cancel(struct ws_timers *timers, struct ws_timer *timer);
+
+    /**
+     * @param timer Timer to look at
+     * @return 1 if it is waiting in a wheel, 0 if not
+     */
+    int ws_timer_pending(const struct ws_timer *timer);
+
+    /**
+     * @param timers Wheel
+     * @return Tick by which ws_timer_expire() has to be called again, at or
+     * before the next timer is due; UINT64_MAX if there is none
+     */
+    uint64_t ws_timer_next(const struct ws_timers *timers);
+
+    /**
+     * Advances the wheel to now and removes one due timer. Call until it
+     * returns NULL; timers may be added or cancelled in between.
+     * @param timers Wheel
+     * @param now Current tick
+     * @return Due timer, no longer pending; NULL if there is none
+     */
+    struct ws_timer *ws_timer_expire(struct ws_timers *timers, uint64_t now);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_TIMER_H */
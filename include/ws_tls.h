@@ -0,0 +1,104 @@
+#ifndef WS_TLS_H
+#define	WS_TLS_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#ifdef WS_TLS
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+#define WS_TLS_RECORD 16384 // plaintext of one record, small buffers are gathered up to it
+
+/*
+ * Certificate, key and session cache of the server, shared by the
+ * connections of all event loops; OpenSSL locks what they share.
+ */
+struct ws_tls_context {
+    SSL_CTX *ctx;
+    BIO_METHOD *socketMethod; // socket BIO that sends with MSG_NOSIGNAL
+};
+
+/*
+ * TLS state of one connection. Reads, writes and the handshake of one
+ * connection must not run at the same time.
+ */
+struct ws_tls {
+    SSL *ssl; // NULL for a plain connection
+    uint8_t established; // handshake done
+    uint8_t resumed; // the client skipped the full handshake
+    uint8_t ktlsSend; // the kernel encrypts, plain writes to the socket are records
+    uint8_t wantWrite; // the last handshake step or read waits for the socket to take data
+    uint8_t failed; // fatal error, no close_notify
+};
+
+    /**
+     * @param context Zeroed context to set up
+     * @param certificateFile PEM certificate chain, the server's certificate first
+     * @param keyFile PEM private key
+     * @param sessionCacheSize Sessions kept for clients resuming by session id, 0 for tickets only
+     * @param ktls TRUE to hand record encryption to the kernel where it supports it
+     * @return 0 on success, -1 if a file can't be loaded or the key doesn't match
+     */
+    int ws_tls_context_init(struct ws_tls_context *context, const char *certificateFile,
+                            const char *keyFile, long sessionCacheSize, int ktls);
+
+    /**
+     * @param context Context to free, zeroed afterwards; no connection may still use it
+     */
+    void ws_tls_context_free(struct ws_tls_context *context);
+
+    /**
+     * @param tls Zeroed state to set up
+     * @param context Server context
+     * @param socket Accepted, non-blocking socket
+     * @return 0 on success, -1 if out of memory
+     */
+    int ws_tls_open(struct ws_tls *tls, struct ws_tls_context *context, int socket);
+
+    /**
+     * Takes the server handshake as far as the socket allows.
+     * @param tls Connection state
+     * @return 1 once established, 0 if it waits for the socket (see wantWrite), -1 on failure
+     */
+    int ws_tls_handshake(struct ws_tls *tls);
+
+    /**
+     * Like recv().
+     * @param tls Established connection
+     * @param buffer Where decrypted data goes
+     * @param length Size of buffer
+     * @return Bytes read, 0 on close_notify or end of stream, -1 with errno (EAGAIN if it waits)
+     */
+    ssize_t ws_tls_read(struct ws_tls *tls, void *buffer, size_t length);
+
+    /**
+     * Like writev(); small buffers are copied into one record, big ones
+     * are written as they are. After -1 with EAGAIN, or a short count, the
+     * next call must start with the bytes that were not taken.
+     * @param tls Established connection
+     * @param iov Buffers
+     * @param iovcnt Number of buffers
+     * @return Bytes written, -1 with errno (EAGAIN if nothing could be written)
+     */
+    ssize_t ws_tls_writev(struct ws_tls *tls, const struct iovec *iov, int iovcnt);
+
+    /**
+     * Sends close_notify if it can without waiting and frees the state; the
+     * socket stays open.
+     * @param tls State to free, zeroed afterwards; no-op for a plain connection
+     */
+    void ws_tls_close(struct ws_tls *tls);
+
+#endif /* WS_TLS */
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_TLS_H */
@@ -0,0 +1,143 @@
+#ifndef WS_URING_H
+#define	WS_URING_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#ifdef WS_USE_URING
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/*
+ * io_uring without liburing: the rings mapped from the kernel, plus one
+ * group of provided receive buffers the kernel picks from, so idle
+ * connections don't hold any.
+ */
+struct ws_uring {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned sqPending; // prepared, not yet published
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+    struct io_uring_buf_ring *bufRing;
+    size_t bufRingSize;
+    uint8_t *buffers;
+    unsigned bufCount;
+    unsigned bufSize;
+};
+
+    /**
+     * @param ring Ring to set up, owned by the calling thread
+     * @param entries Submission queue size, a power of two
+     * @param bufCount Number of provided receive buffers, a power of two
+     * @param bufSize Size of each receive buffer
+     * @return 0 on success, -errno if the kernel lacks what is needed
+     */
+    int ws_uring_init(struct ws_uring *ring, unsigned entries, unsigned bufCount, unsigned bufSize);
+
+    /**
+     * @param ring Ring to tear down, cancelling what is still in flight
+     */
+    void ws_uring_free(struct ws_uring *ring);
+
+    /**
+     * Submits what is queued first when the submission queue is full.
+     * @param ring Ring
+     * @return Cleared entry to prepare, NULL if submitting failed
+     */
+    struct io_uring_sqe *ws_uring_sqe(struct ws_uring *ring);
+
+    /**
+     * Submits every prepared entry with one system call.
+     * @param ring Ring
+     * @param wait Completions to wait for, 0 to return right away
+     * @param timeout Milliseconds to wait at most, -1 for no limit
+     * @return 0 on success or timeout, -errno on failure
+     */
+    int ws_uring_submit(struct ws_uring *ring, unsigned wait, int timeout);
+
+    /**
+     * @param ring Ring
+     * @return Oldest unseen completion, NULL if there is none
+     */
+    struct io_uring_cqe *ws_uring_cqe(struct ws_uring *ring);
+
+    /**
+     * @param ring Ring whose oldest completion is done with
+     */
+    void ws_uring_cqe_seen(struct ws_uring *ring);
+
+    /**
+     * @param ring Ring
+     * @param cqe Completion with IORING_CQE_F_BUFFER set
+     * @return Receive buffer the kernel filled
+     */
+    uint8_t *ws_uring_buffer(struct ws_uring *ring, const struct io_uring_cqe *cqe);
+
+    /**
+     * Gives a receive buffer back to the kernel.
+     * @param ring Ring
+     * @param cqe Completion the buffer came with
+     */
+    void ws_uring_buffer_recycle(struct ws_uring *ring, const struct io_uring_cqe *cqe);
+
+    /**
+     * Accepts connections until cancelled, one completion each.
+     * @param sqe Entry to prepare
+     * @param fd Listening socket
+     * @param flags SOCK_NONBLOCK, SOCK_CLOEXEC for the accepted sockets
+     */
+    void ws_uring_prep_accept(struct io_uring_sqe *sqe, int fd, int flags);
+
+    /**
+     * Receives until the peer closes, each completion in a provided buffer.
+     * @param sqe Entry to prepare
+     * @param fd Connected socket
+     */
+    void ws_uring_prep_recv(struct io_uring_sqe *sqe, int fd);
+
+    /**
+     * @param sqe Entry to prepare
+     * @param fd Connected socket
+     * @param msg Message that stays valid until the completion
+     * @param flags MSG_ flags
+     */
+    void ws_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const void *msg, unsigned flags);
+
+    /**
+     * @param sqe Entry to prepare
+     * @param fd Descriptor to read from
+     * @param buffer Buffer that stays valid until the completion
+     * @param length Size of buffer
+     */
+    void ws_uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buffer, unsigned length);
+
+    /**
+     * Ends a request early, it completes with -ECANCELED unless it is done already.
+     * @param sqe Entry to prepare
+     * @param userData user_data of the request
+     */
+    void ws_uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t userData);
+
+#endif /* WS_USE_URING */
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_URING_H */
@@ -0,0 +1,74 @@
+#ifndef WS_UTF8_H
+#define	WS_UTF8_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum wsUtf8Kernel {
+    WS_UTF8_SCALAR,
+    WS_UTF8_WORD,
+    WS_UTF8_SSSE3,
+    WS_UTF8_AVX2
+};
+
+/*
+ * Where validation stands between calls: the continuation bytes the last
+ * sequence still needs and the range the next one must fall into. A text
+ * message split over fragments or reads keeps one state from its first
+ * byte to its last.
+ */
+struct wsUtf8State {
+    uint8_t needed;
+    uint8_t low;
+    uint8_t high;
+};
+
+    /**
+     * @param state State to reset before the first byte of a message
+     */
+    void wsInitUtf8(struct wsUtf8State *state);
+
+    /**
+     * Unmasks data in place and checks it is UTF-8 as RFC 3629 defines it:
+     * no overlong forms, surrogates or code points above U+10FFFF. Both
+     * happen in one pass over the bytes, using the fastest kernel the CPU
+     * supports; ASCII runs cost little more than the unmasking. data may
+     * end inside a sequence, the next call continues it.
+     * @param state Validation state of the message data belongs to
+     * @param data Pointer to payload bytes, any alignment
+     * @param dataLength Length of payload
+     * @param maskingKey Pointer to the 4 byte masking key, NULL to only validate
+     * @param keyOffset Position of data[0] in the payload, selects the key byte to start with
+     * @return TRUE while the bytes so far are valid; after FALSE data is only partly unmasked
+     */
+    int wsUnmaskUtf8(struct wsUtf8State *state, uint8_t *data, size_t dataLength,
+                     const uint8_t *maskingKey, size_t keyOffset);
+
+    /**
+     * @param state Validation state after the last byte of a message
+     * @return TRUE if the message doesn't end inside a sequence
+     */
+    int wsUtf8Complete(const struct wsUtf8State *state);
+
+    /**
+     * @param kernel Kernel to check
+     * @return TRUE if kernel is compiled in and supported by this CPU
+     */
+    int wsUtf8KernelSupported(enum wsUtf8Kernel kernel);
+
+    /**
+     * Same as wsUnmaskUtf8() with a forced kernel, for tests and benchmarks.
+     * @param kernel Supported kernel, see wsUtf8KernelSupported()
+     */
+    int wsUnmaskUtf8Kernel(enum wsUtf8Kernel kernel, struct wsUtf8State *state, uint8_t *data,
+                           size_t dataLength, const uint8_t *maskingKey, size_t keyOffset);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* WS_UTF8_H */
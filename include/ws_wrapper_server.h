@@ -1,5 +1,12 @@
+#ifndef WS_WRAPPER_SERVER_H
+#define	WS_WRAPPER_SERVER_H
+
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef ESP_PLATFORM
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
@@ -11,10 +18,334 @@
 #include "nvs_flash.h"
 #include "tcpip_adapter.h"
 #include "lwip/sockets.h"
+#else
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) fprintf(stderr, "I (%s) " format "\n", tag, ##__VA_ARGS__)
+#endif
 #include "websocket.h"
+#include "ws_ringbuf.h"
+#include "ws_pool.h"
+#include "ws_deflate.h"
+#include "ws_queue.h"
+#include "ws_uring.h"
+#include "ws_timer.h"
+#include "ws_histogram.h"
+#include "ws_fdtable.h"
+#include "ws_router.h"
+#include "ws_tls.h"
+#include "ws_handoff.h"
 
-#define BUF_LEN 1024 //max: 0xFFFF
+// defaults of struct websocket_config
+#define BUF_LEN 1024 // initial receive buffer of a connection, and each shard's buffer for handshake answers
+#define RX_BUF_MAX 65536 // per connection receive buffer grows from BUF_LEN up to this
+#ifdef ESP_PLATFORM
 #define MAX_SOCKETS 5
+#define LISTEN_BACKLOG MAX_SOCKETS
+#else
+#define MAX_SOCKETS 1024 // of all shards together, raise RLIMIT_NOFILE along with it
+#define LISTEN_BACKLOG SOMAXCONN
+#endif
+#define MAX_MESSAGE_LEN RX_BUF_MAX // default limit of a reassembled fragmented message
+#define EPOLL_BATCH 256 // events taken per epoll_wait
+#define MAX_IOV 16 // buffers per websocket_sendv() message
+#define PUBLISH_STACK 64 // subscribers websocket_publish() copies on the stack, more are allocated
+#define URING_ENTRIES 256 // submission queue of each shard, with WS_USE_URING
+#define URING_BUFFERS 256 // receive buffers of each shard, only connections with data hold one
+#define URING_BUFFER_SIZE 4096
+#define HANDSHAKE_TIMEOUT 10000 // ms to finish the opening and the closing handshake
+
+/*
+ * Why a connection was closed.
+ */
+enum websocket_close_reason {
+    WS_CLOSE_NORMAL, // closing handshake, started by either side
+    WS_CLOSE_HANGUP, // the peer went away without one, or the socket failed
+    WS_CLOSE_PROTOCOL, // malformed handshake, frame or compressed message
+    WS_CLOSE_TOO_BIG, // frame or message over the limit
+    WS_CLOSE_TIMEOUT, // handshake or idle timeout
+    WS_CLOSE_NOT_FOUND, // onOpen refused the resource
+    WS_CLOSE_RESOURCE, // the server ran out of memory or ring entries
+    WS_CLOSE_HANDOFF, // another process took the server over, see websocket_handoff()
+    WS_CLOSE_REASONS
+};
+
+/*
+ * Counters of one shard. The shard updates them while they are read, so a
+ * snapshot may be slightly behind.
+ */
+struct websocket_shard_stats {
+    uint64_t accepted;
+    uint64_t rejected; // table full or out of memory
+    uint64_t closed;
+    uint64_t closeReasons[WS_CLOSE_REASONS]; // closed, by reason
+    uint64_t messages; // passed to onMessage
+    uint64_t framesIn; // data and control frames
+    uint64_t bytesIn;
+    uint64_t framesOut;
+    uint64_t bytesOut; // sent or queued, handshake answers included
+    uint64_t handshakeFailures; // malformed, refused or timed out
+    uint64_t parseErrors; // malformed frames and compressed messages after the handshake
+    uint64_t tlsHandshakes; // completed, with WS_TLS
+    uint64_t tlsResumed; // of tlsHandshakes, without a full handshake
+    uint64_t tlsKernel; // of tlsHandshakes, records encrypted by the kernel
+    int connections; // open right now
+};
+
+/*
+ * Counters of one connection since it was accepted.
+ */
+struct websocket_connection_stats {
+    uint64_t framesIn;
+    uint64_t bytesIn;
+    uint64_t framesOut;
+    uint64_t bytesOut;
+    size_t queued; // waiting for the socket right now
+    uint64_t age; // ms
+};
 
+/*
+ * All shards together. Latencies are in nanoseconds: callback is the time
+ * spent in onMessage or onChunk, reply the time from a recv to the first send,
+ * by any thread, while its data was handled (an answer, a pong or the
+ * handshake answer).
+ */
+struct websocket_metrics {
+    struct websocket_shard_stats total;
+    size_t queued; // bytes in all send queues
+    size_t maxQueued; // longest send queue of one connection
+    struct ws_histogram callbackLatency;
+    struct ws_histogram replyLatency;
+};
+
+/*
+ * Limits and sizes of a server, fixed once it runs. websocket_config_init()
+ * fills in the defaults, change what differs before websocket_start().
+ */
+struct websocket_config {
+    int port;
+    int workers; // event loops, always one on the ESP32
+    const int *cpus; // if not NULL, worker i is pinned to cpus[i]
+    int maxConnections; // of all workers together, more are closed right after accept
+    int backlog; // of each listening socket
+    size_t bufferSize; // initial receive buffer of a connection
+    size_t maxBufferSize; // the receive buffer grows up to this, frames must fit in
+    size_t maxMessageSize; // of a reassembled message, see websocket_set_max_message()
+    size_t memoryBudget; // of all pools, see websocket_memory(); 0 keeps the one set there
+};
+
+/*
+ * Event callbacks, any may be NULL. They run on the event loop serving the
+ * connection and may send. Every connection's context starts as context;
+ * onOpen may set its own, which the later calls for it get.
+ */
+struct websocket_callbacks {
+    void *context;
+    // resource was asked for, EXIT_FAILURE refuses it with a 404
+    int (*onOpen)(int clientSocket, const char *resource, void **context);
+    /*
+     * A whole message, reassembled and inflated, frameType WS_TEXT_FRAME or
+     * WS_BINARY_FRAME. data is borrowed from the receive buffer and valid
+     * until onMessage returns; text is also NUL terminated.
+     */
+    void (*onMessage)(int clientSocket, void *context, enum wsFrameType frameType,
+                      const uint8_t *data, size_t dataSize);
+    // the last call for a connection onOpen accepted
+    void (*onClose)(int clientSocket, void *context, enum websocket_close_reason reason);
+    // all data that had to be queued went out, a producer can go on
+    void (*onWritable)(int clientSocket, void *context);
+    // the queue went past the websocket_watermark() high mark (above 1) or drained to the low one (above 0)
+    void (*onWatermark)(int clientSocket, void *context, int above, size_t queued);
+    /*
+     * Instead of onMessage for frames longer than the websocket_stream()
+     * threshold: dataSize bytes at offset of the message, unmasked in
+     * place, as they arrive. total is 0 until the last fragment starts.
+     */
+    void (*onChunk)(int clientSocket, void *context, enum wsFrameType frameType,
+                    const uint8_t *data, size_t dataSize, uint64_t offset, uint64_t total);
+};
+
+void websocket_config_init(struct websocket_config *config, int port);
+/*
+ * Starts config->workers event loops, each with its own listening socket on
+ * the port (SO_REUSEPORT, the kernel spreads new connections over them),
+ * connections and buffers. Connections are looked up by socket in a table
+ * that grows with the highest descriptor, they cost nothing until accepted.
+ * callbacks may be NULL if websocket_route() covers every resource.
+ * EXIT_FAILURE if the config is inconsistent, the port is taken or a server
+ * already runs.
+ */
+int websocket_start(const struct websocket_config *config, const struct websocket_callbacks *callbacks);
+/*
+ * Shortcuts for websocket_start() with the defaults: websocket_init()
+ * starts one unpinned worker, websocket_init_shards() workers of them.
+ * onRecv(clientSocket, resource, data, dataSize, &returnCode) is called
+ * with data NULL for the handshake, EXIT_FAILURE in returnCode refuses it,
+ * and with every text message. Frames are never streamed to onRecv.
+ */
 void websocket_init(int port, void *onRecv);
-int websocket_send(int clientSocket, const char *buffer, size_t bufferSize);
\ No newline at end of file
+int websocket_init_shards(int port, void *onRecv, int workers, const int *cpus);
+/*
+ * Serves the resources matching pattern, e.g. "/echo" or "/rooms/:room",
+ * or everything below "/files" with a last segment "*" (see
+ * ws_router_add()), with their own callbacks and
+ * context. Once there are routes, a handshake for a resource none matches
+ * gets a 404 as soon as it is parsed; the callbacks passed to
+ * websocket_start() serve every resource only without routes. Routes are
+ * matched once per handshake, the connection keeps its route's callbacks.
+ * Add them before websocket_start().
+ */
+int websocket_route(const char *pattern, const struct websocket_callbacks *callbacks);
+/*
+ * Value of the ":name" segment in the resource of a routed connection, not
+ * NUL terminated, or NULL. Like websocket_resource(), valid until the
+ * connection closes; call it from the connection's callbacks.
+ */
+const char *websocket_route_param(int clientSocket, const char *name, size_t *length);
+const char *websocket_resource(int clientSocket);
+int websocket_shard_count(void);
+int websocket_shard_stats(int shard, struct websocket_shard_stats *stats);
+int websocket_connection_stats(int clientSocket, struct websocket_connection_stats *stats);
+/*
+ * Adds up the counters and histograms of every shard, EXIT_FAILURE before
+ * websocket_init(). The histograms make it a few kilobytes big.
+ */
+int websocket_metrics(struct websocket_metrics *metrics);
+/*
+ * Answers a plain HTTP GET of path (e.g. "/metrics") on the websocket port
+ * with the metrics in the Prometheus text format, then closes the
+ * connection. NULL turns it off, the default. Call before
+ * websocket_start(), EXIT_FAILURE once a server runs.
+ */
+int websocket_metrics_endpoint(const char *path);
+int websocket_send(int clientSocket, const char *buffer, size_t bufferSize);
+int websocket_sendv(int clientSocket, enum wsFrameType frameType, const struct iovec *iov, int iovcnt);
+/*
+ * Sends one fragment: frameType is the message type for the first one and
+ * WS_CONTINUATION_FRAME afterwards, fin is set on the last one.
+ */
+int websocket_send_fragment(int clientSocket, enum wsFrameType frameType, int fin,
+                            const uint8_t *data, size_t dataSize);
+int websocket_send_fragmented(int clientSocket, enum wsFrameType frameType,
+                              const uint8_t *data, size_t dataSize, size_t fragmentSize);
+int websocket_set_max_message(int clientSocket, size_t maxMessageSize);
+/*
+ * Frames with a payload longer than threshold are not buffered but handed to
+ * the onChunk callback of their connection piece by piece as they arrive.
+ * Connections without one buffer them as usual.
+ */
+void websocket_stream(uint64_t threshold);
+/*
+ * Text messages that are not UTF-8 fail the connection, as RFC 6455
+ * requires; the check runs in the pass that unmasks the payload, streamed
+ * chunks and inflated messages included. On by default, 0 hands text to
+ * onMessage unchecked. Applies to connections opened afterwards.
+ */
+void websocket_validate_utf8(int enabled);
+/*
+ * Data a socket can't take right away is queued. The onWatermark callback
+ * of a connection is called once its queue grows past high bytes (above is
+ * 1) and again once it has drained to low (above is 0), so producers can
+ * pause instead of queueing without limit. It runs on the thread whose send
+ * or flush crossed the mark; high 0 turns it off.
+ */
+void websocket_watermark(size_t high, size_t low);
+size_t websocket_queued(int clientSocket);
+/*
+ * Deadlines in milliseconds, 0 turns one off. A client has handshake to
+ * finish the opening handshake and as long to answer a closing frame. One
+ * that sent nothing for ping gets a ping, and another one every ping while
+ * it stays silent; one silent for idle is closed. With ping well below idle
+ * only dead peers are closed, as live ones answer the pings. Pings from
+ * clients are answered right away. Defaults: HANDSHAKE_TIMEOUT, no pings,
+ * no idle limit.
+ */
+void websocket_timeouts(uint32_t handshake, uint32_t ping, uint32_t idle);
+/*
+ * Receive buffers, reassembled and inflated messages and resources come
+ * from size-classed pools; once they are warm, receiving doesn't call malloc.
+ * budget limits the memory of all pools together (0 for no limit): a
+ * connection that needs more is closed instead of taking the heap down.
+ */
+void websocket_memory(size_t budget);
+void websocket_memory_stats(struct ws_pool_stats *stats);
+/*
+ * Every connection is subscribed to the topic named after its resource.
+ * Publishing frames the message once and queues the same buffer on every
+ * subscriber; a socket that can't take it right away gets it when it turns
+ * writable, without holding up the others. These frames are not compressed.
+ * Publish and broadcast return the number of connections reached, -1 if out
+ * of memory.
+ */
+int websocket_subscribe(int clientSocket, const char *topic);
+int websocket_unsubscribe(int clientSocket, const char *topic);
+int websocket_publish(const char *topic, enum wsFrameType frameType, const uint8_t *data, size_t dataSize);
+int websocket_broadcast(enum wsFrameType frameType, const uint8_t *data, size_t dataSize);
+#ifdef WS_DEFLATE
+/*
+ * Offers permessage-deflate (RFC 7692) to clients asking for it, windowBits
+ * 9..15 (0 turns it off). Messages shorter than threshold are sent
+ * uncompressed; connections are not compressed once the zlib memory of all
+ * of them would exceed memoryBudget (0 for no limit).
+ */
+void websocket_deflate(int windowBits, int memLevel, int noContextTakeover,
+                       size_t threshold, size_t memoryBudget);
+#endif
+#ifndef ESP_PLATFORM
+/*
+ * Hands the running server over to a new process without dropping a
+ * client: blocks until the successor connects to the Unix socket at path
+ * (websocket_takeover()), then passes it the listening sockets and every
+ * connection with its receive buffer, parser position, reassembled
+ * fragments, route, topics, compression history and send queue. The event
+ * loops pause meanwhile; sends from other threads go on until the queue
+ * of their connection is handed over and fail afterwards. Connections
+ * are closed here with WS_CLOSE_HANDOFF, onClose is the last call for
+ * them in this process, and the event loops end. TLS connections, and
+ * compressed ones in the middle of a fragmented message, can't be handed
+ * over; they get a closing frame. Call it from a thread of its own, not
+ * from a callback. Returns the number of connections handed over, -1 if
+ * the server isn't running or the successor failed before taking over,
+ * in which case the server just goes on.
+ */
+int websocket_handoff(const char *path);
+/*
+ * Instead of websocket_start() in the new process: takes the server over
+ * from the process waiting in websocket_handoff() at path, with one
+ * worker per listening socket it hands over and config for everything
+ * else. Routes, callbacks and settings must be set up before, as for
+ * websocket_start(). onOpen runs again for every connection that was
+ * open, with its resource, on the event loop now serving it, so the
+ * context can be made anew; refusing it closes the connection, as does a
+ * resource no route matches anymore. EXIT_FAILURE if nobody hands over at
+ * path or the takeover broke off; the old process then goes on serving.
+ */
+int websocket_takeover(const char *path, const struct websocket_config *config,
+                       const struct websocket_callbacks *callbacks);
+#endif
+#ifdef WS_TLS
+/*
+ * Serves wss:// only, with the PEM certificate chain and key; call before
+ * websocket_start(). Clients resume sessions with tickets, or by session id
+ * from a cache of sessionCacheSize entries (0 for tickets only). With ktls,
+ * the kernel encrypts once the handshake is done, if it can (Linux tls
+ * module), and sends go out as they would without TLS. The io_uring loop
+ * falls back to epoll. SIGPIPE handling of the process is left alone, a
+ * peer that is gone shows as a failed send. Returns EXIT_FAILURE if the
+ * files can't be loaded.
+ */
+int websocket_tls(const char *certificateFile, const char *keyFile, long sessionCacheSize, int ktls);
+#endif
+
+#endif	/* WS_WRAPPER_SERVER_H */
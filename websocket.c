@@ -22,46 +22,127 @@
  */
 
 #include "websocket.h"
-
-static char rn[] PROGMEM = "\r\n";
+#ifdef ESP_PLATFORM
+#include "esp_system.h" /* esp_random */
+#elif defined(__linux__)
+#include <sys/random.h> /* getrandom */
+#include <time.h>
+#else
+#include <time.h>
+#endif
 
 void nullHandshake(struct handshake *hs)
 {
-    hs->host = NULL;
-    hs->origin = NULL;
-    hs->resource = NULL;
-    hs->key = NULL;
+    memset(hs, 0, sizeof(*hs));
     hs->frameType = WS_EMPTY_FRAME;
 }
 
 void freeHandshake(struct handshake *hs)
 {
-    if (hs->host) {
-        free(hs->host);
-    }
-    if (hs->origin) {
-        free(hs->origin);
-    }
-    if (hs->resource) {
-        free(hs->resource);
+    nullHandshake(hs);
+}
+
+static char asciiLower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static int equalsNoCase(const char *data, size_t length, const char *name, size_t nameLength)
+{
+    size_t i;
+    if (length != nameLength)
+        return FALSE;
+    for (i = 0; i < length; i++) {
+        if (asciiLower(data[i]) != asciiLower(name[i]))
+            return FALSE;
     }
-    if (hs->key) {
-        free(hs->key);
+    return TRUE;
+}
+
+// field constants end with ": ", only the name part is compared
+static int isField(const struct wsSlice *name, const char *field)
+{
+    return equalsNoCase(name->data, name->length, field, strlen_P(field) - 2);
+}
+
+static const char webSocketPrefix[] PROGMEM = "Sec-WebSocket-";
+
+// Sec-WebSocket-*, the fields kept even past WS_MAX_HEADERS
+static int isWebSocketField(const struct wsSlice *name)
+{
+    size_t prefixLength = strlen_P(webSocketPrefix);
+    return name->length > prefixLength && equalsNoCase(name->data, prefixLength, webSocketPrefix, prefixLength);
+}
+
+// header names end at ':', anything unusual in them just doesn't match a field
+static int isNameChar(char c)
+{
+    return c > ' ' && c < 0x7f && c != ':';
+}
+
+static const char *skipSpaces(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+static const char *trimSpaces(const char *begin, const char *end)
+{
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    return end;
+}
+
+/*
+ * Looks for token in a comma separated header value such as
+ * "keep-alive, Upgrade", in any case.
+ */
+static int hasToken(const struct wsSlice *value, const char *token)
+{
+    const char *item = value->data;
+    const char *end = value->data + value->length;
+    while (1) {
+        const char *comma = memchr(item, ',', end - item);
+        const char *itemEnd = comma ? comma : end;
+        item = skipSpaces(item, itemEnd);
+        if (equalsNoCase(item, trimSpaces(item, itemEnd) - item, token, strlen_P(token)))
+            return TRUE;
+        if (!comma)
+            return FALSE;
+        item = comma + 1;
     }
-    nullHandshake(hs);
 }
 
-static char* getUptoLinefeed(const char *startFrom)
+static int isBase64Char(char c)
 {
-    char *writeTo = NULL;
-    uint8_t newLength = strstr_P(startFrom, rn) - startFrom;
-    assert(newLength);
-    writeTo = (char *)malloc(newLength+1); //+1 for '\x00'
-    assert(writeTo);
-    memcpy(writeTo, startFrom, newLength);
-    writeTo[ newLength ] = 0;
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')
+           || c == '+' || c == '/';
+}
+
+// base64 of a 16 byte nonce: 22 characters and "=="
+static int isNonceKey(const struct wsSlice *key)
+{
+    size_t i;
+    if (key->length != WS_KEY_LENGTH || memcmp(key->data + WS_KEY_LENGTH - 2, "==", 2) != 0)
+        return FALSE;
+    for (i = 0; i < WS_KEY_LENGTH - 2; i++) {
+        if (!isBase64Char(key->data[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
 
-    return writeTo;
+/*
+ * Returns the '\n' ending the line at p, NULL if the line is not complete.
+ * Sets *error if the line doesn't end with "\r\n".
+ */
+static const char *findLineFeed(const char *p, const char *end, uint8_t *error)
+{
+    const char *lineFeed = memchr(p, '\n', end - p);
+    if (lineFeed && (lineFeed == p || lineFeed[-1] != '\r'))
+        *error = TRUE;
+    return lineFeed;
 }
 
 enum wsFrameType wsParseHandshake(const uint8_t *inputFrame, size_t inputLength,
@@ -69,140 +150,497 @@ enum wsFrameType wsParseHandshake(const uint8_t *inputFrame, size_t inputLength,
 {
     const char *inputPtr = (const char *)inputFrame;
     const char *endPtr = (const char *)inputFrame + inputLength;
+    uint8_t error = FALSE;
 
-    if (!strstr((const char *)inputFrame, "\r\n\r\n"))
+    // request line: GET <resource> HTTP/1.1
+    const char *lineFeed = findLineFeed(inputPtr, endPtr, &error);
+    if (!lineFeed)
         return WS_INCOMPLETE_FRAME;
-	
-    if (memcmp_P(inputFrame, PSTR("GET "), 4) != 0)
+    if (error)
         return WS_ERROR_FRAME;
-    // measure resource size
-    char *first = strchr((const char *)inputFrame, ' ');
-    if (!first)
+    const char *lineEnd = lineFeed - 1;
+
+    const char *space = memchr(inputPtr, ' ', lineEnd - inputPtr);
+    if (!space)
         return WS_ERROR_FRAME;
-    first++;
-    char *second = strchr(first, ' ');
-    if (!second)
+    hs->method.data = inputPtr;
+    hs->method.length = space - inputPtr;
+    hs->resource.data = space + 1;
+    space = memchr(hs->resource.data, ' ', lineEnd - hs->resource.data);
+    if (!space || space == hs->resource.data)
         return WS_ERROR_FRAME;
-
-    if (hs->resource) {
-        free(hs->resource);
-        hs->resource = NULL;
-    }
-    hs->resource = (char *)malloc(second - first + 1); // +1 is for \x00 symbol
-    assert(hs->resource);
-
-    if (sscanf_P(inputPtr, PSTR("GET %s HTTP/1.1\r\n"), hs->resource) != 1)
+    hs->resource.length = space - hs->resource.data;
+    if (hs->method.length != 3 || memcmp_P(hs->method.data, PSTR("GET"), 3) != 0)
         return WS_ERROR_FRAME;
-    inputPtr = strstr_P(inputPtr, rn) + 2;
+    if (lineEnd - (space + 1) != 8 || memcmp_P(space + 1, PSTR("HTTP/1.1"), 8) != 0)
+        return WS_ERROR_FRAME;
+    inputPtr = lineFeed + 1;
 
     /*
-        parse next lines
+        parse next lines, up to the empty one
      */
-    #define prepare(x) do {if (x) { free(x); x = NULL; }} while(0)
-    #define strtolower(x) do { int i; for (i = 0; (unsigned char)x[i]; i++) x[i] = tolower((unsigned char)x[i]); } while(0)
     uint8_t connectionFlag = FALSE;
     uint8_t upgradeFlag = FALSE;
     uint8_t subprotocolFlag = FALSE;
     uint8_t versionMismatch = FALSE;
-    while (inputPtr < endPtr && inputPtr[0] != '\r' && inputPtr[1] != '\n') {
-        if (memcmp_P(inputPtr, hostField, strlen_P(hostField)) == 0) {
-            inputPtr += strlen_P(hostField);
-            prepare(hs->host);
-            hs->host = getUptoLinefeed(inputPtr);
+    hs->headerCount = 0;
+    while (1) {
+        lineFeed = findLineFeed(inputPtr, endPtr, &error);
+        if (!lineFeed)
+            return WS_INCOMPLETE_FRAME;
+        if (error)
+            return WS_ERROR_FRAME;
+        lineEnd = lineFeed - 1;
+        if (lineEnd == inputPtr)
+            break;
+
+        // name ":" OWS value OWS, folded lines are not accepted
+        const char *p = inputPtr;
+        while (p < lineEnd && isNameChar(*p))
+            p++;
+        if (p == inputPtr || p == lineEnd || *p != ':')
+            return WS_ERROR_FRAME;
+        // past WS_MAX_HEADERS a line is still checked below, but not kept
+        struct wsHeader overflow;
+        struct wsHeader *header = &overflow;
+        if (hs->headerCount < WS_MAX_HEADERS)
+            header = &hs->headers[hs->headerCount++];
+        header->name.data = inputPtr;
+        header->name.length = p - inputPtr;
+        header->value.data = skipSpaces(p + 1, lineEnd);
+        header->value.length = trimSpaces(header->value.data, lineEnd) - header->value.data;
+        if (header == &overflow && isWebSocketField(&overflow.name)) {
+            // proxies add lines, the handshake's own take the place of the last other one
+            int i = hs->headerCount;
+            while (--i >= 0 && isWebSocketField(&hs->headers[i].name))
+                ;
+            if (i >= 0)
+                hs->headers[i] = overflow;
+        }
+
+        const struct wsSlice *name = &header->name;
+        const struct wsSlice *value = &header->value;
+        if (isField(name, hostField)) {
+            hs->host = *value;
         } else
-        if (memcmp_P(inputPtr, originField, strlen_P(originField)) == 0) {
-            inputPtr += strlen_P(originField);
-            prepare(hs->origin);
-            hs->origin = getUptoLinefeed(inputPtr);
+        if (isField(name, originField)) {
+            hs->origin = *value;
         } else
-        if (memcmp_P(inputPtr, protocolField, strlen_P(protocolField)) == 0) {
-            inputPtr += strlen_P(protocolField);
+        if (isField(name, protocolField)) {
             subprotocolFlag = TRUE;
         } else
-        if (memcmp_P(inputPtr, keyField, strlen_P(keyField)) == 0) {
-            inputPtr += strlen_P(keyField);
-            prepare(hs->key);
-            hs->key = getUptoLinefeed(inputPtr);
+        if (isField(name, keyField)) {
+            hs->key = *value;
         } else
-        if (memcmp_P(inputPtr, versionField, strlen_P(versionField)) == 0) {
-            inputPtr += strlen_P(versionField);
-            char *versionString = NULL;
-            versionString = getUptoLinefeed(inputPtr);
-            if (memcmp_P(versionString, version, strlen_P(version)) != 0)
+        if (isField(name, versionField)) {
+            if (value->length != strlen_P(version)
+                || memcmp_P(value->data, version, value->length) != 0)
                 versionMismatch = TRUE;
-            free(versionString);
         } else
-        if (memcmp_P(inputPtr, connectionField, strlen_P(connectionField)) == 0) {
-            inputPtr += strlen_P(connectionField);
-            char *connectionValue = NULL;
-            connectionValue = getUptoLinefeed(inputPtr);
-            strtolower(connectionValue);
-            assert(connectionValue);
-            if (strstr_P(connectionValue, upgrade) != NULL)
+        if (isField(name, connectionField)) {
+            if (hasToken(value, upgrade))
                 connectionFlag = TRUE;
-            free(connectionValue);
         } else
-        if (memcmp_P(inputPtr, upgradeField, strlen_P(upgradeField)) == 0) {
-            inputPtr += strlen_P(upgradeField);
-            char *compare = NULL;
-            compare = getUptoLinefeed(inputPtr);
-            strtolower(compare);
-            assert(compare);
-            if (memcmp_P(compare, websocket, strlen_P(websocket)) == 0)
+        if (isField(name, upgradeField)) {
+            if (hasToken(value, websocket))
                 upgradeFlag = TRUE;
-            free(compare);
-        };
+        }
 
-        inputPtr = strstr_P(inputPtr, rn) + 2;
+        inputPtr = lineFeed + 1;
     }
+    hs->length = lineFeed + 1 - (const char *)inputFrame;
 
     // we have read all data, so check them
-    if (!hs->host || !hs->key || !connectionFlag || !upgradeFlag || subprotocolFlag
-        || versionMismatch)
+    if (!hs->host.data || !isNonceKey(&hs->key) || !connectionFlag || !upgradeFlag
+        || subprotocolFlag || versionMismatch)
     {
         hs->frameType = WS_ERROR_FRAME;
     } else {
         hs->frameType = WS_OPENING_FRAME;
     }
-    
+
     return hs->frameType;
 }
 
-void wsGetHandshakeAnswer(const struct handshake *hs, uint8_t *outFrame, 
+const struct wsSlice *wsGetHeader(const struct handshake *hs, const char *name)
+{
+    size_t nameLength = strlen(name);
+    int i;
+    for (i = 0; i < hs->headerCount; i++) {
+        const struct wsSlice *headerName = &hs->headers[i].name;
+        if (equalsNoCase(headerName->data, headerName->length, name, nameLength))
+            return &hs->headers[i].value;
+    }
+    return NULL;
+}
+
+// constant part of the 101 response, fields follow in the order written
+static const char answerStart[] PROGMEM = "HTTP/1.1 101 Switching Protocols\r\n"
+                                          "Upgrade: websocket\r\n"
+                                          "Connection: Upgrade\r\n";
+static const char acceptField[] PROGMEM = "Sec-WebSocket-Accept: ";
+static const char answerEnd[] PROGMEM = "\r\n\r\n";
+static const char rn[] PROGMEM = "\r\n";
+static const char serverNoContextTakeover[] PROGMEM = "; server_no_context_takeover";
+static const char clientNoContextTakeover[] PROGMEM = "; client_no_context_takeover";
+static const char serverMaxWindowBits[] PROGMEM = "; server_max_window_bits=";
+static const char clientMaxWindowBits[] PROGMEM = "; client_max_window_bits=";
+
+// text must be an array, not a pointer
+#define appendText(out, text) (memcpy_P((out), (text), sizeof(text) - 1), (out) + sizeof(text) - 1)
+
+static uint8_t *appendWindowBits(uint8_t *out, uint8_t bits)
+{
+    if (bits >= 10)
+        *out++ = '0' + bits / 10;
+    *out++ = '0' + bits % 10;
+    return out;
+}
+
+// accept key: base64(sha1(key + secret)), all on the stack
+static void makeAcceptKey(const char *key, char *accept)
+{
+    uint8_t keyBuffer[WS_KEY_LENGTH + sizeof(secret) - 1];
+    uint8_t shaHash[WS_SHA1_LENGTH];
+    memcpy(keyBuffer, key, WS_KEY_LENGTH);
+    memcpy_P(keyBuffer + WS_KEY_LENGTH, secret, sizeof(secret) - 1);
+    wsSha1(keyBuffer, sizeof(keyBuffer), shaHash);
+    wsBase64Encode(shaHash, sizeof(shaHash), accept);
+}
+
+void wsGetHandshakeAnswer(const struct handshake *hs, uint8_t *outFrame,
                           size_t *outLength)
 {
-    assert(outFrame && *outLength);
+    assert(outFrame && *outLength >= WS_MAX_HANDSHAKE_ANSWER);
     assert(hs->frameType == WS_OPENING_FRAME);
-    assert(hs && hs->key);
-
-    char *responseKey = NULL;
-    uint8_t length = strlen(hs->key)+strlen_P(secret);
-    responseKey = malloc(length);
-    memcpy(responseKey, hs->key, strlen(hs->key));
-    memcpy_P(&(responseKey[strlen(hs->key)]), secret, strlen_P(secret));
-    unsigned char shaHash[20];
-    memset(shaHash, 0, sizeof(shaHash));
-    mbedtls_sha1((unsigned char*)responseKey, length, shaHash);
-    size_t base64Length = 0;
-    mbedtls_base64_encode((unsigned char*)responseKey, length, &base64Length, shaHash, 20);
-
-    responseKey[base64Length] = '\0';
-    
-    int written = sprintf_P((char *)outFrame,
-                            PSTR("HTTP/1.1 101 Switching Protocols\r\n"
-                                 "%s%s\r\n"
-                                 "%s%s\r\n"
-                                 "Sec-WebSocket-Accept: %s\r\n\r\n"),
-                            upgradeField,
-                            websocket,
-                            connectionField,
-                            upgrade2,
-                            responseKey);
-	
-    free(responseKey);
-    // if assert fail, that means, that we corrupt memory
-    assert(written <= *outLength);
-    *outLength = written;
+    assert(hs && hs->key.length == WS_KEY_LENGTH);
+
+    char responseKey[WS_ACCEPT_LENGTH + 1];
+    makeAcceptKey(hs->key.data, responseKey);
+
+    uint8_t *out = appendText(outFrame, answerStart);
+    if (hs->deflate.enabled) {
+        const struct wsDeflateParams *deflate = &hs->deflate;
+        out = appendText(out, extensionsField);
+        out = appendText(out, permessageDeflate);
+        if (deflate->serverNoContextTakeover)
+            out = appendText(out, serverNoContextTakeover);
+        if (deflate->clientNoContextTakeover)
+            out = appendText(out, clientNoContextTakeover);
+        if (deflate->serverWindowBitsOffered) {
+            out = appendText(out, serverMaxWindowBits);
+            out = appendWindowBits(out, deflate->serverMaxWindowBits);
+        }
+        if (deflate->clientWindowBitsOffered) {
+            out = appendText(out, clientMaxWindowBits);
+            out = appendWindowBits(out, deflate->clientMaxWindowBits);
+        }
+        out = appendText(out, rn);
+    }
+    out = appendText(out, acceptField);
+    memcpy(out, responseKey, WS_ACCEPT_LENGTH);
+    out += WS_ACCEPT_LENGTH;
+    out = appendText(out, answerEnd);
+
+    *outLength = out - outFrame;
+}
+
+static uint32_t rotate(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+// splitmix64, spreads any seed over the whole state
+static uint64_t splitMix(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t platformSeed(struct wsRandom *random)
+{
+    uint64_t seed = 0;
+#ifdef ESP_PLATFORM
+    seed = ((uint64_t)esp_random() << 32) | esp_random();
+#else
+#ifdef __linux__
+    // never blocks, fails only before the kernel's pool is initialized
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed))
+        return seed;
+#endif
+    // no entropy source: time and address, better than a constant
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seed = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ (uint64_t)(uintptr_t)random;
+#endif
+    return seed;
+}
+
+void wsInitRandom(struct wsRandom *random, uint64_t seed)
+{
+    if (seed == 0)
+        seed = platformSeed(random);
+    uint64_t a = splitMix(&seed);
+    uint64_t b = splitMix(&seed);
+    random->state[0] = (uint32_t)a;
+    random->state[1] = (uint32_t)(a >> 32);
+    random->state[2] = (uint32_t)b;
+    random->state[3] = (uint32_t)(b >> 32);
+    // the all zero state would repeat itself
+    if (!(random->state[0] | random->state[1] | random->state[2] | random->state[3]))
+        random->state[0] = 1;
+}
+
+uint32_t wsNextRandom(struct wsRandom *random)
+{
+    uint32_t *state = random->state;
+    uint32_t result = rotate(state[1] * 5, 7) * 9;
+    uint32_t t = state[1] << 9;
+
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotate(state[3], 11);
+    return result;
+}
+
+static const char requestStart[] PROGMEM = "GET ";
+static const char requestVersion[] PROGMEM = " HTTP/1.1\r\n";
+static const char requestHeaders[] PROGMEM = "Upgrade: websocket\r\n"
+                                             "Connection: Upgrade\r\n";
+static const char requestVersionField[] PROGMEM = "Sec-WebSocket-Version: 13\r\n\r\n";
+static const char answerStatus[] PROGMEM = "HTTP/1.1 ";
+
+void wsMakeClientHandshake(struct wsClientHandshake *hs, struct wsRandom *random,
+                           const char *host, const char *resource,
+                           uint8_t *outFrame, size_t *outLength)
+{
+    size_t hostLength = strlen(host);
+    size_t resourceLength = strlen(resource);
+    assert(outFrame && *outLength >= WS_CLIENT_HANDSHAKE_LENGTH + hostLength + resourceLength);
+
+    // the key is a base64 encoded 16 byte nonce
+    uint8_t nonce[16];
+    int i;
+    for (i = 0; i < 16; i += 4) {
+        uint32_t bits = wsNextRandom(random);
+        memcpy(nonce + i, &bits, 4);
+    }
+    wsBase64Encode(nonce, sizeof(nonce), hs->key);
+    makeAcceptKey(hs->key, hs->accept);
+    hs->status = 0;
+    hs->length = 0;
+
+    uint8_t *out = appendText(outFrame, requestStart);
+    memcpy(out, resource, resourceLength);
+    out += resourceLength;
+    out = appendText(out, requestVersion);
+    out = appendText(out, hostField);
+    memcpy(out, host, hostLength);
+    out += hostLength;
+    out = appendText(out, rn);
+    out = appendText(out, requestHeaders);
+    out = appendText(out, keyField);
+    memcpy(out, hs->key, WS_KEY_LENGTH);
+    out += WS_KEY_LENGTH;
+    out = appendText(out, rn);
+    out = appendText(out, requestVersionField);
+
+    *outLength = out - outFrame;
+}
+
+enum wsFrameType wsParseHandshakeAnswer(const uint8_t *inputFrame, size_t inputLength,
+                                        struct wsClientHandshake *hs)
+{
+    const char *inputPtr = (const char *)inputFrame;
+    const char *endPtr = (const char *)inputFrame + inputLength;
+    uint8_t error = FALSE;
+
+    // status line: HTTP/1.1 <code> <reason>
+    const char *lineFeed = findLineFeed(inputPtr, endPtr, &error);
+    if (!lineFeed)
+        return WS_INCOMPLETE_FRAME;
+    const char *lineEnd = lineFeed - 1;
+    size_t statusLength = strlen_P(answerStatus);
+    if (error || (size_t)(lineEnd - inputPtr) < statusLength + 3
+        || memcmp_P(inputPtr, answerStatus, statusLength) != 0)
+        return WS_ERROR_FRAME;
+    const char *code = inputPtr + statusLength;
+    if (!isdigit((unsigned char)code[0]) || !isdigit((unsigned char)code[1])
+        || !isdigit((unsigned char)code[2]) || (code + 3 < lineEnd && code[3] != ' '))
+        return WS_ERROR_FRAME;
+    uint16_t status = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+    inputPtr = lineFeed + 1;
+
+    uint8_t connectionFlag = FALSE;
+    uint8_t upgradeFlag = FALSE;
+    uint8_t acceptFlag = FALSE;
+    uint8_t unrequested = FALSE;
+    while (1) {
+        lineFeed = findLineFeed(inputPtr, endPtr, &error);
+        if (!lineFeed)
+            return WS_INCOMPLETE_FRAME;
+        if (error)
+            return WS_ERROR_FRAME;
+        lineEnd = lineFeed - 1;
+        if (lineEnd == inputPtr)
+            break;
+
+        const char *p = inputPtr;
+        while (p < lineEnd && isNameChar(*p))
+            p++;
+        if (p == inputPtr || p == lineEnd || *p != ':')
+            return WS_ERROR_FRAME;
+        struct wsSlice name = { inputPtr, (size_t)(p - inputPtr) };
+        struct wsSlice value;
+        value.data = skipSpaces(p + 1, lineEnd);
+        value.length = trimSpaces(value.data, lineEnd) - value.data;
+
+        if (isField(&name, acceptField)) {
+            acceptFlag = value.length == WS_ACCEPT_LENGTH
+                         && memcmp(value.data, hs->accept, WS_ACCEPT_LENGTH) == 0;
+        } else
+        if (isField(&name, connectionField)) {
+            if (hasToken(&value, upgrade))
+                connectionFlag = TRUE;
+        } else
+        if (isField(&name, upgradeField)) {
+            if (hasToken(&value, websocket))
+                upgradeFlag = TRUE;
+        } else
+        if (isField(&name, extensionsField) || isField(&name, protocolField)) {
+            unrequested = TRUE;
+        }
+
+        inputPtr = lineFeed + 1;
+    }
+    hs->status = status;
+    hs->length = lineFeed + 1 - (const char *)inputFrame;
+
+    if (status != 101 || !connectionFlag || !upgradeFlag || !acceptFlag || unrequested)
+        return WS_ERROR_FRAME;
+    return WS_OPENING_FRAME;
+}
+
+static int matchToken(const char *token, size_t tokenLength, const char *name)
+{
+    return tokenLength == strlen(name) && memcmp(token, name, tokenLength) == 0;
+}
+
+/*
+ * One offer: "permessage-deflate; param; param=value", values may be quoted.
+ * Unknown, repeated or out of range parameters decline the offer.
+ */
+static int acceptDeflateOffer(const char *p, const char *end, const struct wsDeflateParams *limits,
+                              struct wsDeflateParams *accepted)
+{
+    memset(accepted, 0, sizeof(*accepted));
+    accepted->serverMaxWindowBits = limits->serverMaxWindowBits;
+    accepted->clientMaxWindowBits = 15;
+
+    p = skipSpaces(p, end);
+    size_t nameLength = strlen_P(permessageDeflate);
+    if ((size_t)(end - p) < nameLength || memcmp_P(p, permessageDeflate, nameLength) != 0)
+        return FALSE;
+    p = skipSpaces(p + nameLength, end);
+
+    uint8_t seen = 0;
+    while (p < end) {
+        if (*p != ';')
+            return FALSE;
+        p = skipSpaces(p + 1, end);
+        const char *token = p;
+        while (p < end && *p != '=' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        size_t tokenLength = p - token;
+        p = skipSpaces(p, end);
+
+        int value = -1;
+        if (p < end && *p == '=') {
+            p = skipSpaces(p + 1, end);
+            uint8_t quoted = p < end && *p == '"';
+            if (quoted)
+                p++;
+            if (p == end || !isdigit((unsigned char)*p))
+                return FALSE;
+            value = 0;
+            while (p < end && isdigit((unsigned char)*p) && value < 100)
+                value = value * 10 + (*p++ - '0');
+            if (quoted && (p == end || *p++ != '"'))
+                return FALSE;
+            p = skipSpaces(p, end);
+        }
+
+        uint8_t bit;
+        if (matchToken(token, tokenLength, "server_no_context_takeover") && value == -1) {
+            bit = 0x01;
+            accepted->serverNoContextTakeover = TRUE;
+        } else if (matchToken(token, tokenLength, "client_no_context_takeover") && value == -1) {
+            bit = 0x02;
+            accepted->clientNoContextTakeover = TRUE;
+        } else if (matchToken(token, tokenLength, "server_max_window_bits") && value >= 8 && value <= 15) {
+            bit = 0x04;
+            accepted->serverWindowBitsOffered = TRUE;
+            if (value < accepted->serverMaxWindowBits)
+                accepted->serverMaxWindowBits = value;
+        } else if (matchToken(token, tokenLength, "client_max_window_bits")
+                   && (value == -1 || (value >= 8 && value <= 15))) {
+            bit = 0x08;
+            // the client lets us pick its window, up to value
+            accepted->clientWindowBitsOffered = TRUE;
+            accepted->clientMaxWindowBits = value == -1 ? 15 : value;
+            if (limits->clientMaxWindowBits < accepted->clientMaxWindowBits)
+                accepted->clientMaxWindowBits = limits->clientMaxWindowBits;
+        } else {
+            return FALSE;
+        }
+        if (seen & bit)
+            return FALSE;
+        seen |= bit;
+    }
+
+    // zlib's raw deflate has no 256 byte window
+    if (accepted->serverMaxWindowBits < 9)
+        return FALSE;
+    if (limits->serverNoContextTakeover)
+        accepted->serverNoContextTakeover = TRUE;
+    if (limits->clientNoContextTakeover)
+        accepted->clientNoContextTakeover = TRUE;
+    accepted->enabled = TRUE;
+    return TRUE;
+}
+
+int wsNegotiateDeflate(struct handshake *hs, const struct wsDeflateParams *limits)
+{
+    struct wsDeflateParams *accepted = &hs->deflate;
+    int i;
+
+    memset(accepted, 0, sizeof(*accepted));
+    if (!limits->enabled)
+        return FALSE;
+
+    // repeated headers are one comma separated list of offers
+    for (i = 0; i < hs->headerCount; i++) {
+        if (!isField(&hs->headers[i].name, extensionsField))
+            continue;
+        const char *offer = hs->headers[i].value.data;
+        const char *valueEnd = offer + hs->headers[i].value.length;
+        while (offer < valueEnd) {
+            const char *end = memchr(offer, ',', valueEnd - offer);
+            if (!end)
+                end = valueEnd;
+            if (acceptDeflateOffer(offer, end, limits, accepted))
+                return TRUE;
+            offer = end + 1;
+        }
+    }
+
+    memset(accepted, 0, sizeof(*accepted));
+    return FALSE;
 }
 
 void wsMakeFrame(const uint8_t *data, size_t dataLength,
@@ -212,116 +650,345 @@ void wsMakeFrame(const uint8_t *data, size_t dataLength,
     assert(frameType < 0x10);
     if (dataLength > 0)
         assert(data);
-	
-    outFrame[0] = 0x80 | frameType;
-    
+
+    size_t headerLength = wsMakeFrameHeader(dataLength, outFrame, frameType);
+    // if assert fail, that means, that we corrupt memory
+    assert(headerLength + dataLength <= *outLength);
+    if (dataLength > 0)
+        memcpy(&outFrame[headerLength], data, dataLength);
+    *outLength = headerLength + dataLength;
+}
+
+size_t wsMakeFrameHeader(size_t dataLength, uint8_t *outHeader,
+                         enum wsFrameType frameType)
+{
+    return wsMakeFragmentHeader(dataLength, outHeader, frameType, TRUE);
+}
+
+size_t wsMakeMaskedFragmentHeader(size_t dataLength, uint8_t *outHeader,
+                                  enum wsFrameType frameType, uint8_t fin,
+                                  struct wsRandom *random)
+{
+    size_t headerLength = wsMakeFragmentHeader(dataLength, outHeader, frameType, fin);
+    uint32_t maskingKey = wsNextRandom(random);
+
+    outHeader[1] |= 0x80;
+    memcpy(outHeader + headerLength, &maskingKey, 4);
+    return headerLength + 4;
+}
+
+void wsMakeMaskedFrame(const uint8_t *data, size_t dataLength,
+                       uint8_t *outFrame, size_t *outLength, enum wsFrameType frameType,
+                       struct wsRandom *random)
+{
+    assert(outFrame && *outLength);
+    if (dataLength > 0)
+        assert(data);
+
+    size_t headerLength = wsMakeMaskedFragmentHeader(dataLength, outFrame, frameType, TRUE, random);
+    assert(headerLength + dataLength <= *outLength);
+    if (dataLength > 0) {
+        // copied first, the masking kernels work in place
+        memcpy(&outFrame[headerLength], data, dataLength);
+        wsApplyMask(&outFrame[headerLength], dataLength, &outFrame[headerLength - 4], 0);
+    }
+    *outLength = headerLength + dataLength;
+}
+
+size_t wsMakeFragmentHeader(size_t dataLength, uint8_t *outHeader,
+                            enum wsFrameType frameType, uint8_t fin)
+{
+    assert(outHeader);
+    assert(frameType < 0x10);
+
+    outHeader[0] = (fin ? 0x80 : 0x00) | frameType;
+
     if (dataLength <= 125) {
-        outFrame[1] = dataLength;
-        *outLength = 2;
+        outHeader[1] = dataLength;
+        return 2;
     } else if (dataLength <= 0xFFFF) {
-        outFrame[1] = 126;
-        uint16_t payloadLength16b = htons(dataLength);
-        memcpy(&outFrame[2], &payloadLength16b, 2);
-        *outLength = 4;
-    } else {
-        assert(dataLength <= 0xFFFF);
-        
-        /* implementation for 64bit systems
-        outFrame[1] = 127;
-        dataLength = htonll(dataLength);
-        memcpy(&outFrame[2], &dataLength, 8);
-        *outLength = 10;
-        */
+        outHeader[1] = 126;
+        outHeader[2] = (uint8_t)(dataLength >> 8);
+        outHeader[3] = (uint8_t)dataLength;
+        return 4;
+    }
+
+    uint64_t payloadLength64b = dataLength;
+    outHeader[1] = 127;
+    int i;
+    for (i = 0; i < 8; i++) {
+        outHeader[2 + i] = (uint8_t)(payloadLength64b >> (56 - 8 * i));
     }
-    memcpy(&outFrame[*outLength], data, dataLength);
-    *outLength+= dataLength;
+    return 10;
 }
 
-static size_t getPayloadLength(const uint8_t *inputFrame, size_t inputLength,
-                               uint8_t *payloadFieldExtraBytes, enum wsFrameType *frameType) 
+static void resetFrame(struct wsFrameParser *parser)
 {
-    size_t payloadLength = inputFrame[1] & 0x7F;
-    *payloadFieldExtraBytes = 0;
-    if ((payloadLength == 0x7E && inputLength < 4) || (payloadLength == 0x7F && inputLength < 10)) {
-        *frameType = WS_INCOMPLETE_FRAME;
-        return 0;
+    parser->headerLength = 0;
+    parser->headerNeeded = 2;
+    parser->opcode = 0;
+    parser->payloadLength = 0;
+    parser->payloadUnmasked = 0;
+}
+
+void wsInitFrameParser(struct wsFrameParser *parser, size_t maxPayloadLength)
+{
+    resetFrame(parser);
+    parser->fin = TRUE;
+    parser->fragmentOpcode = 0;
+    parser->rsvAllowed = 0;
+    parser->compressed = FALSE;
+    parser->unmasked = FALSE;
+    parser->validateUtf8 = FALSE;
+    parser->textMessage = FALSE;
+    wsInitUtf8(&parser->utf8);
+    parser->maxPayloadLength = maxPayloadLength;
+}
+
+static enum wsFrameType checkHeader(struct wsFrameParser *parser)
+{
+    const uint8_t *header = parser->header;
+
+    if ((header[0] & 0x70 & ~parser->rsvAllowed) != 0x0) // checks extensions off
+        return WS_ERROR_FRAME;
+    // checks masking bit: clients mask every frame, servers none
+    if (((header[1] & 0x80) == 0x80) == parser->unmasked)
+        return WS_ERROR_FRAME;
+
+    uint8_t fin = (header[0] & 0x80) == 0x80;
+    uint8_t opcode = header[0] & 0x0F;
+    if (opcode != WS_CONTINUATION_FRAME &&
+            opcode != WS_TEXT_FRAME &&
+            opcode != WS_BINARY_FRAME &&
+            opcode != WS_CLOSING_FRAME &&
+            opcode != WS_PING_FRAME &&
+            opcode != WS_PONG_FRAME)
+        return WS_ERROR_FRAME;
+
+    // a compressed message is marked on its first frame only
+    uint8_t rsv1 = (header[0] & 0x40) == 0x40;
+    if (rsv1 && (opcode & 0x08 || opcode == WS_CONTINUATION_FRAME))
+        return WS_ERROR_FRAME;
+    if (opcode != WS_CONTINUATION_FRAME && !(opcode & 0x08)) {
+        parser->compressed = rsv1;
+        parser->textMessage = opcode == WS_TEXT_FRAME;
+        wsInitUtf8(&parser->utf8);
     }
-    if (payloadLength == 0x7F && (inputFrame[3] & 0x80) != 0x0) {
-        *frameType = WS_ERROR_FRAME;
-        return 0;
+
+    uint8_t payloadLength = header[1] & 0x7F;
+    if (opcode & 0x08) {
+        // control frames may come between fragments, but are never fragmented or extended
+        if (!fin || payloadLength > 125)
+            return WS_ERROR_FRAME;
+    } else if (opcode == WS_CONTINUATION_FRAME) {
+        if (!parser->fragmentOpcode) // nothing to continue
+            return WS_ERROR_FRAME;
+        if (fin)
+            parser->fragmentOpcode = 0;
+    } else {
+        if (parser->fragmentOpcode) // previous message isn't finished
+            return WS_ERROR_FRAME;
+        if (!fin)
+            parser->fragmentOpcode = opcode;
     }
 
+    parser->fin = fin;
+    parser->opcode = opcode;
+    return WS_INCOMPLETE_FRAME;
+}
+
+static uint64_t getPayloadLength(const uint8_t *header)
+{
+    uint8_t payloadLength = header[1] & 0x7F;
+    uint64_t payloadLength64b = 0;
+    int i;
+
     if (payloadLength == 0x7E) {
-        uint16_t payloadLength16b = 0;
-        *payloadFieldExtraBytes = 2;
-        memcpy(&payloadLength16b, &inputFrame[2], *payloadFieldExtraBytes);
-        payloadLength = ntohs(payloadLength16b);
+        return ((uint64_t)header[2] << 8) | header[3];
     } else if (payloadLength == 0x7F) {
-        *frameType = WS_ERROR_FRAME;
-        return 0;
-        
-        /* // implementation for 64bit systems
-        uint64_t payloadLength64b = 0;
-        *payloadFieldExtraBytes = 8;
-        memcpy(&payloadLength64b, &inputFrame[2], *payloadFieldExtraBytes);
-        if (payloadLength64b > SIZE_MAX) {
-            *frameType = WS_ERROR_FRAME;
-            return 0;
+        for (i = 0; i < 8; i++) {
+            payloadLength64b = (payloadLength64b << 8) | header[2 + i];
         }
-        payloadLength = (size_t)ntohll(payloadLength64b);
-        */
+        return payloadLength64b;
     }
-
     return payloadLength;
 }
 
-enum wsFrameType wsParseInputFrame(uint8_t *inputFrame, size_t inputLength,
-                                   uint8_t **dataPtr, size_t *dataLength)
+enum wsFrameType wsParseFrameHeader(struct wsFrameParser *parser, const uint8_t *input,
+                                    size_t inputLength, size_t *consumed)
 {
-    assert(inputFrame && inputLength);
+    size_t position = 0;
 
-    if (inputLength < 2)
-        return WS_INCOMPLETE_FRAME;
-	
-    if ((inputFrame[0] & 0x70) != 0x0) // checks extensions off
-        return WS_ERROR_FRAME;
-    if ((inputFrame[0] & 0x80) != 0x80) // we haven't continuation frames support
-        return WS_ERROR_FRAME; // so, fin flag must be set
-    if ((inputFrame[1] & 0x80) != 0x80) // checks masking bit
-        return WS_ERROR_FRAME;
+    while (parser->headerLength < parser->headerNeeded) {
+        if (position == inputLength) {
+            *consumed = position;
+            return WS_INCOMPLETE_FRAME;
+        }
+        parser->header[parser->headerLength++] = input[position++];
 
-    uint8_t opcode = inputFrame[0] & 0x0F;
-    if (opcode == WS_TEXT_FRAME ||
-            opcode == WS_BINARY_FRAME ||
-            opcode == WS_CLOSING_FRAME ||
-            opcode == WS_PING_FRAME ||
-            opcode == WS_PONG_FRAME
-    ){
-        enum wsFrameType frameType = opcode;
-
-        uint8_t payloadFieldExtraBytes = 0;
-        size_t payloadLength = getPayloadLength(inputFrame, inputLength,
-                                                &payloadFieldExtraBytes, &frameType);
-        if (payloadLength > 0) {
-            if (payloadLength + 6 + payloadFieldExtraBytes > inputLength) // 4-maskingKey, 2-header
-                return WS_INCOMPLETE_FRAME;
-            uint8_t *maskingKey = &inputFrame[2 + payloadFieldExtraBytes];
-
-            if(payloadLength != inputLength - 6 - payloadFieldExtraBytes)
-            {
+        if (parser->headerLength == 2) {
+            if (checkHeader(parser) == WS_ERROR_FRAME)
                 return WS_ERROR_FRAME;
-            }
-
-            *dataPtr = &inputFrame[2 + payloadFieldExtraBytes + 4];
-            *dataLength = payloadLength;
-		
-            size_t i;
-            for (i = 0; i < *dataLength; i++) {
-                (*dataPtr)[i] = (*dataPtr)[i] ^ maskingKey[i%4];
-            }
+            uint8_t payloadLength = parser->header[1] & 0x7F;
+            parser->headerNeeded = parser->unmasked ? 2 : 2 + 4; // 4-maskingKey
+            if (payloadLength == 0x7E)
+                parser->headerNeeded += 2;
+            else if (payloadLength == 0x7F)
+                parser->headerNeeded += 8;
         }
+        if (parser->headerLength == parser->headerNeeded) {
+            if ((parser->header[1] & 0x7F) == 0x7F && (parser->header[2] & 0x80) != 0x0)
+                return WS_ERROR_FRAME; // most significant bit must be 0
+            parser->payloadLength = getPayloadLength(parser->header);
+        }
+    }
+
+    *consumed = position;
+    return parser->opcode;
+}
+
+// payload of the current frame is checked as it is unmasked
+static int checksUtf8(const struct wsFrameParser *parser)
+{
+    if (!parser->validateUtf8 || parser->compressed)
+        return FALSE;
+    return parser->opcode == WS_TEXT_FRAME
+        || (parser->opcode == WS_CONTINUATION_FRAME && parser->textMessage);
+}
+
+/*
+ * Unmasks payload bytes [offset, offset + length), checking the text of
+ * the current message on the way.
+ */
+static int unmaskPayload(struct wsFrameParser *parser, uint8_t *data, size_t length,
+                         uint64_t offset)
+{
+    const uint8_t *maskingKey = parser->unmasked ? NULL : &parser->header[parser->headerNeeded - 4];
+
+    if (checksUtf8(parser))
+        return wsUnmaskUtf8(&parser->utf8, data, length, maskingKey, (size_t)(offset & 3));
+    if (maskingKey)
+        wsApplyMask(data, length, maskingKey, (size_t)(offset & 3));
+    return TRUE;
+}
+
+// the last fragment of a text message can't leave a sequence open
+static int completesText(const struct wsFrameParser *parser)
+{
+    return !checksUtf8(parser) || !parser->fin || wsUtf8Complete(&parser->utf8);
+}
+
+// a closing frame may carry a status code and a UTF-8 reason after it
+static int validCloseReason(const struct wsFrameParser *parser, const uint8_t *payload)
+{
+    struct wsUtf8State utf8;
+
+    if (!parser->validateUtf8 || parser->opcode != WS_CLOSING_FRAME || parser->payloadLength <= 2)
+        return TRUE;
+    wsInitUtf8(&utf8);
+    return wsUnmaskUtf8(&utf8, (uint8_t *)payload + 2, (size_t)parser->payloadLength - 2, NULL, 0)
+        && wsUtf8Complete(&utf8);
+}
+
+enum wsFrameType wsParseFrame(struct wsFrameParser *parser, uint8_t *input,
+                              size_t inputLength, size_t *consumed,
+                              uint8_t **dataPtr, size_t *dataLength)
+{
+    size_t position = 0;
+    enum wsFrameType frameType = wsParseFrameHeader(parser, input, inputLength, &position);
+    if (frameType == WS_INCOMPLETE_FRAME || frameType == WS_ERROR_FRAME) {
+        *consumed = position;
+        return frameType;
+    }
+    // the whole payload has to fit into the caller's buffer
+    if ((uint64_t)(size_t)parser->payloadLength != parser->payloadLength
+        || (parser->maxPayloadLength && parser->payloadLength > parser->maxPayloadLength))
+        return WS_ERROR_FRAME;
+
+    uint8_t *payload = &input[position];
+    size_t available = inputLength - position;
+    if (available > parser->payloadLength)
+        available = parser->payloadLength;
+
+    if (available > parser->payloadUnmasked) {
+        if (!unmaskPayload(parser, payload + parser->payloadUnmasked,
+                           available - parser->payloadUnmasked, parser->payloadUnmasked))
+            return WS_ERROR_FRAME;
+        parser->payloadUnmasked = available;
+    }
+
+    if (parser->payloadUnmasked < parser->payloadLength) {
+        // keep the payload in the caller's buffer, resume after it
+        *consumed = position;
+        return WS_INCOMPLETE_FRAME;
+    }
+
+    if (!completesText(parser) || !validCloseReason(parser, payload))
+        return WS_ERROR_FRAME;
+
+    *dataPtr = payload;
+    *dataLength = parser->payloadLength;
+    *consumed = position + parser->payloadLength;
+    resetFrame(parser);
+    return frameType;
+}
+
+enum wsFrameType wsParseFrameChunk(struct wsFrameParser *parser, uint8_t *input,
+                                   size_t inputLength, size_t *consumed,
+                                   struct wsFrameChunk *chunk)
+{
+    size_t position = 0;
+    enum wsFrameType frameType = wsParseFrameHeader(parser, input, inputLength, &position);
+    if (frameType == WS_INCOMPLETE_FRAME || frameType == WS_ERROR_FRAME) {
+        *consumed = position;
         return frameType;
     }
 
-    return WS_ERROR_FRAME;
+    uint64_t remaining = parser->payloadLength - parser->payloadUnmasked;
+    size_t available = inputLength - position;
+    if (available > remaining)
+        available = (size_t)remaining;
+    // an empty chunk is only reported for an empty payload
+    if (available == 0 && remaining > 0) {
+        *consumed = position;
+        return WS_INCOMPLETE_FRAME;
+    }
+
+    chunk->data = &input[position];
+    chunk->length = available;
+    chunk->offset = parser->payloadUnmasked;
+    chunk->total = parser->payloadLength;
+    if (!unmaskPayload(parser, chunk->data, available, parser->payloadUnmasked))
+        return WS_ERROR_FRAME;
+
+    parser->payloadUnmasked += available;
+    if (parser->payloadUnmasked == parser->payloadLength) {
+        if (!completesText(parser))
+            return WS_ERROR_FRAME;
+        resetFrame(parser);
+    }
+    *consumed = position + available;
+    return frameType;
+}
+
+enum wsFrameType wsParseInputFrame(uint8_t *inputFrame, size_t inputLength,
+                                   uint8_t **dataPtr, size_t *dataLength)
+{
+    assert(inputFrame && inputLength);
+
+    struct wsFrameParser parser;
+    size_t consumed = 0;
+    wsInitFrameParser(&parser, 0);
+    parser.validateUtf8 = TRUE;
+
+    enum wsFrameType frameType = wsParseFrame(&parser, inputFrame, inputLength, &consumed,
+                                              dataPtr, dataLength);
+    // one frame per call, pipelined input needs wsParseFrame()
+    if (frameType != WS_INCOMPLETE_FRAME && frameType != WS_ERROR_FRAME && consumed != inputLength)
+        return WS_ERROR_FRAME;
+    // fragments need the state kept by wsParseFrame()
+    if (frameType != WS_INCOMPLETE_FRAME && frameType != WS_ERROR_FRAME && !parser.fin)
+        return WS_ERROR_FRAME;
+
+    return frameType;
 }
@@ -0,0 +1,182 @@
+#include "ws_deflate.h"
+
+#ifdef WS_DEFLATE
+
+// free output space below which the buffer grows before calling zlib again
+#define WS_DEFLATE_SLACK 64
+
+static const uint8_t syncTail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+// estimated zlib memory of all connections, shared by every event loop
+static size_t deflateMemory = 0;
+
+/*
+ * zlib's own figures (zconf.h): deflate needs (1 << (windowBits + 2)) +
+ * (1 << (memLevel + 9)), inflate 1 << windowBits, plus a few KB of state each.
+ */
+static size_t estimateMemory(const struct wsDeflateParams *params, int memLevel)
+{
+    return ((size_t)1 << (params->serverMaxWindowBits + 2)) + ((size_t)1 << (memLevel + 9)) + 6144
+           + ((size_t)1 << params->clientMaxWindowBits) + 7168;
+}
+
+int ws_deflate_init(struct ws_deflate *deflate, const struct wsDeflateParams *params,
+                    int memLevel, size_t memoryBudget)
+{
+    size_t estimate = estimateMemory(params, memLevel);
+    size_t total = __atomic_add_fetch(&deflateMemory, estimate, __ATOMIC_RELAXED);
+    if (memoryBudget && total > memoryBudget) {
+        __atomic_sub_fetch(&deflateMemory, estimate, __ATOMIC_RELAXED);
+        return -1;
+    }
+    deflate->reserved = estimate;
+    deflate->params = *params;
+
+    // negative windowBits: raw deflate, no zlib header or checksum
+    if (deflateInit2(&deflate->deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -params->serverMaxWindowBits, memLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+        ws_deflate_free(deflate);
+        return -1;
+    }
+    deflate->deflaterReady = 1;
+    if (inflateInit2(&deflate->inflater, -params->clientMaxWindowBits) != Z_OK) {
+        ws_deflate_free(deflate);
+        return -1;
+    }
+    deflate->inflaterReady = 1;
+    return 0;
+}
+
+void ws_deflate_free(struct ws_deflate *deflate)
+{
+    if (deflate->deflaterReady)
+        deflateEnd(&deflate->deflater);
+    if (deflate->inflaterReady)
+        inflateEnd(&deflate->inflater);
+    if (deflate->reserved)
+        __atomic_sub_fetch(&deflateMemory, deflate->reserved, __ATOMIC_RELAXED);
+    memset(deflate, 0, sizeof(*deflate));
+}
+
+static int growOutput(struct ws_pool *pool, struct ws_buffer *out)
+{
+    if (out->capacity - out->length >= WS_DEFLATE_SLACK)
+        return 0;
+    return ws_buffer_reserve(pool, out, out->capacity ? out->capacity * 2 : 256);
+}
+
+static int runDeflate(z_stream *stream, struct ws_pool *pool, struct ws_buffer *out, int flush)
+{
+    do {
+        if (growOutput(pool, out) == -1)
+            return -1;
+        stream->next_out = out->data + out->length;
+        stream->avail_out = out->capacity - out->length;
+        int ret = deflate(stream, flush);
+        out->length = stream->next_out - out->data;
+        if (ret == Z_STREAM_ERROR)
+            return -1;
+        // a full output buffer may hold back more, flush is done when space is left over
+    } while (stream->avail_in > 0 || stream->avail_out == 0);
+    return 0;
+}
+
+int ws_deflate_compress(struct ws_deflate *deflate, struct ws_pool *pool,
+                        const struct iovec *iov, int iovcnt, struct ws_buffer *out)
+{
+    z_stream *stream = &deflate->deflater;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        stream->next_in = iov[i].iov_base;
+        stream->avail_in = iov[i].iov_len;
+        if (runDeflate(stream, pool, out, i == iovcnt - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH) == -1)
+            return -1;
+    }
+    if (iovcnt == 0) {
+        stream->avail_in = 0;
+        if (runDeflate(stream, pool, out, Z_SYNC_FLUSH) == -1)
+            return -1;
+    }
+
+    // the sync flush ends with an empty stored block, the peer adds it back
+    if (out->length < sizeof(syncTail)
+        || memcmp(out->data + out->length - sizeof(syncTail), syncTail, sizeof(syncTail)) != 0)
+        return -1;
+    out->length -= sizeof(syncTail);
+
+    if (deflate->params.serverNoContextTakeover)
+        deflateReset(stream);
+    return 0;
+}
+
+static int runInflate(z_stream *stream, struct ws_pool *pool, struct ws_buffer *out, size_t maxLength)
+{
+    do {
+        if (growOutput(pool, out) == -1)
+            return -1;
+        stream->next_out = out->data + out->length;
+        stream->avail_out = out->capacity - out->length;
+        int ret = inflate(stream, Z_SYNC_FLUSH);
+        out->length = stream->next_out - out->data;
+        if (out->length > maxLength)
+            return -1;
+        if (ret == Z_STREAM_END) {
+            // a final block ends the stream, whatever follows starts a new one
+            inflateReset(stream);
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return -1;
+        }
+    } while (stream->avail_in > 0 || stream->avail_out == 0);
+    return 0;
+}
+
+int ws_deflate_decompress(struct ws_deflate *deflate, struct ws_pool *pool,
+                          const uint8_t *data, size_t dataLength, int fin,
+                          size_t maxLength, struct ws_buffer *out)
+{
+    z_stream *stream = &deflate->inflater;
+
+    stream->next_in = (uint8_t *)data;
+    stream->avail_in = dataLength;
+    if (dataLength && runInflate(stream, pool, out, maxLength) == -1)
+        return -1;
+    if (!fin)
+        return 0;
+
+    stream->next_in = (uint8_t *)syncTail;
+    stream->avail_in = sizeof(syncTail);
+    if (runInflate(stream, pool, out, maxLength) == -1)
+        return -1;
+
+    if (deflate->params.clientNoContextTakeover)
+        inflateReset(stream);
+    return 0;
+}
+
+int ws_deflate_get_window(struct ws_deflate *deflate, int compressor, uint8_t *window, size_t *length)
+{
+#if ZLIB_VERNUM >= 0x1290
+    uInt copied = 0;
+    int ret = compressor ? deflateGetDictionary(&deflate->deflater, window, &copied)
+                         : inflateGetDictionary(&deflate->inflater, window, &copied);
+    *length = copied;
+    return ret == Z_OK ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+int ws_deflate_set_window(struct ws_deflate *deflate, int compressor, const uint8_t *window, size_t length)
+{
+    // raw streams: no header announces the dictionary, the peer already has the same history
+    if (length == 0)
+        return 0;
+    if (length > WS_DEFLATE_WINDOW)
+        return -1;
+    int ret = compressor ? deflateSetDictionary(&deflate->deflater, window, length)
+                         : inflateSetDictionary(&deflate->inflater, window, length);
+    return ret == Z_OK ? 0 : -1;
+}
+
+#endif /* WS_DEFLATE */
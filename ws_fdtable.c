@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ws_fdtable.h"
+
+void ws_fdtable_init(struct ws_fdtable *table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+void ws_fdtable_destroy(struct ws_fdtable *table)
+{
+    int i;
+    for (i = 0; i < WS_FDTABLE_PAGES; i++)
+        free(table->pages[i]);
+    memset(table, 0, sizeof(*table));
+}
+
+static void **page(struct ws_fdtable *table, int fd, int create)
+{
+    void ***slot = &table->pages[fd >> WS_FDTABLE_PAGE_BITS];
+    void **pageOfFd = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (pageOfFd != NULL || !create)
+        return pageOfFd;
+
+    void **created = calloc(WS_FDTABLE_PAGE, sizeof(void *));
+    if (created == NULL)
+        return NULL;
+    // two event loops may race for the same page, the loser frees its copy
+    if (!__atomic_compare_exchange_n(slot, &pageOfFd, created, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(created);
+        return pageOfFd;
+    }
+    int end = __atomic_load_n(&table->end, __ATOMIC_RELAXED);
+    int pageEnd = ((fd >> WS_FDTABLE_PAGE_BITS) + 1) << WS_FDTABLE_PAGE_BITS;
+    while (end < pageEnd
+           && !__atomic_compare_exchange_n(&table->end, &end, pageEnd, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return created;
+}
+
+int ws_fdtable_set(struct ws_fdtable *table, int fd, void *value)
+{
+    if (fd < 0 || fd >= WS_FDTABLE_SIZE)
+        return -1;
+    void **pageOfFd = page(table, fd, value != NULL);
+    if (pageOfFd == NULL)
+        return value != NULL ? -1 : 0;
+    __atomic_store_n(&pageOfFd[fd & (WS_FDTABLE_PAGE - 1)], value, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void ws_fdtable_clear(struct ws_fdtable *table, int fd, void *value)
+{
+    if (fd < 0 || fd >= WS_FDTABLE_SIZE)
+        return;
+    void **pageOfFd = page(table, fd, 0);
+    if (pageOfFd != NULL)
+        __atomic_compare_exchange_n(&pageOfFd[fd & (WS_FDTABLE_PAGE - 1)], &value, NULL, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+void *ws_fdtable_get(struct ws_fdtable *table, int fd)
+{
+    if (fd < 0 || fd >= WS_FDTABLE_SIZE)
+        return NULL;
+    void **pageOfFd = page(table, fd, 0);
+    if (pageOfFd == NULL)
+        return NULL;
+    return __atomic_load_n(&pageOfFd[fd & (WS_FDTABLE_PAGE - 1)], __ATOMIC_ACQUIRE);
+}
+
+int ws_fdtable_end(struct ws_fdtable *table)
+{
+    return __atomic_load_n(&table->end, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,182 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // struct ucred
+#endif
+#include "ws_handoff.h"
+
+#ifndef ESP_PLATFORM
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+static int address(const char *path, struct sockaddr_un *local)
+{
+    memset(local, 0, sizeof(*local));
+    local->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(local->sun_path))
+        return -1;
+    strcpy(local->sun_path, path);
+    return 0;
+}
+
+int ws_handoff_listen(const char *path)
+{
+    struct sockaddr_un local;
+    if (address(path, &local) == -1)
+        return -1;
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenSocket == -1)
+        return -1;
+    unlink(path);
+    if (bind(listenSocket, (struct sockaddr *)&local, sizeof(local)) == -1 || listen(listenSocket, 1) == -1) {
+        close(listenSocket);
+        return -1;
+    }
+    return listenSocket;
+}
+
+int ws_handoff_accept(int listenSocket)
+{
+    while (1) {
+        int channel = accept(listenSocket, NULL, NULL);
+        if (channel == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+#ifdef SO_PEERCRED
+        // the sockets are as good as the process, nobody else gets them
+        struct ucred peer;
+        socklen_t length = sizeof(peer);
+        if (getsockopt(channel, SOL_SOCKET, SO_PEERCRED, &peer, &length) == -1 || peer.uid != geteuid()) {
+            close(channel);
+            continue;
+        }
+#endif
+        return channel;
+    }
+}
+
+int ws_handoff_connect(const char *path)
+{
+    struct sockaddr_un remote;
+    if (address(path, &remote) == -1)
+        return -1;
+    int channel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (channel == -1)
+        return -1;
+    if (connect(channel, (struct sockaddr *)&remote, sizeof(remote)) == -1) {
+        close(channel);
+        return -1;
+    }
+    return channel;
+}
+
+int ws_handoff_send(int channel, const struct iovec *iov, int iovcnt, const int *fds, int fdCount)
+{
+    union {
+        struct cmsghdr align;
+        uint8_t data[CMSG_SPACE(WS_HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+    struct iovec rest[iovcnt > 0 ? iovcnt : 1];
+    struct msghdr msg;
+
+    if (fdCount > WS_HANDOFF_MAX_FDS)
+        return -1;
+    memcpy(rest, iov, iovcnt * sizeof(*iov));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = rest;
+    msg.msg_iovlen = iovcnt;
+    if (fdCount > 0) {
+        msg.msg_control = control.data;
+        msg.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fdCount * sizeof(int));
+    }
+
+    // the descriptors go with the first byte, a message without data can't carry them
+    while (msg.msg_iovlen > 0 || msg.msg_control != NULL) {
+        ssize_t sent = sendmsg(channel, &msg, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov[0].iov_len) {
+            sent -= msg.msg_iov[0].iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov[0].iov_base = (uint8_t *)msg.msg_iov[0].iov_base + sent;
+            msg.msg_iov[0].iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+int ws_handoff_recv(int channel, void *data, size_t length, int *fds, int maxFds)
+{
+    union {
+        struct cmsghdr align;
+        uint8_t data[CMSG_SPACE(WS_HANDOFF_MAX_FDS * sizeof(int))];
+    } control;
+    size_t received = 0;
+    int fdCount = 0;
+    int failed = FALSE;
+
+    while (received < length) {
+        struct iovec iov = { .iov_base = (uint8_t *)data + received, .iov_len = length - received };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof(control.data);
+
+        ssize_t readed = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+        if (readed == -1 && errno == EINTR)
+            continue;
+        if (readed <= 0) {
+            failed = TRUE;
+            break;
+        }
+        received += readed;
+        if (msg.msg_flags & MSG_CTRUNC)
+            failed = TRUE;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+                if (fdCount < maxFds) {
+                    fds[fdCount++] = fd;
+                } else {
+                    close(fd);
+                    failed = TRUE;
+                }
+            }
+        }
+    }
+    if (failed) {
+        while (fdCount > 0)
+            close(fds[--fdCount]);
+        return -1;
+    }
+    return fdCount;
+}
+
+#endif /* ESP_PLATFORM */
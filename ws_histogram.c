@@ -0,0 +1,76 @@
+#include <string.h>
+#include "ws_histogram.h"
+
+#define SUB_BUCKETS (1 << WS_HISTOGRAM_SUB_BITS)
+
+/*
+ * Values below SUB_BUCKETS are their own bucket. Above, the position of the
+ * highest bit picks a group of SUB_BUCKETS and the next bits the bucket in it.
+ */
+static int bucketOf(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return (int)value;
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= WS_HISTOGRAM_MAX_BITS)
+        return WS_HISTOGRAM_BUCKETS - 1;
+    int shift = exponent - WS_HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << WS_HISTOGRAM_SUB_BITS) + (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+// biggest value that falls into bucket
+static uint64_t upperBound(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return (uint64_t)bucket;
+    int shift = (bucket >> WS_HISTOGRAM_SUB_BITS) - 1;
+    uint64_t base = (uint64_t)(SUB_BUCKETS | (bucket & (SUB_BUCKETS - 1))) << shift;
+    return base + ((uint64_t)1 << shift) - 1;
+}
+
+void ws_histogram_init(struct ws_histogram *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void ws_histogram_record(struct ws_histogram *histogram, uint64_t value)
+{
+    histogram->counts[bucketOf(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+void ws_histogram_merge(struct ws_histogram *into, const struct ws_histogram *from)
+{
+    int i;
+    for (i = 0; i < WS_HISTOGRAM_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+uint64_t ws_histogram_quantile(const struct ws_histogram *histogram, double quantile)
+{
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (histogram->count == 0)
+        return 0;
+    // the value with this many values at or below it, at least the first
+    rank = (uint64_t)(quantile * histogram->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < WS_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        // the last bucket also holds everything beyond the range
+        if (seen >= rank && i < WS_HISTOGRAM_BUCKETS - 1) {
+            uint64_t bound = upperBound(i);
+            return bound < histogram->max ? bound : histogram->max;
+        }
+    }
+    return histogram->max;
+}
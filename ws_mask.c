@@ -0,0 +1,184 @@
+#include <string.h>
+#include "ws_mask.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define WS_MASK_X86
+    #include <immintrin.h>
+#endif
+
+// below this the kernel selection costs more than it saves
+#define WS_MASK_SMALL 16
+
+typedef void (*maskFunction)(uint8_t *data, size_t dataLength, const uint8_t *maskingKey,
+                             size_t keyOffset);
+
+static void maskScalar(uint8_t *data, size_t dataLength, const uint8_t *maskingKey,
+                       size_t keyOffset)
+{
+    size_t i;
+    for (i = 0; i < dataLength; i++) {
+        data[i] ^= maskingKey[(keyOffset + i) & 3];
+    }
+}
+
+/*
+ * Fills out[] with the key bytes starting at keyOffset. Any multiple of 4
+ * bytes keeps the phase, so one rotated pattern serves every full word.
+ */
+static void rotateKey(uint8_t *out, size_t outLength, const uint8_t *maskingKey,
+                      size_t keyOffset)
+{
+    size_t i;
+    for (i = 0; i < outLength; i++) {
+        out[i] = maskingKey[(keyOffset + i) & 3];
+    }
+}
+
+static int32_t rotatedKey32(const uint8_t *maskingKey, size_t keyOffset)
+{
+    uint8_t pattern[4];
+    int32_t mask32;
+    rotateKey(pattern, sizeof(pattern), maskingKey, keyOffset);
+    memcpy(&mask32, pattern, sizeof(mask32));
+    return mask32;
+}
+
+static size_t alignHead(uint8_t *data, size_t dataLength, const uint8_t *maskingKey,
+                        size_t keyOffset, size_t alignment)
+{
+    size_t head = (alignment - ((uintptr_t)data & (alignment - 1))) & (alignment - 1);
+    if (head > dataLength)
+        head = dataLength;
+    maskScalar(data, head, maskingKey, keyOffset);
+    return head;
+}
+
+static void maskWord(uint8_t *data, size_t dataLength, const uint8_t *maskingKey,
+                     size_t keyOffset)
+{
+    size_t i = alignHead(data, dataLength, maskingKey, keyOffset, sizeof(uint64_t));
+
+    uint8_t pattern[sizeof(uint64_t)];
+    uint64_t mask64;
+    rotateKey(pattern, sizeof(pattern), maskingKey, keyOffset + i);
+    memcpy(&mask64, pattern, sizeof(mask64));
+
+    for (; i + sizeof(uint64_t) <= dataLength; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, &data[i], sizeof(word));
+        word ^= mask64;
+        memcpy(&data[i], &word, sizeof(word));
+    }
+    maskScalar(&data[i], dataLength - i, maskingKey, keyOffset + i);
+}
+
+#ifdef WS_MASK_X86
+static void maskSse2(uint8_t *data, size_t dataLength, const uint8_t *maskingKey,
+                     size_t keyOffset)
+{
+    size_t i = 0;
+
+    int32_t mask32 = rotatedKey32(maskingKey, keyOffset);
+    __m128i mask128 = _mm_set1_epi32(mask32);
+
+    // unaligned loads: a scalar head loop costs more than the split loads
+    for (; i + 64 <= dataLength; i += 64) {
+        __m128i *p = (__m128i *)&data[i];
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask128));
+        _mm_storeu_si128(p + 1, _mm_xor_si128(_mm_loadu_si128(p + 1), mask128));
+        _mm_storeu_si128(p + 2, _mm_xor_si128(_mm_loadu_si128(p + 2), mask128));
+        _mm_storeu_si128(p + 3, _mm_xor_si128(_mm_loadu_si128(p + 3), mask128));
+    }
+    for (; i + 16 <= dataLength; i += 16) {
+        __m128i *p = (__m128i *)&data[i];
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask128));
+    }
+    maskWord(&data[i], dataLength - i, maskingKey, keyOffset + i);
+}
+
+__attribute__((target("avx2")))
+static void maskAvx2(uint8_t *data, size_t dataLength, const uint8_t *maskingKey,
+                     size_t keyOffset)
+{
+    size_t i = 0;
+
+    int32_t mask32 = rotatedKey32(maskingKey, keyOffset);
+    __m256i mask256 = _mm256_set1_epi32(mask32);
+    __m128i mask128 = _mm_set1_epi32(mask32);
+
+    for (; i + 128 <= dataLength; i += 128) {
+        __m256i *p = (__m256i *)&data[i];
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), mask256));
+        _mm256_storeu_si256(p + 1, _mm256_xor_si256(_mm256_loadu_si256(p + 1), mask256));
+        _mm256_storeu_si256(p + 2, _mm256_xor_si256(_mm256_loadu_si256(p + 2), mask256));
+        _mm256_storeu_si256(p + 3, _mm256_xor_si256(_mm256_loadu_si256(p + 3), mask256));
+    }
+    for (; i + 32 <= dataLength; i += 32) {
+        __m256i *p = (__m256i *)&data[i];
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), mask256));
+    }
+    // stay VEX encoded for the tail, legacy SSE code after 256 bit ops stalls
+    for (; i + 16 <= dataLength; i += 16) {
+        __m128i *p = (__m128i *)&data[i];
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask128));
+    }
+    // GCC leaves it out before the tail call, the caller's SSE code would pay for the dirty upper halves
+    _mm256_zeroupper();
+    maskWord(&data[i], dataLength - i, maskingKey, keyOffset + i);
+}
+#endif
+
+static maskFunction kernels[] = {
+    maskScalar,
+    maskWord,
+#ifdef WS_MASK_X86
+    maskSse2,
+    maskAvx2,
+#endif
+};
+
+int wsMaskKernelSupported(enum wsMaskKernel kernel)
+{
+    if (kernel >= sizeof(kernels) / sizeof(kernels[0]))
+        return 0;
+#ifdef WS_MASK_X86
+    if (kernel == WS_MASK_AVX2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+static maskFunction selectKernel(void)
+{
+#ifdef WS_MASK_X86
+    if (wsMaskKernelSupported(WS_MASK_AVX2))
+        return maskAvx2;
+    return maskSse2;
+#else
+    return maskWord;
+#endif
+}
+
+void wsApplyMask(uint8_t *data, size_t dataLength, const uint8_t *maskingKey,
+                 size_t keyOffset)
+{
+    static maskFunction kernel = NULL;
+
+    if (dataLength < WS_MASK_SMALL) {
+        maskScalar(data, dataLength, maskingKey, keyOffset);
+        return;
+    }
+    // racing first calls store the same pointer
+    maskFunction selected = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (!selected) {
+        selected = selectKernel();
+        __atomic_store_n(&kernel, selected, __ATOMIC_RELAXED);
+    }
+    selected(data, dataLength, maskingKey, keyOffset);
+}
+
+void wsApplyMaskKernel(enum wsMaskKernel kernel, uint8_t *data, size_t dataLength,
+                       const uint8_t *maskingKey, size_t keyOffset)
+{
+    kernels[kernel](data, dataLength, maskingKey, keyOffset);
+}
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ws_pool.h"
+
+// shared by the pools of all event loops
+static struct ws_pool_stats stats;
+
+static size_t classSize(int index)
+{
+    return ((size_t)1 << (index + WS_POOL_MIN_SHIFT)) + WS_POOL_SLACK;
+}
+
+static int sizeClass(size_t size)
+{
+    int index = 0;
+    while (classSize(index) < size) {
+        if (++index == WS_POOL_CLASSES)
+            return -1;
+    }
+    return index;
+}
+
+// counts size against the budget, 0 if it doesn't fit
+static int reserve(size_t size)
+{
+    size_t total = __atomic_add_fetch(&stats.used, size, __ATOMIC_RELAXED)
+                   + __atomic_load_n(&stats.cached, __ATOMIC_RELAXED);
+    size_t budget = __atomic_load_n(&stats.budget, __ATOMIC_RELAXED);
+    if (budget && total > budget) {
+        __atomic_sub_fetch(&stats.used, size, __ATOMIC_RELAXED);
+        return 0;
+    }
+    size_t highWater = __atomic_load_n(&stats.highWater, __ATOMIC_RELAXED);
+    while (total > highWater
+           && !__atomic_compare_exchange_n(&stats.highWater, &highWater, total, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return 1;
+}
+
+static void freeCached(struct ws_pool *pool)
+{
+    int i;
+    for (i = 0; i < WS_POOL_CLASSES; i++) {
+        while (pool->freeList[i]) {
+            void *next = *(void **)pool->freeList[i];
+            free(pool->freeList[i]);
+            pool->freeList[i] = next;
+            __atomic_sub_fetch(&stats.cached, classSize(i), __ATOMIC_RELAXED);
+        }
+        pool->cached[i] = 0;
+    }
+}
+
+void ws_pool_init(struct ws_pool *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+}
+
+void ws_pool_destroy(struct ws_pool *pool)
+{
+    freeCached(pool);
+}
+
+void *ws_pool_alloc(struct ws_pool *pool, size_t size, size_t *capacity)
+{
+    int index = sizeClass(size);
+    if (index < 0)
+        return NULL;
+
+    *capacity = classSize(index);
+    void *block = pool ? pool->freeList[index] : NULL;
+    if (block) {
+        // free blocks link through their first bytes
+        pool->freeList[index] = *(void **)block;
+        pool->cached[index]--;
+        __atomic_sub_fetch(&stats.cached, *capacity, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.used, *capacity, __ATOMIC_RELAXED);
+        return block;
+    }
+
+    if (!reserve(*capacity)) {
+        // blocks of other sizes waiting here may make room
+        if (pool)
+            freeCached(pool);
+        if (!reserve(*capacity)) {
+            __atomic_add_fetch(&stats.failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    block = malloc(*capacity);
+    if (!block) {
+        __atomic_sub_fetch(&stats.used, *capacity, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_add_fetch(&stats.heapAllocs, 1, __ATOMIC_RELAXED);
+    return block;
+}
+
+void ws_pool_free(struct ws_pool *pool, void *block, size_t capacity)
+{
+    if (!block)
+        return;
+
+    int index = sizeClass(capacity);
+    __atomic_sub_fetch(&stats.used, capacity, __ATOMIC_RELAXED);
+    if (!pool || index < 0 || pool->cached[index] >= WS_POOL_CACHED) {
+        free(block);
+        return;
+    }
+    *(void **)block = pool->freeList[index];
+    pool->freeList[index] = block;
+    pool->cached[index]++;
+    __atomic_add_fetch(&stats.cached, capacity, __ATOMIC_RELAXED);
+}
+
+void ws_pool_budget(size_t budget)
+{
+    __atomic_store_n(&stats.budget, budget, __ATOMIC_RELAXED);
+}
+
+void ws_pool_stats(struct ws_pool_stats *out)
+{
+    out->used = __atomic_load_n(&stats.used, __ATOMIC_RELAXED);
+    out->cached = __atomic_load_n(&stats.cached, __ATOMIC_RELAXED);
+    out->highWater = __atomic_load_n(&stats.highWater, __ATOMIC_RELAXED);
+    out->budget = __atomic_load_n(&stats.budget, __ATOMIC_RELAXED);
+    out->heapAllocs = __atomic_load_n(&stats.heapAllocs, __ATOMIC_RELAXED);
+    out->failed = __atomic_load_n(&stats.failed, __ATOMIC_RELAXED);
+}
+
+int ws_buffer_reserve(struct ws_pool *pool, struct ws_buffer *buffer, size_t size)
+{
+    if (size > buffer->capacity) {
+        size_t capacity = 0;
+        uint8_t *grown = ws_pool_alloc(pool, size, &capacity);
+        if (!grown)
+            return -1;
+        if (buffer->length)
+            memcpy(grown, buffer->data, buffer->length);
+        ws_pool_free(pool, buffer->data, buffer->capacity);
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    return 0;
+}
+
+int ws_buffer_append(struct ws_pool *pool, struct ws_buffer *buffer,
+                     const uint8_t *data, size_t length)
+{
+    if (ws_buffer_reserve(pool, buffer, buffer->length + length) == -1)
+        return -1;
+    if (length)
+        memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 0;
+}
+
+void ws_buffer_release(struct ws_pool *pool, struct ws_buffer *buffer)
+{
+    ws_pool_free(pool, buffer->data, buffer->capacity);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
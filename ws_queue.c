@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ws_queue.h"
+
+// smallest buffer a copy gets, later small copies are appended to it
+#define WS_QUEUE_CHUNK 4096
+// drained items kept per queue
+#define WS_QUEUE_SPARE 4
+
+struct ws_shared *ws_shared_alloc(size_t length)
+{
+    struct ws_shared *shared = malloc(sizeof(*shared) + length);
+    if (!shared)
+        return NULL;
+    shared->refs = 1;
+    shared->length = length;
+    shared->capacity = length;
+    return shared;
+}
+
+struct ws_shared *ws_shared_ref(struct ws_shared *shared)
+{
+    // queues of different connections may be served by different threads
+    __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+    return shared;
+}
+
+void ws_shared_unref(struct ws_shared *shared)
+{
+    if (shared && __atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(shared);
+}
+
+void ws_queue_init(struct ws_queue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+}
+
+int ws_queue_push(struct ws_queue *queue, struct ws_shared *buffer, size_t offset)
+{
+    struct ws_queue_item *item = queue->spare;
+    if (item) {
+        queue->spare = item->next;
+        queue->spareCount--;
+    } else {
+        item = malloc(sizeof(*item));
+        if (!item)
+            return -1;
+    }
+    item->buffer = ws_shared_ref(buffer);
+    item->offset = offset;
+    item->next = NULL;
+    if (queue->tail)
+        queue->tail->next = item;
+    else
+        queue->head = item;
+    queue->tail = item;
+    queue->bytes += buffer->length - offset;
+    return 0;
+}
+
+int ws_queue_copy(struct ws_queue *queue, const struct iovec *iov, int iovcnt, size_t skip)
+{
+    size_t length = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+    if (skip >= length)
+        return 0;
+    length -= skip;
+
+    // only the queue references the last buffer: bytes behind its end are unused
+    struct ws_shared *buffer = queue->tail ? queue->tail->buffer : NULL;
+    int append = buffer && __atomic_load_n(&buffer->refs, __ATOMIC_ACQUIRE) == 1
+                 && buffer->capacity - buffer->length >= length;
+    if (!append && length <= WS_QUEUE_CHUNK && queue->spareBuffer) {
+        buffer = queue->spareBuffer;
+        queue->spareBuffer = NULL;
+    } else if (!append) {
+        buffer = ws_shared_alloc(length < WS_QUEUE_CHUNK ? WS_QUEUE_CHUNK : length);
+        if (!buffer)
+            return -1;
+        buffer->length = 0;
+    }
+
+    uint8_t *p = buffer->data + buffer->length;
+    for (i = 0; i < iovcnt; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        memcpy(p, (const uint8_t *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+        p += iov[i].iov_len - skip;
+        skip = 0;
+    }
+    buffer->length += length;
+
+    if (append) {
+        queue->bytes += length;
+        return 0;
+    }
+    int ret = ws_queue_push(queue, buffer, 0);
+    ws_shared_unref(buffer);
+    return ret;
+}
+
+int ws_queue_iov(const struct ws_queue *queue, struct iovec *iov, int iovcnt)
+{
+    const struct ws_queue_item *item = queue->head;
+    int count = 0;
+    for (; item && count < iovcnt; item = item->next, count++) {
+        iov[count].iov_base = item->buffer->data + item->offset;
+        iov[count].iov_len = item->buffer->length - item->offset;
+    }
+    return count;
+}
+
+void ws_queue_consume(struct ws_queue *queue, size_t written)
+{
+    queue->bytes -= written;
+    while (written > 0) {
+        struct ws_queue_item *item = queue->head;
+        size_t left = item->buffer->length - item->offset;
+        if (written < left) {
+            item->offset += written;
+            return;
+        }
+        written -= left;
+        queue->head = item->next;
+        if (!queue->head)
+            queue->tail = NULL;
+
+        struct ws_shared *buffer = item->buffer;
+        if (!queue->spareBuffer && buffer->capacity == WS_QUEUE_CHUNK
+            && __atomic_load_n(&buffer->refs, __ATOMIC_ACQUIRE) == 1) {
+            buffer->length = 0;
+            queue->spareBuffer = buffer;
+        } else {
+            ws_shared_unref(buffer);
+        }
+        if (queue->spareCount < WS_QUEUE_SPARE) {
+            item->next = queue->spare;
+            queue->spare = item;
+            queue->spareCount++;
+        } else {
+            free(item);
+        }
+    }
+}
+
+void ws_queue_clear(struct ws_queue *queue)
+{
+    ws_queue_consume(queue, queue->bytes);
+    while (queue->spare) {
+        struct ws_queue_item *next = queue->spare->next;
+        free(queue->spare);
+        queue->spare = next;
+    }
+    queue->spareCount = 0;
+    ws_shared_unref(queue->spareBuffer);
+    queue->spareBuffer = NULL;
+}
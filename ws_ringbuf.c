@@ -0,0 +1,134 @@
+#include <string.h>
+#include "ws_ringbuf.h"
+
+static size_t roundUpPow2(size_t value)
+{
+    size_t result = 1;
+    while (result < value)
+        result <<= 1;
+    return result;
+}
+
+int ws_ringbuf_init(struct ws_ringbuf *rb, struct ws_pool *pool, size_t capacity, size_t maxCapacity)
+{
+    rb->pool = pool;
+    rb->capacity = roundUpPow2(capacity);
+    rb->maxCapacity = roundUpPow2(maxCapacity);
+    if (rb->maxCapacity < rb->capacity)
+        rb->maxCapacity = rb->capacity;
+    rb->head = 0;
+    rb->tail = 0;
+    // +1 keeps room for the NUL written by ws_ringbuf_linearize()
+    rb->buffer = (uint8_t *)ws_pool_alloc(pool, rb->capacity + 1, &rb->blockSize);
+    return rb->buffer ? 0 : -1;
+}
+
+void ws_ringbuf_free(struct ws_ringbuf *rb)
+{
+    ws_pool_free(rb->pool, rb->buffer, rb->blockSize);
+    rb->buffer = NULL;
+    rb->capacity = 0;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+static void reverse(uint8_t *first, uint8_t *last)
+{
+    while (first < --last) {
+        uint8_t tmp = *first;
+        *first++ = *last;
+        *last = tmp;
+    }
+}
+
+static int grow(struct ws_ringbuf *rb)
+{
+    size_t used = ws_ringbuf_used(rb);
+    size_t newCapacity = rb->capacity * 2;
+    size_t newBlockSize = 0;
+    uint8_t *newBuffer = (uint8_t *)ws_pool_alloc(rb->pool, newCapacity + 1, &newBlockSize);
+    if (!newBuffer)
+        return -1;
+
+    size_t offset = rb->head & (rb->capacity - 1);
+    size_t first = rb->capacity - offset;
+    if (first > used)
+        first = used;
+    memcpy(newBuffer, rb->buffer + offset, first);
+    memcpy(newBuffer + first, rb->buffer, used - first);
+
+    ws_pool_free(rb->pool, rb->buffer, rb->blockSize);
+    rb->buffer = newBuffer;
+    rb->blockSize = newBlockSize;
+    rb->capacity = newCapacity;
+    rb->head = 0;
+    rb->tail = used;
+    return 0;
+}
+
+uint8_t *ws_ringbuf_write_ptr(struct ws_ringbuf *rb, size_t *length)
+{
+    size_t used = ws_ringbuf_used(rb);
+    if (used == rb->capacity && (rb->capacity >= rb->maxCapacity || grow(rb) != 0)) {
+        *length = 0;
+        return rb->buffer;
+    }
+
+    size_t offset = rb->tail & (rb->capacity - 1);
+    size_t space = rb->capacity - ws_ringbuf_used(rb);
+    *length = rb->capacity - offset < space ? rb->capacity - offset : space;
+    return rb->buffer + offset;
+}
+
+void ws_ringbuf_commit(struct ws_ringbuf *rb, size_t length)
+{
+    rb->tail += length;
+}
+
+uint8_t *ws_ringbuf_read_ptr(const struct ws_ringbuf *rb, size_t *length)
+{
+    size_t used = ws_ringbuf_used(rb);
+    size_t offset = rb->head & (rb->capacity - 1);
+    *length = rb->capacity - offset < used ? rb->capacity - offset : used;
+    return rb->buffer + offset;
+}
+
+uint8_t *ws_ringbuf_linearize(struct ws_ringbuf *rb, size_t *length)
+{
+    size_t used = ws_ringbuf_used(rb);
+    size_t offset = rb->head & (rb->capacity - 1);
+
+    if (offset + used > rb->capacity) {
+        // [second | free | first], only the readable bytes move
+        size_t first = rb->capacity - offset;
+        size_t second = used - first;
+        if (used <= offset) {
+            // first fits in front of second
+            memmove(rb->buffer + first, rb->buffer, second);
+            memcpy(rb->buffer, rb->buffer + offset, first);
+        } else {
+            // [second first] next to each other, then rotated left by second
+            memmove(rb->buffer + second, rb->buffer + offset, first);
+            reverse(rb->buffer, rb->buffer + second);
+            reverse(rb->buffer + second, rb->buffer + used);
+            reverse(rb->buffer, rb->buffer + used);
+        }
+        rb->head = 0;
+        rb->tail = used;
+        offset = 0;
+    }
+
+    rb->buffer[offset + used] = 0;
+    *length = used;
+    return rb->buffer + offset;
+}
+
+void ws_ringbuf_consume(struct ws_ringbuf *rb, size_t length)
+{
+    rb->head += length;
+    if (rb->head == rb->tail) {
+        // empty: rewind so the next recv gets the largest contiguous region
+        rb->head = 0;
+        rb->tail = 0;
+    }
+}
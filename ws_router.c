@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ws_router.h"
+
+/*
+ * Every '/' starts a segment, in patterns as in paths: "/" is one empty
+ * segment, "/a/" the segments "a" and "".
+ */
+static const char *segmentEnd(const char *segment, const char *end)
+{
+    while (segment < end && *segment != '/')
+        segment++;
+    return segment;
+}
+
+void ws_router_init(struct ws_router *router)
+{
+    memset(router, 0, sizeof(*router));
+}
+
+static void freeNodes(struct ws_route_node *node)
+{
+    while (node) {
+        struct ws_route_node *next = node->next;
+        freeNodes(node->child);
+        free(node->segment);
+        free(node);
+        node = next;
+    }
+}
+
+void ws_router_free(struct ws_router *router)
+{
+    freeNodes(router->root.child);
+    memset(router, 0, sizeof(*router));
+}
+
+// the child for a segment, added if there is none; a position has one parameter name
+static struct ws_route_node *child(struct ws_route_node *node, const char *segment, size_t length, uint8_t param)
+{
+    struct ws_route_node **link = &node->child;
+    for (; *link; link = &(*link)->next) {
+        struct ws_route_node *candidate = *link;
+        if (candidate->param != param)
+            continue;
+        if (candidate->length == length && memcmp(candidate->segment, segment, length) == 0)
+            return candidate;
+        if (param)
+            return NULL;
+    }
+
+    struct ws_route_node *added = calloc(1, sizeof(*added));
+    if (!added)
+        return NULL;
+    added->segment = malloc(length + 1);
+    if (!added->segment) {
+        free(added);
+        return NULL;
+    }
+    memcpy(added->segment, segment, length);
+    added->segment[length] = '\0';
+    added->length = length;
+    added->param = param;
+    *link = added;
+    return added;
+}
+
+int ws_router_add(struct ws_router *router, const char *pattern, void *value)
+{
+    struct ws_route_node *node = &router->root;
+    int params = 0;
+
+    if (pattern[0] != '/' || !value)
+        return -1;
+    const char *path = pattern;
+    const char *end = pattern + strlen(pattern);
+    while (path < end) {
+        const char *segment = path + 1;
+        const char *next = segmentEnd(segment, end);
+        size_t length = next - segment;
+
+        if (length == 1 && *segment == '*' && next == end) {
+            if (node->prefix)
+                return -1;
+            node->prefix = value;
+            router->count++;
+            return 0;
+        }
+        uint8_t param = length > 0 && *segment == ':';
+        if (param) {
+            segment++;
+            length--;
+            if (length == 0 || ++params > WS_ROUTER_PARAMS)
+                return -1;
+        }
+        node = child(node, segment, length, param);
+        if (!node)
+            return -1;
+        path = next;
+    }
+    if (node->exact)
+        return -1;
+    node->exact = value;
+    router->count++;
+    return 0;
+}
+
+// path is at the '/' of the next segment, or at end
+static void *find(const struct ws_route_node *node, const char *start, const char *path, const char *end,
+                  struct ws_route_match *match)
+{
+    const struct ws_route_node *candidate;
+    void *value;
+
+    if (path == end)
+        return node->exact ? node->exact : node->prefix;
+
+    const char *segment = path + 1;
+    const char *next = segmentEnd(segment, end);
+    size_t length = next - segment;
+
+    // literal segments first, then a parameter, then a prefix: the most specific pattern wins
+    for (candidate = node->child; candidate; candidate = candidate->next) {
+        if (!candidate->param && candidate->length == length
+            && memcmp(candidate->segment, segment, length) == 0) {
+            if ((value = find(candidate, start, next, end, match)))
+                return value;
+            break;
+        }
+    }
+    for (candidate = node->child; candidate && length; candidate = candidate->next) {
+        if (candidate->param) {
+            struct ws_route_param *param = &match->param[match->params++];
+            param->name = candidate->segment;
+            param->offset = segment - start;
+            param->length = length;
+            if ((value = find(candidate, start, next, end, match)))
+                return value;
+            match->params--;
+            break;
+        }
+    }
+    return node->prefix;
+}
+
+void *ws_router_match(const struct ws_router *router, const char *path, size_t length,
+                      struct ws_route_match *match)
+{
+    const char *query = memchr(path, '?', length);
+    const char *end = query ? query : path + length;
+
+    match->params = 0;
+    if (length == 0 || path[0] != '/')
+        return NULL;
+    return find(&router->root, path, path, end, match);
+}
@@ -0,0 +1,282 @@
+#include <string.h>
+#include "ws_sha1.h"
+
+#if defined(WS_CRYPTO_ESP32)
+    #include "hwcrypto/sha.h"
+#elif defined(WS_CRYPTO_MBEDTLS)
+    #include "mbedtls/sha1.h"
+    #include "mbedtls/base64.h"
+#elif defined(WS_CRYPTO_OPENSSL)
+    #include <openssl/sha.h>
+    #include <openssl/evp.h>
+#endif
+
+#if defined(WS_CRYPTO_BUNDLED) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define WS_SHA1_X86
+    #include <immintrin.h>
+    #include <cpuid.h>
+#endif
+
+#if !defined(WS_CRYPTO_MBEDTLS) && !defined(WS_CRYPTO_OPENSSL)
+static const char base64Table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t wsBase64Encode(const uint8_t *data, size_t dataLength, char *out)
+{
+    char *p = out;
+    size_t i;
+
+    for (i = 0; i + 3 <= dataLength; i += 3) {
+        uint32_t triple = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 | data[i + 2];
+        *p++ = base64Table[triple >> 18];
+        *p++ = base64Table[(triple >> 12) & 0x3F];
+        *p++ = base64Table[(triple >> 6) & 0x3F];
+        *p++ = base64Table[triple & 0x3F];
+    }
+    if (i < dataLength) {
+        uint32_t triple = (uint32_t)data[i] << 16;
+        if (i + 1 < dataLength)
+            triple |= (uint32_t)data[i + 1] << 8;
+        *p++ = base64Table[triple >> 18];
+        *p++ = base64Table[(triple >> 12) & 0x3F];
+        *p++ = i + 1 < dataLength ? base64Table[(triple >> 6) & 0x3F] : '=';
+        *p++ = '=';
+    }
+    *p = '\0';
+    return p - out;
+}
+#endif
+
+#if defined(WS_CRYPTO_ESP32)
+
+void wsSha1(const uint8_t *data, size_t dataLength, uint8_t *digest)
+{
+    esp_sha(SHA1, data, dataLength, digest);
+}
+
+#elif defined(WS_CRYPTO_MBEDTLS)
+
+void wsSha1(const uint8_t *data, size_t dataLength, uint8_t *digest)
+{
+    mbedtls_sha1(data, dataLength, digest);
+}
+
+size_t wsBase64Encode(const uint8_t *data, size_t dataLength, char *out)
+{
+    size_t written = 0;
+    mbedtls_base64_encode((unsigned char *)out, 4 * ((dataLength + 2) / 3) + 1, &written,
+                          data, dataLength);
+    return written;
+}
+
+#elif defined(WS_CRYPTO_OPENSSL)
+
+void wsSha1(const uint8_t *data, size_t dataLength, uint8_t *digest)
+{
+    SHA1(data, dataLength, digest);
+}
+
+size_t wsBase64Encode(const uint8_t *data, size_t dataLength, char *out)
+{
+    return EVP_EncodeBlock((unsigned char *)out, data, dataLength);
+}
+
+#else /* WS_CRYPTO_BUNDLED */
+
+typedef void (*blocksFunction)(uint32_t *state, const uint8_t *data, size_t blocks);
+
+static uint32_t rotl(uint32_t x, int n)
+{
+    return x << n | x >> (32 - n);
+}
+
+static void blocksPortable(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    uint32_t w[16];
+    int i;
+
+    while (blocks--) {
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 16) {
+                w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16
+                       | (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+            } else {
+                // 16 word window of the message schedule
+                w[i & 15] = rotl(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+            }
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = rotl(a, 5) + f + e + k + w[i & 15];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = t;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        data += 64;
+    }
+}
+
+#ifdef WS_SHA1_X86
+/*
+ * Four rounds with the SHA extensions. i is the message register holding
+ * w[4g..4g+3] of group g; the schedule for the following groups is
+ * advanced with msg1/msg2/xor, which are dead in the last groups.
+ */
+#define SHA1_GROUP(i, f, eCur, eNext) do { \
+        eCur = _mm_sha1nexte_epu32(eCur, msg[i]); \
+        eNext = abcd; \
+        msg[((i) + 1) & 3] = _mm_sha1msg2_epu32(msg[((i) + 1) & 3], msg[i]); \
+        abcd = _mm_sha1rnds4_epu32(abcd, eCur, f); \
+        msg[((i) + 3) & 3] = _mm_sha1msg1_epu32(msg[((i) + 3) & 3], msg[i]); \
+        msg[((i) + 2) & 3] = _mm_xor_si128(msg[((i) + 2) & 3], msg[i]); \
+    } while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void blocksShaNi(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1B);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+    __m128i e1;
+    __m128i msg[4];
+
+    while (blocks--) {
+        __m128i abcdSave = abcd;
+        __m128i e0Save = e0;
+
+        msg[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), byteSwap);
+        msg[1] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), byteSwap);
+        msg[2] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), byteSwap);
+        msg[3] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), byteSwap);
+
+        // rounds 0-15 only start the schedule
+        e0 = _mm_add_epi32(e0, msg[0]);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        e1 = _mm_sha1nexte_epu32(e1, msg[1]);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        msg[0] = _mm_sha1msg1_epu32(msg[0], msg[1]);
+
+        e0 = _mm_sha1nexte_epu32(e0, msg[2]);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        msg[1] = _mm_sha1msg1_epu32(msg[1], msg[2]);
+        msg[0] = _mm_xor_si128(msg[0], msg[2]);
+
+        SHA1_GROUP(3, 0, e1, e0);
+        SHA1_GROUP(0, 0, e0, e1);
+        SHA1_GROUP(1, 1, e1, e0);
+        SHA1_GROUP(2, 1, e0, e1);
+        SHA1_GROUP(3, 1, e1, e0);
+        SHA1_GROUP(0, 1, e0, e1);
+        SHA1_GROUP(1, 1, e1, e0);
+        SHA1_GROUP(2, 2, e0, e1);
+        SHA1_GROUP(3, 2, e1, e0);
+        SHA1_GROUP(0, 2, e0, e1);
+        SHA1_GROUP(1, 2, e1, e0);
+        SHA1_GROUP(2, 2, e0, e1);
+        SHA1_GROUP(3, 3, e1, e0);
+        SHA1_GROUP(0, 3, e0, e1);
+        SHA1_GROUP(1, 3, e1, e0);
+        SHA1_GROUP(2, 3, e0, e1);
+        SHA1_GROUP(3, 3, e1, e0);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0Save);
+        abcd = _mm_add_epi32(abcd, abcdSave);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+#endif
+
+static blocksFunction kernels[] = {
+    blocksPortable,
+#ifdef WS_SHA1_X86
+    blocksShaNi,
+#endif
+};
+
+int wsSha1KernelSupported(enum wsSha1Kernel kernel)
+{
+    if (kernel >= sizeof(kernels) / sizeof(kernels[0]))
+        return 0;
+#ifdef WS_SHA1_X86
+    if (kernel == WS_SHA1_SHANI) {
+        unsigned int eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+            return 0;
+        return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+    }
+#endif
+    return 1;
+}
+
+static void sha1(blocksFunction blocks, const uint8_t *data, size_t dataLength, uint8_t *digest)
+{
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint8_t tail[128];
+    size_t full = dataLength / 64;
+    size_t rest = dataLength - full * 64;
+    int i;
+
+    blocks(state, data, full);
+
+    // 0x80, zeros, then the bit length; one or two more blocks
+    memcpy(tail, data + full * 64, rest);
+    tail[rest] = 0x80;
+    size_t tailLength = rest < 56 ? 64 : 128;
+    memset(tail + rest + 1, 0, tailLength - rest - 1);
+    uint64_t bits = (uint64_t)dataLength * 8;
+    for (i = 0; i < 8; i++) {
+        tail[tailLength - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    blocks(state, tail, tailLength / 64);
+
+    for (i = 0; i < 5; i++) {
+        digest[4 * i] = (uint8_t)(state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)state[i];
+    }
+}
+
+void wsSha1(const uint8_t *data, size_t dataLength, uint8_t *digest)
+{
+    static blocksFunction selected = NULL;
+
+    // racing first calls store the same pointer
+    if (!selected)
+        selected = kernels[wsSha1KernelSupported(WS_SHA1_SHANI) ? WS_SHA1_SHANI : WS_SHA1_PORTABLE];
+    sha1(selected, data, dataLength, digest);
+}
+
+void wsSha1Kernel(enum wsSha1Kernel kernel, const uint8_t *data, size_t dataLength,
+                  uint8_t *digest)
+{
+    sha1(kernels[kernel], data, dataLength, digest);
+}
+
+#endif
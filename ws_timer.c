@@ -0,0 +1,139 @@
+#include <string.h>
+#include "ws_timer.h"
+
+// the whole wheel spans 2^36 ticks
+#define WS_TIMER_SPAN (WS_TIMER_BITS * WS_TIMER_LEVELS)
+
+static void push(struct ws_timer **head, struct ws_timer *timer)
+{
+    timer->next = *head;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+}
+
+// timers->now is where the wheel stands, expires is not before it
+static void place(struct ws_timers *timers, struct ws_timer *timer)
+{
+    int level = 0;
+    // the finest level whose window holds both now and expires
+    while (level < WS_TIMER_LEVELS - 1
+           && timer->expires >> (WS_TIMER_BITS * (level + 1)) != timers->now >> (WS_TIMER_BITS * (level + 1)))
+        level++;
+
+    timer->level = (uint8_t)level;
+    timer->slot = (uint8_t)((timer->expires >> (WS_TIMER_BITS * level)) & (WS_TIMER_SLOTS - 1));
+    push(&timers->slots[level][timer->slot], timer);
+    timers->occupied[level] |= (uint64_t)1 << timer->slot;
+}
+
+// tick at which the first occupied slot is due, every one lies ahead of now at its level
+static uint64_t nextSlot(const struct ws_timers *timers)
+{
+    uint64_t next = UINT64_MAX;
+    int level;
+
+    for (level = 0; level < WS_TIMER_LEVELS; level++) {
+        if (!timers->occupied[level])
+            continue;
+        int shift = WS_TIMER_BITS * level;
+        uint64_t window = timers->now >> (shift + WS_TIMER_BITS) << (shift + WS_TIMER_BITS);
+        uint64_t tick = window | (uint64_t)__builtin_ctzll(timers->occupied[level]) << shift;
+        if (tick < next)
+            next = tick;
+    }
+    return next;
+}
+
+void ws_timer_init(struct ws_timers *timers, uint64_t now)
+{
+    memset(timers, 0, sizeof(*timers));
+    timers->now = now;
+}
+
+void ws_timer_add(struct ws_timers *timers, struct ws_timer *timer, uint64_t expires)
+{
+    ws_timer_cancel(timers, timer);
+    if (expires <= timers->now)
+        expires = timers->now + 1;
+    // beyond the wheel: due at the end of it, the owner finds it early and adds it again
+    if (expires >> WS_TIMER_SPAN != timers->now >> WS_TIMER_SPAN)
+        expires = timers->now | (((uint64_t)1 << WS_TIMER_SPAN) - 1);
+    timer->expires = expires;
+    place(timers, timer);
+    timers->count++;
+}
+
+void ws_timer_cancel(struct ws_timers *timers, struct ws_timer *timer)
+{
+    if (!timer->pprev)
+        return;
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    if (timer->level < WS_TIMER_LEVELS && !timers->slots[timer->level][timer->slot])
+        timers->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timers->count--;
+}
+
+int ws_timer_pending(const struct ws_timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+uint64_t ws_timer_next(const struct ws_timers *timers)
+{
+    if (timers->expired)
+        return timers->now;
+    return nextSlot(timers);
+}
+
+struct ws_timer *ws_timer_expire(struct ws_timers *timers, uint64_t now)
+{
+    int level;
+
+    while (!timers->expired && timers->now < now) {
+        // straight to the next occupied slot, nothing is due in between
+        uint64_t next = nextSlot(timers);
+        if (next > now) {
+            timers->now = now;
+            break;
+        }
+        timers->now = next;
+
+        // slots whose time has come move down, coarse ones first as they may fill finer ones
+        for (level = WS_TIMER_LEVELS - 1; level > 0; level--) {
+            int shift = WS_TIMER_BITS * level;
+            if (next & (((uint64_t)1 << shift) - 1))
+                continue;
+            int slot = (next >> shift) & (WS_TIMER_SLOTS - 1);
+            struct ws_timer *timer = timers->slots[level][slot];
+            timers->slots[level][slot] = NULL;
+            timers->occupied[level] &= ~((uint64_t)1 << slot);
+            while (timer) {
+                struct ws_timer *following = timer->next;
+                place(timers, timer);
+                timer = following;
+            }
+        }
+
+        int slot = next & (WS_TIMER_SLOTS - 1);
+        struct ws_timer *timer = timers->slots[0][slot];
+        timers->slots[0][slot] = NULL;
+        timers->occupied[0] &= ~((uint64_t)1 << slot);
+        while (timer) {
+            struct ws_timer *following = timer->next;
+            timer->level = WS_TIMER_LEVELS; // on the expired list
+            push(&timers->expired, timer);
+            timer = following;
+        }
+    }
+
+    struct ws_timer *timer = timers->expired;
+    if (timer)
+        ws_timer_cancel(timers, timer);
+    return timer;
+}
@@ -0,0 +1,257 @@
+#include "ws_tls.h"
+
+#ifdef WS_TLS
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const unsigned char sessionContext[] = "cwebsocket";
+
+/*
+ * OpenSSL's socket BIO writes with plain write(), which raises SIGPIPE once
+ * the peer is gone. Writes go out with MSG_NOSIGNAL instead, as on the plain
+ * path. With kTLS the socket BIO has to frame the control records (alerts,
+ * close_notify) itself; those are rare and written with SIGPIPE blocked in
+ * the calling thread only, a signal they raise is taken back.
+ */
+static int socketWrite(BIO *bio, const char *data, int length)
+{
+    int fd = -1;
+
+    BIO_get_fd(bio, &fd);
+#ifdef BIO_get_ktls_send
+    if (BIO_get_ktls_send(bio)) {
+        sigset_t pipeSet, previous, pending;
+        sigemptyset(&pipeSet);
+        sigaddset(&pipeSet, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipeSet, &previous);
+        sigpending(&pending);
+        int wasPending = sigismember(&pending, SIGPIPE);
+        int ret = BIO_meth_get_write(BIO_s_socket())(bio, data, length);
+        int saved = errno;
+        if (ret <= 0 && saved == EPIPE && !wasPending && !sigismember(&previous, SIGPIPE)) {
+            struct timespec now = { 0, 0 };
+            sigtimedwait(&pipeSet, NULL, &now);
+        }
+        pthread_sigmask(SIG_SETMASK, &previous, NULL);
+        errno = saved;
+        return ret;
+    }
+#endif
+    BIO_clear_retry_flags(bio);
+    errno = 0;
+    ssize_t ret = send(fd, data, length, MSG_NOSIGNAL);
+    if (ret <= 0 && BIO_sock_should_retry((int)ret))
+        BIO_set_retry_write(bio);
+    return ret;
+}
+
+static BIO_METHOD *socketMethodNew(void)
+{
+    const BIO_METHOD *socket = BIO_s_socket();
+    BIO_METHOD *method = BIO_meth_new(BIO_TYPE_SOCKET, "websocket socket");
+    if (method == NULL)
+        return NULL;
+    if (BIO_meth_set_write(method, socketWrite) != 1
+        || BIO_meth_set_read(method, BIO_meth_get_read(socket)) != 1
+        || BIO_meth_set_puts(method, BIO_meth_get_puts(socket)) != 1
+        || BIO_meth_set_ctrl(method, BIO_meth_get_ctrl(socket)) != 1
+        || BIO_meth_set_create(method, BIO_meth_get_create(socket)) != 1
+        || BIO_meth_set_destroy(method, BIO_meth_get_destroy(socket)) != 1) {
+        BIO_meth_free(method);
+        return NULL;
+    }
+    return method;
+}
+
+int ws_tls_context_init(struct ws_tls_context *context, const char *certificateFile,
+                        const char *keyFile, long sessionCacheSize, int ktls)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL)
+        return -1;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // the send queue hands over what it holds at the moment, which may be more or less next time
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                          | SSL_MODE_RELEASE_BUFFERS);
+    // a client that just drops the connection is a hangup, not an error
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    // a header and a whole record per recv instead of one read each
+    SSL_CTX_set_read_ahead(ctx, 1);
+
+    // tickets resume without server state; the cache serves clients that offer a session id instead
+    SSL_CTX_set_session_id_context(ctx, sessionContext, sizeof(sessionContext) - 1);
+    if (sessionCacheSize > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, sessionCacheSize);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, certificateFile) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1
+        || (context->socketMethod = socketMethodNew()) == NULL) {
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    context->ctx = ctx;
+    return 0;
+}
+
+void ws_tls_context_free(struct ws_tls_context *context)
+{
+    SSL_CTX_free(context->ctx);
+    BIO_meth_free(context->socketMethod);
+    memset(context, 0, sizeof(*context));
+}
+
+int ws_tls_open(struct ws_tls *tls, struct ws_tls_context *context, int socket)
+{
+    memset(tls, 0, sizeof(*tls));
+    tls->ssl = SSL_new(context->ctx);
+    if (tls->ssl == NULL)
+        return -1;
+    BIO *bio = BIO_new(context->socketMethod);
+    if (bio == NULL) {
+        SSL_free(tls->ssl);
+        tls->ssl = NULL;
+        return -1;
+    }
+    BIO_set_fd(bio, socket, BIO_NOCLOSE);
+    SSL_set_bio(tls->ssl, bio, bio);
+    SSL_set_accept_state(tls->ssl);
+    return 0;
+}
+
+// -1 or 0 with errno, as the socket calls would have returned
+static ssize_t failed(struct ws_tls *tls, int ret)
+{
+    switch (SSL_get_error(tls->ssl, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        tls->failed = 1;
+        // errno may be left over from an earlier call, a retry would never end
+        if (errno == 0 || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            errno = ECONNRESET;
+        return -1;
+    default:
+        tls->failed = 1;
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+int ws_tls_handshake(struct ws_tls *tls)
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake(tls->ssl);
+    if (ret == 1) {
+        tls->established = 1;
+        tls->wantWrite = 0;
+        tls->resumed = SSL_session_reused(tls->ssl) == 1;
+#ifdef BIO_get_ktls_send
+        tls->ktlsSend = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) != 0;
+#endif
+        return 1;
+    }
+    tls->wantWrite = SSL_get_error(tls->ssl, ret) == SSL_ERROR_WANT_WRITE;
+    if (failed(tls, ret) == -1 && errno == EAGAIN)
+        return 0;
+    tls->failed = 1;
+    return -1;
+}
+
+ssize_t ws_tls_read(struct ws_tls *tls, void *buffer, size_t length)
+{
+    size_t readed = 0;
+    ERR_clear_error();
+    if (SSL_read_ex(tls->ssl, buffer, length, &readed) == 1) {
+        tls->wantWrite = 0;
+        return readed;
+    }
+    tls->wantWrite = SSL_get_error(tls->ssl, 0) == SSL_ERROR_WANT_WRITE;
+    return failed(tls, 0);
+}
+
+ssize_t ws_tls_writev(struct ws_tls *tls, const struct iovec *iov, int iovcnt)
+{
+    static __thread uint8_t gathered[WS_TLS_RECORD];
+    size_t total = 0;
+    size_t offset = 0; // into iov[0]
+
+    /*
+     * Every write is the next WS_TLS_RECORD bytes, or all there are: a write
+     * that has to be retried must be offered at least as many bytes again,
+     * and the queue holding them may be laid out in other buffers by then.
+     * Small buffers are copied together, as one sendmsg would have put them
+     * into one segment; a big one is written from where it is.
+     */
+    while (iovcnt > 0) {
+        const uint8_t *data = (const uint8_t *)iov[0].iov_base + offset;
+        size_t length = iov[0].iov_len - offset;
+        if (length >= WS_TLS_RECORD) {
+            length = WS_TLS_RECORD;
+        } else if (iovcnt > 1) {
+            memcpy(gathered, data, length);
+            for (int i = 1; i < iovcnt && length < WS_TLS_RECORD; i++) {
+                size_t part = iov[i].iov_len < WS_TLS_RECORD - length ? iov[i].iov_len : WS_TLS_RECORD - length;
+                memcpy(gathered + length, iov[i].iov_base, part);
+                length += part;
+            }
+            data = gathered;
+        }
+
+        size_t written = 0;
+        ERR_clear_error();
+        if (length > 0 && SSL_write_ex(tls->ssl, data, length, &written) != 1) {
+            // what went out already is reported, the error shows again on the next call
+            if (total > 0)
+                return total;
+            if (failed(tls, 0) == 0)
+                errno = EPIPE;
+            return -1;
+        }
+        total += written;
+        offset += written;
+        while (iovcnt > 0 && offset >= iov[0].iov_len) {
+            offset -= iov[0].iov_len;
+            iov++;
+            iovcnt--;
+        }
+    }
+    return total;
+}
+
+void ws_tls_close(struct ws_tls *tls)
+{
+    if (tls->ssl == NULL)
+        return;
+    // the socket is about to close, close_notify goes out only if it fits right away
+    if (tls->established && !tls->failed) {
+        ERR_clear_error();
+        SSL_shutdown(tls->ssl);
+    }
+    SSL_free(tls->ssl);
+    memset(tls, 0, sizeof(*tls));
+}
+
+#endif /* WS_TLS */
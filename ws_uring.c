@@ -0,0 +1,257 @@
+#include "ws_uring.h"
+
+#ifdef WS_USE_URING
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// the one group of provided receive buffers
+#define WS_URING_GROUP 0
+
+static int uringSetup(unsigned entries, struct io_uring_params *params)
+{
+    int fd = (int)syscall(__NR_io_uring_setup, entries, params);
+    return fd == -1 ? -errno : fd;
+}
+
+static int uringEnter(int fd, unsigned submit, unsigned wait, int timeout)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    void *argp = NULL;
+    size_t argSize = 0;
+
+    if (wait && timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argSize = sizeof(arg);
+    }
+    int ret = (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, argp, argSize);
+    return ret == -1 ? -errno : ret;
+}
+
+static int uringRegister(int fd, unsigned opcode, void *arg, unsigned count)
+{
+    int ret = (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+    return ret == -1 ? -errno : ret;
+}
+
+static void *mapRing(int fd, size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+int ws_uring_init(struct ws_uring *ring, unsigned entries, unsigned bufCount, unsigned bufSize)
+{
+    struct io_uring_params params;
+    unsigned i;
+    int ret;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    // only this thread submits, completion work runs when it enters the kernel anyway
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    ret = uringSetup(entries, &params);
+    if (ret == -EINVAL) {
+        memset(&params, 0, sizeof(params));
+        ret = uringSetup(entries, &params);
+    }
+    if (ret < 0)
+        return ret;
+    ring->fd = ret;
+    if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        ret = -ENOSYS;
+        goto fail;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqRing = mapRing(ring->fd, ring->sqRingSize, IORING_OFF_SQ_RING);
+    ring->cqRing = mapRing(ring->fd, ring->cqRingSize, IORING_OFF_CQ_RING);
+    ring->sqes = mapRing(ring->fd, ring->sqesSize, IORING_OFF_SQES);
+    if (!ring->sqRing || !ring->cqRing || !ring->sqes) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ring->sqHead = (unsigned *)((uint8_t *)ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned *)((uint8_t *)ring->sqRing + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)((uint8_t *)ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)((uint8_t *)ring->sqRing + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->cqHead = (unsigned *)((uint8_t *)ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned *)((uint8_t *)ring->cqRing + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)((uint8_t *)ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cqRing + params.cq_off.cqes);
+    // entries map one to one to slots, the indirection is never used
+    for (i = 0; i < ring->sqEntries; i++)
+        ring->sqArray[i] = i;
+
+    // the buffer ring and the buffers live in one page aligned mapping
+    ring->bufCount = bufCount;
+    ring->bufSize = bufSize;
+    ring->bufRingSize = bufCount * sizeof(struct io_uring_buf) + (size_t)bufCount * bufSize;
+    ring->bufRing = mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufRing == MAP_FAILED) {
+        ring->bufRing = NULL;
+        ret = -ENOMEM;
+        goto fail;
+    }
+    ring->buffers = (uint8_t *)ring->bufRing + bufCount * sizeof(struct io_uring_buf);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+    reg.ring_entries = bufCount;
+    reg.bgid = WS_URING_GROUP;
+    ret = uringRegister(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (ret < 0)
+        goto fail;
+    for (i = 0; i < bufCount; i++) {
+        struct io_uring_buf *buf = &ring->bufRing->bufs[i];
+        buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)i * bufSize);
+        buf->len = bufSize;
+        buf->bid = (uint16_t)i;
+    }
+    __atomic_store_n(&ring->bufRing->tail, (uint16_t)bufCount, __ATOMIC_RELEASE);
+    return 0;
+
+fail:
+    ws_uring_free(ring);
+    return ret;
+}
+
+void ws_uring_free(struct ws_uring *ring)
+{
+    // closing the ring cancels every request still in flight
+    if (ring->fd != -1)
+        close(ring->fd);
+    if (ring->bufRing)
+        munmap(ring->bufRing, ring->bufRingSize);
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing)
+        munmap(ring->sqRing, ring->sqRingSize);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *ws_uring_sqe(struct ws_uring *ring)
+{
+    // entries are published to the kernel all at once by ws_uring_submit()
+    unsigned tail = *ring->sqTail + ring->sqPending;
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries) {
+        ws_uring_submit(ring, 0, -1);
+        tail = *ring->sqTail + ring->sqPending;
+        if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqPending++;
+    return sqe;
+}
+
+int ws_uring_submit(struct ws_uring *ring, unsigned wait, int timeout)
+{
+    __atomic_store_n(ring->sqTail, *ring->sqTail + ring->sqPending, __ATOMIC_RELEASE);
+    ring->sqPending = 0;
+    // published entries the kernel didn't take last time are submitted again
+    unsigned submit = *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+    int ret = uringEnter(ring->fd, submit, wait, timeout);
+    // EBUSY: the completion queue must be reaped before the kernel takes more
+    if (ret == -EAGAIN || ret == -EBUSY || ret == -ETIME)
+        return 0;
+    return ret < 0 ? ret : 0;
+}
+
+struct io_uring_cqe *ws_uring_cqe(struct ws_uring *ring)
+{
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void ws_uring_cqe_seen(struct ws_uring *ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+uint8_t *ws_uring_buffer(struct ws_uring *ring, const struct io_uring_cqe *cqe)
+{
+    return ring->buffers + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * ring->bufSize;
+}
+
+void ws_uring_buffer_recycle(struct ws_uring *ring, const struct io_uring_cqe *cqe)
+{
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    uint16_t tail = ring->bufRing->tail;
+    struct io_uring_buf *buf = &ring->bufRing->bufs[tail & (ring->bufCount - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * ring->bufSize);
+    buf->len = ring->bufSize;
+    buf->bid = bid;
+    __atomic_store_n(&ring->bufRing->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+void ws_uring_prep_accept(struct io_uring_sqe *sqe, int fd, int flags)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = flags;
+}
+
+void ws_uring_prep_recv(struct io_uring_sqe *sqe, int fd)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = WS_URING_GROUP;
+}
+
+void ws_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const void *msg, unsigned flags)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+}
+
+void ws_uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buffer, unsigned length)
+{
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = (uint64_t)-1; // current position, eventfds have none
+}
+
+void ws_uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t userData)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = userData;
+}
+
+#endif /* WS_USE_URING */
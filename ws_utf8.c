@@ -0,0 +1,536 @@
+#include <string.h>
+#include "ws_utf8.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define WS_UTF8_X86
+    #include <immintrin.h>
+#endif
+
+// below this the kernel selection costs more than it saves
+#define WS_UTF8_SMALL 16
+
+// non-ASCII stretch the word kernel goes through before looking at words again
+#define WS_UTF8_STRETCH 32
+
+typedef int (*utf8Function)(struct wsUtf8State *state, uint8_t *data, size_t dataLength,
+                            const uint8_t *maskingKey, size_t keyOffset);
+
+void wsInitUtf8(struct wsUtf8State *state)
+{
+    state->needed = 0;
+    state->low = 0x80;
+    state->high = 0xBF;
+}
+
+int wsUtf8Complete(const struct wsUtf8State *state)
+{
+    return state->needed == 0;
+}
+
+/*
+ * One byte through the sequence state machine. A lead byte narrows the
+ * range of the byte after it where RFC 3629 rules out overlong forms (E0,
+ * F0), surrogates (ED) and code points above U+10FFFF (F4).
+ */
+static int step(struct wsUtf8State *state, uint8_t c)
+{
+    if (state->needed) {
+        if (c < state->low || c > state->high)
+            return 0;
+        state->needed--;
+        state->low = 0x80;
+        state->high = 0xBF;
+        return 1;
+    }
+    if (c < 0x80)
+        return 1;
+    // continuation without lead, overlong 2 byte forms, beyond U+10FFFF
+    if (c < 0xC2 || c > 0xF4)
+        return 0;
+    if (c < 0xE0) {
+        state->needed = 1;
+    } else if (c < 0xF0) {
+        state->needed = 2;
+        if (c == 0xE0)
+            state->low = 0xA0;
+        else if (c == 0xED)
+            state->high = 0x9F;
+    } else {
+        state->needed = 3;
+        if (c == 0xF0)
+            state->low = 0x90;
+        else if (c == 0xF4)
+            state->high = 0x8F;
+    }
+    return 1;
+}
+
+static int utf8Scalar(struct wsUtf8State *state, uint8_t *data, size_t dataLength,
+                      const uint8_t *maskingKey, size_t keyOffset)
+{
+    size_t i;
+    for (i = 0; i < dataLength; i++) {
+        if (maskingKey)
+            data[i] ^= maskingKey[(keyOffset + i) & 3];
+        if (!step(state, data[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static void rotateKey(uint8_t *out, size_t outLength, const uint8_t *maskingKey,
+                      size_t keyOffset)
+{
+    size_t i;
+    for (i = 0; i < outLength; i++) {
+        out[i] = maskingKey[(keyOffset + i) & 3];
+    }
+}
+
+/*
+ * The same state machine for the word kernel, as one row per byte class
+ * with the next state of every state, 6 bits each; a state is its shift
+ * in the row. Nothing branches on the text, which is what makes the byte
+ * loop slow on mixed text, and the loads don't wait for the state.
+ */
+#define STATE_BITS 6
+#define ACCEPT (0 * STATE_BITS)
+#define REJECT (1 * STATE_BITS)
+#define ROW(s0, s1, s2, s3, s4, s5, s6, s7, s8) \
+    ((uint64_t)(s0) * STATE_BITS | (uint64_t)(s1) * STATE_BITS << 6 | \
+     (uint64_t)(s2) * STATE_BITS << 12 | (uint64_t)(s3) * STATE_BITS << 18 | \
+     (uint64_t)(s4) * STATE_BITS << 24 | (uint64_t)(s5) * STATE_BITS << 30 | \
+     (uint64_t)(s6) * STATE_BITS << 36 | (uint64_t)(s7) * STATE_BITS << 42 | \
+     (uint64_t)(s8) * STATE_BITS << 48)
+
+static const uint8_t byteClass[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 00..7F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 80..8F
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, // 90..9F
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, // A0..BF
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+    4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, // C0, C1, C2..DF
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 7, // E0, E1..EC, ED, EE..EF
+    9, 10, 10, 10, 11, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4 // F0, F1..F3, F4, F5..FF
+};
+
+/*
+ * States: accept, reject, one more, two more, two more after E0 (A0..BF),
+ * two more after ED (80..9F), three more, three more after F0 (90..BF),
+ * three more after F4 (80..8F).
+ */
+static const uint64_t classRow[12] = {
+    ROW(0, 1, 1, 1, 1, 1, 1, 1, 1), // 00..7F
+    ROW(1, 1, 0, 2, 1, 2, 3, 1, 3), // 80..8F
+    ROW(1, 1, 0, 2, 1, 2, 3, 3, 1), // 90..9F
+    ROW(1, 1, 0, 2, 2, 1, 3, 3, 1), // A0..BF
+    ROW(1, 1, 1, 1, 1, 1, 1, 1, 1), // C0, C1, F5..FF
+    ROW(2, 1, 1, 1, 1, 1, 1, 1, 1), // C2..DF
+    ROW(4, 1, 1, 1, 1, 1, 1, 1, 1), // E0
+    ROW(3, 1, 1, 1, 1, 1, 1, 1, 1), // E1..EC, EE..EF
+    ROW(5, 1, 1, 1, 1, 1, 1, 1, 1), // ED
+    ROW(7, 1, 1, 1, 1, 1, 1, 1, 1), // F0
+    ROW(6, 1, 1, 1, 1, 1, 1, 1, 1), // F1..F3
+    ROW(8, 1, 1, 1, 1, 1, 1, 1, 1) // F4
+};
+
+// wsUtf8State of each table state, the reject state is never stored back
+static const struct wsUtf8State stateOf[9] = {
+    { 0, 0x80, 0xBF }, { 0, 0x80, 0xBF }, { 1, 0x80, 0xBF },
+    { 2, 0x80, 0xBF }, { 2, 0xA0, 0xBF }, { 2, 0x80, 0x9F },
+    { 3, 0x80, 0xBF }, { 3, 0x90, 0xBF }, { 3, 0x80, 0x8F }
+};
+
+static unsigned tableState(const struct wsUtf8State *state)
+{
+    switch (state->needed) {
+    case 0:
+        return 0;
+    case 1:
+        return 2;
+    case 2:
+        return state->low == 0xA0 ? 4 : state->high == 0x9F ? 5 : 3;
+    default:
+        return state->low == 0x90 ? 7 : state->high == 0x8F ? 8 : 6;
+    }
+}
+
+/*
+ * Whole words for ASCII runs outside a sequence. Anything else goes through
+ * the rows for at least WS_UTF8_STRETCH bytes, up to a word boundary
+ * outside a sequence, so mixed text doesn't switch back and forth.
+ */
+static int utf8Word(struct wsUtf8State *state, uint8_t *data, size_t dataLength,
+                    const uint8_t *maskingKey, size_t keyOffset)
+{
+    size_t boundary = (sizeof(uint64_t) - ((uintptr_t)data & (sizeof(uint64_t) - 1))) & (sizeof(uint64_t) - 1);
+    unsigned current = tableState(state) * STATE_BITS;
+    size_t i = 0;
+
+    uint64_t mask64 = 0;
+    if (maskingKey) {
+        uint8_t pattern[sizeof(uint64_t)];
+        rotateKey(pattern, sizeof(pattern), maskingKey, keyOffset + boundary);
+        memcpy(&mask64, pattern, sizeof(mask64));
+    }
+
+    while (i < dataLength) {
+        size_t stop = boundary;
+        if (i >= boundary && current == ACCEPT) {
+            for (; i + sizeof(uint64_t) <= dataLength; i += sizeof(uint64_t)) {
+                uint64_t word;
+                memcpy(&word, &data[i], sizeof(word));
+                word ^= mask64;
+                if (word & 0x8080808080808080ull)
+                    break;
+                if (maskingKey)
+                    memcpy(&data[i], &word, sizeof(word));
+            }
+            stop = i + WS_UTF8_STRETCH;
+        }
+        if (stop > dataLength)
+            stop = dataLength;
+        for (;;) {
+            for (; i < stop; i++) {
+                if (maskingKey)
+                    data[i] ^= maskingKey[(keyOffset + i) & 3];
+                current = (classRow[byteClass[data[i]]] >> current) & 63;
+            }
+            if (current == REJECT)
+                return 0;
+            if (current == ACCEPT || i == dataLength)
+                break;
+            // a sequence is open, finish it up to the next word boundary
+            stop = i + sizeof(uint64_t) - ((i - boundary) & (sizeof(uint64_t) - 1));
+            if (stop > dataLength)
+                stop = dataLength;
+        }
+    }
+    *state = stateOf[current / STATE_BITS];
+    return 1;
+}
+
+#undef STATE_BITS
+#undef ACCEPT
+#undef REJECT
+#undef ROW
+
+#ifdef WS_UTF8_X86
+/*
+ * The vector kernels classify every byte by the high nibble of the byte
+ * before it, the low nibble of the byte before it and its own high nibble
+ * (Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per
+ * Byte"). Each lookup gives the error classes the nibble is compatible
+ * with; a pair is invalid when a class survives all three. Third and
+ * fourth bytes of longer sequences are found by looking 2 and 3 bytes back.
+ */
+#define TOO_SHORT (1 << 0) // lead byte not followed by a continuation
+#define TOO_LONG (1 << 1) // continuation after ASCII
+#define OVERLONG_3 (1 << 2) // E0 80..9F
+#define TOO_LARGE (1 << 3) // F4 90..BF, F5..FF
+#define SURROGATE (1 << 4) // ED A0..BF
+#define OVERLONG_2 (1 << 5) // C0, C1
+#define TOO_LARGE_1000 (1 << 6) // F5..FF 80..8F
+#define OVERLONG_4 (1 << 6) // F0 80..8F
+#define TWO_CONTS ((char)(1 << 7)) // continuation after continuation, unless 2 or 3 bytes after a lead
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS) // decided by the high nibble alone
+
+#define BYTE_1_HIGH \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+    TOO_SHORT | OVERLONG_2, \
+    TOO_SHORT, \
+    TOO_SHORT | OVERLONG_3 | SURROGATE, \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+    CARRY | OVERLONG_2, \
+    CARRY, CARRY, \
+    CARRY | TOO_LARGE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+// last bytes of a block above these start a sequence the block doesn't finish
+#define INCOMPLETE_TAIL (char)0xEF, (char)0xDF, (char)0xBF
+
+static int32_t rotatedKey32(const uint8_t *maskingKey, size_t keyOffset)
+{
+    uint8_t pattern[4];
+    int32_t mask32;
+    rotateKey(pattern, sizeof(pattern), maskingKey, keyOffset);
+    memcpy(&mask32, pattern, sizeof(mask32));
+    return mask32;
+}
+
+// scalar until the sequence the previous call ended in is complete
+static int finishSequence(struct wsUtf8State *state, uint8_t *data, size_t dataLength,
+                          const uint8_t *maskingKey, size_t keyOffset, size_t *used)
+{
+    size_t i;
+    for (i = 0; i < dataLength && state->needed; i++) {
+        if (maskingKey)
+            data[i] ^= maskingKey[(keyOffset + i) & 3];
+        if (!step(state, data[i]))
+            return 0;
+    }
+    *used = i;
+    return 1;
+}
+
+/*
+ * The vector loop checked [start, end) but a sequence running past end:
+ * that one is checked again from its lead byte, followed by the rest.
+ */
+static int finishTail(struct wsUtf8State *state, uint8_t *data, size_t start, size_t end,
+                      size_t dataLength, const uint8_t *maskingKey, size_t keyOffset)
+{
+    size_t back, restart = end;
+
+    for (back = 1; back <= 3 && back <= end - start; back++) {
+        uint8_t c = data[end - back];
+        if (c < 0x80)
+            break;
+        if (c >= 0xC0) {
+            if (back < (c >= 0xF0 ? 4u : c >= 0xE0 ? 3u : 2u))
+                restart = end - back;
+            break;
+        }
+    }
+    // unmasked already
+    if (!utf8Scalar(state, &data[restart], end - restart, NULL, 0))
+        return 0;
+    return utf8Word(state, &data[end], dataLength - end, maskingKey, keyOffset + end);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i checkSsse3(__m128i input, __m128i previous)
+{
+    const __m128i low4 = _mm_set1_epi8(0x0F);
+    const __m128i byte1HighTable = _mm_setr_epi8(BYTE_1_HIGH);
+    const __m128i byte1LowTable = _mm_setr_epi8(BYTE_1_LOW);
+    const __m128i byte2HighTable = _mm_setr_epi8(BYTE_2_HIGH);
+
+    __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+    __m128i byte1High = _mm_shuffle_epi8(byte1HighTable, _mm_and_si128(_mm_srli_epi16(prev1, 4), low4));
+    __m128i byte1Low = _mm_shuffle_epi8(byte1LowTable, _mm_and_si128(prev1, low4));
+    __m128i byte2High = _mm_shuffle_epi8(byte2HighTable, _mm_and_si128(_mm_srli_epi16(input, 4), low4));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+    // only 111_____ 2 back and 1111____ 3 back reach 0x80
+    __m128i third = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 14), _mm_set1_epi8(0xE0 - 0x80));
+    __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 13), _mm_set1_epi8(0xF0 - 0x80));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23, special);
+}
+
+__attribute__((target("ssse3")))
+static int utf8Ssse3(struct wsUtf8State *state, uint8_t *data, size_t dataLength,
+                     const uint8_t *maskingKey, size_t keyOffset)
+{
+    size_t i, start;
+    if (!finishSequence(state, data, dataLength, maskingKey, keyOffset, &i))
+        return 0;
+    start = i;
+
+    const __m128i mask128 = _mm_set1_epi32(maskingKey ? rotatedKey32(maskingKey, keyOffset + i) : 0);
+    const __m128i maxValue = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                           INCOMPLETE_TAIL);
+    __m128i previous = _mm_setzero_si128();
+    __m128i incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+
+    for (; i + 64 <= dataLength; i += 64) {
+        __m128i *p = (__m128i *)&data[i];
+        __m128i in0 = _mm_xor_si128(_mm_loadu_si128(p), mask128);
+        __m128i in1 = _mm_xor_si128(_mm_loadu_si128(p + 1), mask128);
+        __m128i in2 = _mm_xor_si128(_mm_loadu_si128(p + 2), mask128);
+        __m128i in3 = _mm_xor_si128(_mm_loadu_si128(p + 3), mask128);
+        if (maskingKey) {
+            _mm_storeu_si128(p, in0);
+            _mm_storeu_si128(p + 1, in1);
+            _mm_storeu_si128(p + 2, in2);
+            _mm_storeu_si128(p + 3, in3);
+        }
+        // ASCII: only a sequence it cuts off is an error
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(in0, in1), _mm_or_si128(in2, in3))) == 0) {
+            error = _mm_or_si128(error, incomplete);
+        } else {
+            error = _mm_or_si128(error, checkSsse3(in0, previous));
+            error = _mm_or_si128(error, checkSsse3(in1, in0));
+            error = _mm_or_si128(error, checkSsse3(in2, in1));
+            error = _mm_or_si128(error, checkSsse3(in3, in2));
+            incomplete = _mm_subs_epu8(in3, maxValue);
+        }
+        previous = in3;
+    }
+    for (; i + 16 <= dataLength; i += 16) {
+        __m128i *p = (__m128i *)&data[i];
+        __m128i input = _mm_xor_si128(_mm_loadu_si128(p), mask128);
+        if (maskingKey)
+            _mm_storeu_si128(p, input);
+        if (_mm_movemask_epi8(input) == 0) {
+            error = _mm_or_si128(error, incomplete);
+        } else {
+            error = _mm_or_si128(error, checkSsse3(input, previous));
+            incomplete = _mm_subs_epu8(input, maxValue);
+        }
+        previous = input;
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF)
+        return 0;
+    return finishTail(state, data, start, i, dataLength, maskingKey, keyOffset);
+}
+
+// the n bytes before input, across the 128 bit lanes
+#define PREVIOUS_AVX2(input, previous, n) \
+    _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static inline __m256i checkAvx2(__m256i input, __m256i previous)
+{
+    const __m256i low4 = _mm256_set1_epi8(0x0F);
+    const __m256i byte1HighTable = _mm256_setr_epi8(BYTE_1_HIGH, BYTE_1_HIGH);
+    const __m256i byte1LowTable = _mm256_setr_epi8(BYTE_1_LOW, BYTE_1_LOW);
+    const __m256i byte2HighTable = _mm256_setr_epi8(BYTE_2_HIGH, BYTE_2_HIGH);
+
+    __m256i prev1 = PREVIOUS_AVX2(input, previous, 1);
+    __m256i byte1High = _mm256_shuffle_epi8(byte1HighTable, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low4));
+    __m256i byte1Low = _mm256_shuffle_epi8(byte1LowTable, _mm256_and_si256(prev1, low4));
+    __m256i byte2High = _mm256_shuffle_epi8(byte2HighTable, _mm256_and_si256(_mm256_srli_epi16(input, 4), low4));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+    __m256i third = _mm256_subs_epu8(PREVIOUS_AVX2(input, previous, 2), _mm256_set1_epi8(0xE0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(PREVIOUS_AVX2(input, previous, 3), _mm256_set1_epi8(0xF0 - 0x80));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23, special);
+}
+
+__attribute__((target("avx2")))
+static int utf8Avx2(struct wsUtf8State *state, uint8_t *data, size_t dataLength,
+                    const uint8_t *maskingKey, size_t keyOffset)
+{
+    size_t i, start;
+    if (!finishSequence(state, data, dataLength, maskingKey, keyOffset, &i))
+        return 0;
+    start = i;
+
+    const __m256i mask256 = _mm256_set1_epi32(maskingKey ? rotatedKey32(maskingKey, keyOffset + i) : 0);
+    const __m256i maxValue = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                              -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                              -1, INCOMPLETE_TAIL);
+    __m256i previous = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+
+    for (; i + 64 <= dataLength; i += 64) {
+        __m256i *p = (__m256i *)&data[i];
+        __m256i in0 = _mm256_xor_si256(_mm256_loadu_si256(p), mask256);
+        __m256i in1 = _mm256_xor_si256(_mm256_loadu_si256(p + 1), mask256);
+        if (maskingKey) {
+            _mm256_storeu_si256(p, in0);
+            _mm256_storeu_si256(p + 1, in1);
+        }
+        if (_mm256_movemask_epi8(_mm256_or_si256(in0, in1)) == 0) {
+            error = _mm256_or_si256(error, incomplete);
+        } else {
+            error = _mm256_or_si256(error, checkAvx2(in0, previous));
+            error = _mm256_or_si256(error, checkAvx2(in1, in0));
+            incomplete = _mm256_subs_epu8(in1, maxValue);
+        }
+        previous = in1;
+    }
+    for (; i + 32 <= dataLength; i += 32) {
+        __m256i *p = (__m256i *)&data[i];
+        __m256i input = _mm256_xor_si256(_mm256_loadu_si256(p), mask256);
+        if (maskingKey)
+            _mm256_storeu_si256(p, input);
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, incomplete);
+        } else {
+            error = _mm256_or_si256(error, checkAvx2(input, previous));
+            incomplete = _mm256_subs_epu8(input, maxValue);
+        }
+        previous = input;
+    }
+    int valid = _mm256_testz_si256(error, error);
+    // the tail is SSE code, see maskAvx2()
+    _mm256_zeroupper();
+    if (!valid)
+        return 0;
+    return finishTail(state, data, start, i, dataLength, maskingKey, keyOffset);
+}
+#endif
+
+static utf8Function kernels[] = {
+    utf8Scalar,
+    utf8Word,
+#ifdef WS_UTF8_X86
+    utf8Ssse3,
+    utf8Avx2,
+#endif
+};
+
+int wsUtf8KernelSupported(enum wsUtf8Kernel kernel)
+{
+    if (kernel >= sizeof(kernels) / sizeof(kernels[0]))
+        return 0;
+#ifdef WS_UTF8_X86
+    if (kernel == WS_UTF8_SSSE3)
+        return __builtin_cpu_supports("ssse3");
+    if (kernel == WS_UTF8_AVX2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+static utf8Function selectKernel(void)
+{
+    if (wsUtf8KernelSupported(WS_UTF8_AVX2))
+        return kernels[WS_UTF8_AVX2];
+    if (wsUtf8KernelSupported(WS_UTF8_SSSE3))
+        return kernels[WS_UTF8_SSSE3];
+    return utf8Word;
+}
+
+int wsUnmaskUtf8(struct wsUtf8State *state, uint8_t *data, size_t dataLength,
+                 const uint8_t *maskingKey, size_t keyOffset)
+{
+    static utf8Function kernel = NULL;
+
+    if (dataLength < WS_UTF8_SMALL)
+        return utf8Scalar(state, data, dataLength, maskingKey, keyOffset);
+    // racing first calls store the same pointer
+    utf8Function selected = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (!selected) {
+        selected = selectKernel();
+        __atomic_store_n(&kernel, selected, __ATOMIC_RELAXED);
+    }
+    return selected(state, data, dataLength, maskingKey, keyOffset);
+}
+
+int wsUnmaskUtf8Kernel(enum wsUtf8Kernel kernel, struct wsUtf8State *state, uint8_t *data,
+                       size_t dataLength, const uint8_t *maskingKey, size_t keyOffset)
+{
+    return kernels[kernel](state, data, dataLength, maskingKey, keyOffset);
+}
@@ -1,35 +1,695 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
 #include "ws_wrapper_server.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <limits.h>
+#ifdef WS_TLS
+#endif
+
+#if defined(__linux__) && !defined(ESP_PLATFORM)
+#define WS_USE_EPOLL
+#endif
+#if defined(WS_USE_URING) && !defined(WS_USE_EPOLL)
+#error "WS_USE_URING needs Linux"
+#endif
+#ifndef ESP_PLATFORM
+#define WS_USE_HANDOFF
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 static const char *TAG = "ws_wrapper_server";
 
-static void websocket_listen(void *pvParameters);
-static void websocket_manage(void *pvParameters);
-static void websocket_select(void *pvParameters);
+// label values of websocket_closed_total, in enum websocket_close_reason order
+static const char *closeReasonNames[WS_CLOSE_REASONS] = {
+    "normal", "hangup", "protocol", "too_big", "timeout", "not_found", "resource", "handoff"
+};
+
+struct ws_connection {
+    int socket;
+    enum wsState state;
+    enum wsFrameType frameType;
+    struct ws_ringbuf rx;
+    struct wsFrameParser parser;
+    struct ws_buffer message; // fragments of the current message
+    size_t maxMessageSize; // set from any thread, atomic
+    enum wsFrameType messageType;
+    uint8_t streaming; // current message goes to onChunk
+    uint64_t streamOffset; // message bytes passed to onChunk by previous fragments
+    uint8_t congested; // out went above the high watermark and hasn't drained to the low one yet
+#ifdef WS_DEFLATE
+    struct ws_deflate deflate; // permessage-deflate streams, params.enabled once negotiated; the deflater under sendLock
+#endif
+#ifdef WS_TLS
+    struct ws_tls tls; // used under sendLock, like the socket
+#endif
+    pthread_mutex_t sendLock; // any thread may send, the event loop flushes
+    struct ws_queue out; // bytes the socket didn't take yet
+    struct ws_shard *shard; // event loop serving this connection
+    struct ws_connection *next; // in the shard's free list, or its open list with select
+#ifndef WS_USE_EPOLL
+    struct ws_connection *prev; // in the open list
+#endif
+    struct ws_timer timer; // next deadline of the current state
+    uint64_t lastSeen; // ms, when data last came in
+    uint64_t lastPing; // ms, when the last ping went out
+    uint64_t opened; // ms
+    enum websocket_close_reason closeReason; // why the server started the closing handshake
+    const struct websocket_callbacks *callbacks; // of the matched route, bound at the handshake
+    void *context; // of the callbacks
+    struct ws_buffer resource; // NUL terminated, once the handshake is accepted
+    struct ws_route_match route; // parameters, offsets into resource
+    uint8_t established; // onOpen accepted it, onClose is due
+    struct websocket_connection_stats stats; // in by the event loop, out under sendLock
+    uint64_t recvAt; // ns, of the recv being handled, 0 in between
+    uint64_t sentAt; // ns, of the first send since recvAt
+    struct ws_subscription *subscriptions; // under the shard's topicLock
+#ifdef WS_USE_HANDOFF
+    uint8_t handedOff; // the queue went to the successor, nothing may be sent anymore
+    uint8_t adopted; // taken over established, onOpen runs again on the event loop
+    struct ws_connection *nextAdopted;
+#endif
+#ifdef WS_USE_URING
+    uint8_t receiving; // multishot recv armed, the slot is not reused before it ends
+    uint8_t sending; // sendMsg in flight, it points into out
+    uint8_t pendingFlush; // on the shard's pending list, sendLock held
+    struct ws_connection *nextPending;
+    struct msghdr sendMsg;
+    struct iovec sendIov[MAX_IOV];
+#endif
+};
+
+/*
+ * One event loop with its own listening socket, connections and buffers.
+ * Shards share only the callbacks, each has its own topics and can run on its own core.
+ */
+struct ws_shard {
+    int index;
+    int cpu; // -1 if not pinned
+    int listenSocket;
+#ifdef WS_USE_EPOLL
+    int epollFd;
+    int wakeFd; // eventfd other threads poke: data queued for the ring, a handoff
+#endif
+#ifdef WS_USE_URING
+    uint8_t uring; // ring is used, otherwise the kernel doesn't support it and epoll is
+    struct ws_uring ring;
+    pthread_t thread;
+    uint64_t wakeValue;
+    uint8_t accepting; // multishot accept armed
+    uint8_t cancelled; // a handoff cancelled every request
+    int inflight; // accept, recv and send requests whose last completion is still due
+    pthread_mutex_t pendingLock;
+    struct ws_connection *pending; // queued data, no send submitted yet
+#endif
+    struct ws_connection *freeConnections; // closed, reused by the next accepts
+#ifndef WS_USE_EPOLL
+    struct ws_connection *openConnections;
+    fd_set readSet; // listening socket and open connections, kept up to date by open and close
+#endif
+#ifdef WS_USE_HANDOFF
+    struct ws_connection *adopted; // taken over, the event loop registers them when it starts
+#endif
+    struct ws_pool pool;
+    struct handshake hs;
+    struct ws_timers timers; // one per connection
+    uint64_t now; // ms, read after every wait
+    uint8_t buffer[BUF_LEN];
+    struct websocket_shard_stats stats; // written by the shard, out counters by any thread
+    struct ws_histogram callbackLatency; // written by the shard only
+    struct ws_histogram replyLatency;
+    /*
+     * Topics of this shard's connections, hashed by name. The event loop
+     * takes topicLock for its handshakes and closes, other threads only to
+     * subscribe its connections or to copy subscribers for a publish.
+     */
+    pthread_mutex_t topicLock;
+    struct ws_topic **topicBuckets;
+    size_t topicBucketCount; // power of two, 0 until the first subscription
+    size_t topicCount;
+};
+
+/*
+ * One connection in one topic. A close walks its connection's list, a
+ * removal swaps the topic's last subscriber into index.
+ */
+struct ws_subscription {
+    struct ws_topic *topic;
+    struct ws_connection *conn;
+    int socket; // conn's when it subscribed, publish checks it still is
+    int index; // in topic->subscribers
+    struct ws_subscription *next; // of the connection
+};
+
+/*
+ * Subscribers of one topic on one shard; a topic with subscribers on
+ * several shards is in each of their tables.
+ */
+struct ws_topic {
+    char *name;
+    uint32_t hash;
+    struct ws_topic *next; // in the bucket
+    struct ws_subscription **subscribers;
+    int count;
+    int capacity;
+};
+
+static void websocket_loop(void *pvParameters);
+static struct ws_connection *websocket_find(int clientSocket);
+static int websocket_listen(int port, int reusePort, int backlog);
+static void websocket_accept(struct ws_shard *shard);
+static struct ws_connection *websocket_open(struct ws_shard *shard, int clientSocket,
+                                            const struct sockaddr_in *remote);
+static void websocket_read(struct ws_connection *conn);
+static void websocket_manage(struct ws_connection *conn);
+static void websocket_close(struct ws_connection *conn, enum websocket_close_reason reason);
+static void websocket_fail(struct ws_connection *conn, enum websocket_close_reason reason);
+static void websocket_flush(struct ws_connection *conn);
+static void websocket_unsubscribe_all(struct ws_connection *conn);
+static void websocket_arm(struct ws_connection *conn);
+static void websocket_expire(struct ws_shard *shard);
+static void websocket_received(struct ws_connection *conn);
+static void websocket_replied(struct ws_connection *conn);
+static int websocket_metrics_requested(struct ws_shard *shard);
+static void websocket_metrics_answer(struct ws_connection *conn);
 int safeSend(int clientSocket, const uint8_t *buffer, size_t bufferSize);
+static int safeSendv(int clientSocket, struct iovec *iov, int iovcnt);
+static int websocket_sendv_fragment(int clientSocket, enum wsFrameType frameType, int fin,
+                                    uint8_t rsv, const struct iovec *iov, int iovcnt);
+static int websocket_write_locked(struct ws_connection *conn, int clientSocket, struct iovec *iov, int iovcnt,
+                                  struct ws_shared *shared, int *crossed);
+static void websocket_watermark_notify(struct ws_connection *conn, int clientSocket, int crossed, size_t queued);
+#ifdef WS_USE_URING
+static int websocket_uring_loop(struct ws_shard *shard);
+static void websocket_uring_schedule(struct ws_connection *conn);
+#endif
+#ifdef WS_USE_HANDOFF
+static int websocket_handing_off(void);
+static void websocket_wake(struct ws_shard *shard);
+static int websocket_park(struct ws_shard *shard);
+static void websocket_adopt(struct ws_shard *shard);
+#endif
+
+static struct websocket_config serverConfig;
+static struct ws_shard *shards = NULL;
+static int shardCount = 0;
+static struct ws_fdtable connectionTable; // connections of all shards, by socket
+static int openConnections = 0; // of all shards, limited by serverConfig.maxConnections
+static struct websocket_callbacks callbacks; // without routes, of every resource
+static struct ws_router router; // of websocket_callbacks copies
+static void (*onRecv)(int clientSocket, const char *resource, const char *data, int dataSize, int *returnCode) = NULL;
+static uint64_t streamThreshold = 0;
+static uint8_t validateUtf8 = TRUE;
+static size_t highWatermark = 0;
+static size_t lowWatermark = 0;
+static uint32_t handshakeTimeout = HANDSHAKE_TIMEOUT;
+static uint32_t pingInterval = 0;
+static uint32_t idleTimeout = 0;
+static char *metricsPath = NULL;
+#ifdef WS_DEFLATE
+static struct wsDeflateParams deflateLimits;
+static int deflateMemLevel = 8;
+static size_t deflateThreshold = 0;
+static size_t deflateBudget = 0;
+#endif
+#ifdef WS_TLS
+static struct ws_tls_context tlsContext; // ctx set: every connection is TLS
+#endif
+#ifdef WS_USE_HANDOFF
+static int handoffRequested = FALSE; // event loops take on no new work and park
+static int handoffParked = 0; // event loops parked, under handoffLock
+static int handoffDone = FALSE; // the successor took over, parked loops end
+static pthread_mutex_t handoffLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handoffCond = PTHREAD_COND_INITIALIZER;
+#endif
+
+// milliseconds, never goes back
+static uint64_t websocket_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// nanoseconds, for latencies
+static uint64_t websocket_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// milliseconds the event loop may wait before a timer is due, -1 for no limit
+static int websocket_wait_time(struct ws_shard *shard)
+{
+    uint64_t next = ws_timer_next(&shard->timers);
+    if (next == UINT64_MAX)
+        return -1;
+    uint64_t now = websocket_clock();
+    if (next <= now)
+        return 0;
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+#ifndef ESP_PLATFORM
+static void *websocket_thread(void *arg)
+{
+    struct ws_shard *shard = arg;
+#ifdef __linux__
+    if (shard->cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            ESP_LOGE(TAG, "pinning shard %d to cpu %d FAILED", shard->index, shard->cpu);
+    }
+#endif
+    websocket_loop(shard);
+    return NULL;
+}
+#endif
+
+void websocket_config_init(struct websocket_config *config, int port)
+{
+    memset(config, 0, sizeof(*config));
+    config->port = port;
+    config->workers = 1;
+    config->cpus = NULL;
+    config->maxConnections = MAX_SOCKETS;
+    config->backlog = LISTEN_BACKLOG;
+    config->bufferSize = BUF_LEN;
+    config->maxBufferSize = RX_BUF_MAX;
+    config->maxMessageSize = MAX_MESSAGE_LEN;
+    config->memoryBudget = 0;
+}
+
+// onRecv of websocket_init() on top of the callbacks
+static int websocket_recv_open(int clientSocket, const char *resource, void **context)
+{
+    (void)context;
+    int ret = 0;
+    onRecv(clientSocket, resource, NULL, 0, &ret);
+    return ret == EXIT_FAILURE ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void websocket_recv_message(int clientSocket, void *context, enum wsFrameType frameType,
+                                   const uint8_t *data, size_t dataSize)
+{
+    (void)context;
+    int ret = 0;
+    if (frameType == WS_TEXT_FRAME)
+        onRecv(clientSocket, websocket_resource(clientSocket), (const char *)data, (int)dataSize, &ret);
+}
+
+static const struct websocket_callbacks recvCallbacks = {
+    .context = NULL,
+    .onOpen = websocket_recv_open,
+    .onMessage = websocket_recv_message,
+    .onClose = NULL,
+    .onWritable = NULL,
+    .onWatermark = NULL,
+    .onChunk = NULL
+};
+
+void websocket_init(int port, void *onRecvCallback)
+{
+    websocket_init_shards(port, onRecvCallback, 1, NULL);
+}
+
+int websocket_init_shards(int port, void *onRecvCallback, int workers, const int *cpus)
+{
+    struct websocket_config config;
+    websocket_config_init(&config, port);
+    config.workers = workers;
+    config.cpus = cpus;
+    if (shards != NULL)
+        return EXIT_FAILURE;
+    onRecv = onRecvCallback;
+    return websocket_start(&config, &recvCallbacks);
+}
+
+/*
+ * Shards for config, each with a listening socket on the port, or with one
+ * of listeners, which it owns from then on. No event loop runs yet.
+ */
+static int websocket_setup(const struct websocket_config *config, const struct websocket_callbacks *callbackTable,
+                           const int *listeners, int listenerCount)
+{
+    int workers = listeners ? listenerCount : config->workers;
+    const int *cpus = config->cpus;
+
+#ifdef ESP_PLATFORM
+    // lwIP doesn't spread connections over listeners sharing a port
+    workers = 1;
+#endif
+    struct ws_shard *created = NULL;
+    if (shards != NULL || workers < 1 || config->maxConnections < 1 || config->bufferSize == 0
+        || config->maxBufferSize < config->bufferSize
+        || (created = calloc(workers, sizeof(*created))) == NULL)
+    {
+        for (int s = 0; s < listenerCount; s++)
+            close(listeners[s]);
+        return EXIT_FAILURE;
+    }
+    serverConfig = *config;
+    serverConfig.workers = workers;
+    serverConfig.cpus = NULL; // only read here
+    if (callbackTable != NULL)
+        callbacks = *callbackTable;
+    if (config->memoryBudget)
+        ws_pool_budget(config->memoryBudget);
+
+    // all listeners are bound before any loop starts, so a taken port fails here
+    for (int s = 0; s < workers; s++)
+    {
+        struct ws_shard *shard = &created[s];
+        shard->index = s;
+        shard->cpu = cpus && s < config->workers ? cpus[s] : -1;
+        shard->listenSocket = listeners ? listeners[s] : websocket_listen(config->port, workers > 1, config->backlog);
+#ifdef WS_USE_EPOLL
+        shard->wakeFd = shard->listenSocket == -1 ? -1 : eventfd(0, EFD_CLOEXEC);
+        if (shard->wakeFd == -1 && shard->listenSocket != -1)
+        {
+            ESP_LOGE(TAG, "eventfd FAILED");
+            close(shard->listenSocket);
+            shard->listenSocket = -1;
+        }
+#endif
+        if (shard->listenSocket == -1)
+        {
+            for (int l = s + 1; listeners && l < workers; l++)
+                close(listeners[l]);
+            while (s-- > 0)
+            {
+                close(created[s].listenSocket);
+#ifdef WS_USE_EPOLL
+                close(created[s].wakeFd);
+#endif
+            }
+            free(created);
+            return EXIT_FAILURE;
+        }
+        nullHandshake(&shard->hs);
+        ws_pool_init(&shard->pool);
+        shard->now = websocket_clock();
+        ws_timer_init(&shard->timers, shard->now);
+        pthread_mutex_init(&shard->topicLock, NULL);
+#ifdef WS_USE_URING
+        pthread_mutex_init(&shard->pendingLock, NULL);
+#endif
+    }
+    shards = created;
+    shardCount = workers;
+    return EXIT_SUCCESS;
+}
+
+// starts the event loops of the shards websocket_setup() made
+static int websocket_run(void)
+{
+    int ret = EXIT_SUCCESS;
+
+    for (int s = 0; s < shardCount; s++)
+    {
+        struct ws_shard *shard = &shards[s];
+#ifdef ESP_PLATFORM
+        BaseType_t started;
+        if (shard->cpu >= 0)
+            started = xTaskCreatePinnedToCore(&websocket_loop, "websocket_loop", 8192, shard, 5, NULL, shard->cpu);
+        else
+            started = xTaskCreate(&websocket_loop, "websocket_loop", 8192, shard, 5, NULL);
+        if (started != pdPASS)
+#else
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &websocket_thread, shard) == 0)
+            pthread_detach(thread);
+        else
+#endif
+        {
+            ESP_LOGE(TAG, "create thread FAILED");
+            close(shard->listenSocket);
+            shard->listenSocket = -1;
+            ret = EXIT_FAILURE;
+        }
+    }
+    return ret;
+}
+
+int websocket_start(const struct websocket_config *config, const struct websocket_callbacks *callbackTable)
+{
+    if (websocket_setup(config, callbackTable, NULL, 0) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    return websocket_run();
+}
+
+int websocket_route(const char *pattern, const struct websocket_callbacks *routeCallbacks)
+{
+    // the event loops read the router without a lock
+    if (shards != NULL)
+        return EXIT_FAILURE;
+    struct websocket_callbacks *copy = malloc(sizeof(*copy));
+    if (copy == NULL)
+        return EXIT_FAILURE;
+    *copy = *routeCallbacks;
+    if (ws_router_add(&router, pattern, copy) == -1)
+    {
+        ESP_LOGE(TAG, "route %s FAILED", pattern);
+        free(copy);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+const char *websocket_route_param(int clientSocket, const char *name, size_t *length)
+{
+    struct ws_connection *conn = websocket_find(clientSocket);
+    if (conn == NULL || conn->resource.data == NULL)
+        return NULL;
+    for (int i = 0; i < conn->route.params; i++)
+    {
+        const struct ws_route_param *param = &conn->route.param[i];
+        if (strcmp(param->name, name) == 0)
+        {
+            *length = param->length;
+            return (const char *)conn->resource.data + param->offset;
+        }
+    }
+    return NULL;
+}
+
+const char *websocket_resource(int clientSocket)
+{
+    struct ws_connection *conn = websocket_find(clientSocket);
+    if (conn == NULL)
+        return NULL;
+    return (const char *)conn->resource.data;
+}
+
+int websocket_shard_count(void)
+{
+    return shardCount;
+}
+
+int websocket_shard_stats(int shard, struct websocket_shard_stats *stats)
+{
+    if (shard < 0 || shard >= shardCount)
+        return EXIT_FAILURE;
+    *stats = shards[shard].stats;
+    return EXIT_SUCCESS;
+}
+
+int websocket_connection_stats(int clientSocket, struct websocket_connection_stats *stats)
+{
+    int ret = EXIT_FAILURE;
+    struct ws_connection *conn = websocket_find(clientSocket);
+    if (conn == NULL)
+        return EXIT_FAILURE;
+    pthread_mutex_lock(&conn->sendLock);
+    if (conn->socket == clientSocket)
+    {
+        *stats = conn->stats;
+        stats->queued = conn->out.bytes;
+        stats->age = websocket_clock() - conn->opened;
+        ret = EXIT_SUCCESS;
+    }
+    pthread_mutex_unlock(&conn->sendLock);
+    return ret;
+}
+
+static void websocket_stats_add(struct websocket_shard_stats *total, const struct websocket_shard_stats *stats)
+{
+    total->accepted += stats->accepted;
+    total->rejected += stats->rejected;
+    total->closed += stats->closed;
+    for (int i = 0; i < WS_CLOSE_REASONS; i++)
+        total->closeReasons[i] += stats->closeReasons[i];
+    total->messages += stats->messages;
+    total->framesIn += stats->framesIn;
+    total->bytesIn += stats->bytesIn;
+    total->framesOut += stats->framesOut;
+    total->bytesOut += stats->bytesOut;
+    total->handshakeFailures += stats->handshakeFailures;
+    total->parseErrors += stats->parseErrors;
+    total->tlsHandshakes += stats->tlsHandshakes;
+    total->tlsResumed += stats->tlsResumed;
+    total->tlsKernel += stats->tlsKernel;
+    total->connections += stats->connections;
+}
+
+int websocket_metrics(struct websocket_metrics *metrics)
+{
+    if (shards == NULL)
+        return EXIT_FAILURE;
+    memset(metrics, 0, sizeof(*metrics));
+    for (int s = 0; s < shardCount; s++)
+    {
+        struct ws_shard *shard = &shards[s];
+        websocket_stats_add(&metrics->total, &shard->stats);
+        ws_histogram_merge(&metrics->callbackLatency, &shard->callbackLatency);
+        ws_histogram_merge(&metrics->replyLatency, &shard->replyLatency);
+    }
+    int end = ws_fdtable_end(&connectionTable);
+    for (int clientSocket = 0; clientSocket < end; clientSocket++)
+    {
+        struct ws_connection *conn = websocket_find(clientSocket);
+        if (conn == NULL)
+            continue;
+        pthread_mutex_lock(&conn->sendLock);
+        if (conn->socket == clientSocket)
+        {
+            metrics->queued += conn->out.bytes;
+            if (conn->out.bytes > metrics->maxQueued)
+                metrics->maxQueued = conn->out.bytes;
+        }
+        pthread_mutex_unlock(&conn->sendLock);
+    }
+    return EXIT_SUCCESS;
+}
+
+int websocket_metrics_endpoint(const char *path)
+{
+    char *copy = NULL;
+
+    // the event loops compare requests with it unlocked
+    if (shards != NULL)
+        return EXIT_FAILURE;
+    if (path && (copy = strdup(path)) == NULL)
+        return EXIT_FAILURE;
+    free(metricsPath);
+    metricsPath = copy;
+    return EXIT_SUCCESS;
+}
+
+void websocket_stream(uint64_t threshold)
+{
+    streamThreshold = threshold;
+}
+
+void websocket_validate_utf8(int enabled)
+{
+    validateUtf8 = enabled != 0;
+}
+
+void websocket_watermark(size_t high, size_t low)
+{
+    highWatermark = high;
+    lowWatermark = low < high ? low : high;
+}
+
+void websocket_timeouts(uint32_t handshake, uint32_t ping, uint32_t idle)
+{
+    handshakeTimeout = handshake;
+    pingInterval = ping;
+    idleTimeout = idle;
+}
+
+void websocket_memory(size_t budget)
+{
+    ws_pool_budget(budget);
+}
+
+void websocket_memory_stats(struct ws_pool_stats *stats)
+{
+    ws_pool_stats(stats);
+}
 
-int sockets[MAX_SOCKETS] = { 0 };
-int sockets_ready[MAX_SOCKETS] = { 0 };
+#ifdef WS_DEFLATE
+void websocket_deflate(int windowBits, int memLevel, int noContextTakeover,
+                       size_t threshold, size_t memoryBudget)
+{
+    memset(&deflateLimits, 0, sizeof(deflateLimits));
+    deflateLimits.enabled = windowBits >= 9 && windowBits <= 15;
+    deflateLimits.serverMaxWindowBits = windowBits;
+    deflateLimits.clientMaxWindowBits = windowBits;
+    deflateLimits.serverNoContextTakeover = noContextTakeover;
+    deflateMemLevel = memLevel;
+    deflateThreshold = threshold;
+    deflateBudget = memoryBudget;
+}
+#endif
 
-void websocket_init(int port, void *onRecv)
+#ifdef WS_TLS
+int websocket_tls(const char *certificateFile, const char *keyFile, long sessionCacheSize, int ktls)
 {
-    int *pport = (int*)malloc(sizeof(int));
-    *pport = port;
+    struct ws_tls_context created;
+
+    if (shards != NULL || tlsContext.ctx != NULL)
+        return EXIT_FAILURE;
+    memset(&created, 0, sizeof(created));
+    if (ws_tls_context_init(&created, certificateFile, keyFile, sessionCacheSize, ktls) == -1)
+    {
+        ESP_LOGE(TAG, "loading %s and %s FAILED", certificateFile, keyFile);
+        return EXIT_FAILURE;
+    }
+    tlsContext = created;
+    return EXIT_SUCCESS;
+}
+#endif
 
-    xTaskCreate(&websocket_listen, "websocket_listen", 4096, (void*)pport, 5, NULL);
-    xTaskCreate(&websocket_select, "websocket_select", 4096, NULL, 5, NULL);
-    xTaskCreate(&websocket_manage, "websocket_manage", 4096 * MAX_SOCKETS, onRecv, 5, NULL);
+/*
+ * Connections are never freed, so the result stays valid; it may be closed,
+ * or even reused for another socket, by the time the caller takes sendLock.
+ */
+static struct ws_connection *websocket_find(int clientSocket)
+{
+    struct ws_connection *conn = ws_fdtable_get(&connectionTable, clientSocket);
+    if (conn == NULL || conn->socket != clientSocket)
+        return NULL;
+    return conn;
 }
 
-static void websocket_listen(void *pvParameters)
+static int websocket_set_nonblocking(int socket)
 {
-    int port = *((int*)pvParameters);
-    free(pvParameters);
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+}
 
+static int websocket_listen(int port, int reusePort, int backlog)
+{
     int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (listenSocket == -1)
     {
         ESP_LOGE(TAG, "create socket FAILED");
+        return -1;
+    }
+
+    int reuse = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#ifdef SO_REUSEPORT
+    // every shard listens on the port, the kernel spreads new connections over them
+    if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)
+    {
+        ESP_LOGE(TAG, "SO_REUSEPORT FAILED");
+        close(listenSocket);
+        return -1;
     }
+#endif
 
     struct sockaddr_in local;
     memset(&local, 0, sizeof(local));
@@ -39,260 +699,2821 @@ static void websocket_listen(void *pvParameters)
     if (bind(listenSocket, (struct sockaddr*)&local, sizeof(local)) == -1)
     {
         ESP_LOGE(TAG, "bind FAILED");
+        close(listenSocket);
+        return -1;
     }
 
-    if(listen(listenSocket, 1) == -1)
+    if (listen(listenSocket, backlog) == -1 || websocket_set_nonblocking(listenSocket) == -1)
     {
         ESP_LOGE(TAG, "listen FAILED");
+        close(listenSocket);
+        return -1;
+    }
+    ESP_LOGI(TAG, "opened %s:%d", inet_ntoa(local.sin_addr), ntohs(local.sin_port));
+
+    return listenSocket;
+}
+
+static void websocket_loop(void *pvParameters)
+{
+    struct ws_shard *shard = pvParameters;
+    int listenSocket = shard->listenSocket;
+
+#ifdef WS_USE_URING
+    if (websocket_uring_loop(shard) == 0)
+        goto exit;
+#endif
+
+#ifdef WS_USE_EPOLL
+    // edge-triggered: every ready socket is drained until EAGAIN before waiting again
+    shard->epollFd = epoll_create1(0);
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    struct epoll_event wake = { .events = EPOLLIN | EPOLLET, .data.ptr = shard };
+    if (shard->epollFd == -1 || epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, listenSocket, &event) == -1
+        || epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, shard->wakeFd, &wake) == -1)
+    {
+        ESP_LOGE(TAG, "epoll FAILED");
+        goto exit;
     }
-    ESP_LOGI(TAG, "opened %s:%d\n", inet_ntoa(local.sin_addr), ntohs(local.sin_port));
+#ifdef WS_USE_HANDOFF
+    websocket_adopt(shard);
+#endif
 
-    while(1)
+    struct epoll_event events[EPOLL_BATCH];
+    while (1)
     {
-        struct sockaddr_in remote;
-        socklen_t sockaddrLen = sizeof(remote);
-        int clientSocket = accept(listenSocket, (struct sockaddr*)&remote, &sockaddrLen);
-        if (clientSocket == -1)
+        int count = epoll_wait(shard->epollFd, events, EPOLL_BATCH, websocket_wait_time(shard));
+        if (count == -1)
         {
-            ESP_LOGE(TAG, "accept FAILED");
+            if (errno == EINTR)
+                continue;
+            ESP_LOGE(TAG, "epoll_wait failed!");
+            break;
         }
+        shard->now = websocket_clock();
 
-        ESP_LOGI(TAG, "connected %s:%d\n", inet_ntoa(remote.sin_addr), ntohs(remote.sin_port));
-        
-        int i = 0;
-        for(i = 0; i < MAX_SOCKETS; i++)
+        for (int i = 0; i < count; i++)
         {
-            if(sockets[i] == 0)
+            struct ws_connection *conn = events[i].data.ptr;
+            if (conn == NULL)
             {
-                sockets[i] = clientSocket;
-                break;
+                websocket_accept(shard);
+                continue;
             }
+            if (events[i].data.ptr == shard)
+            {
+                // only ends the wait, see websocket_wake()
+                uint64_t value;
+                if (read(shard->wakeFd, &value, sizeof(value)) == -1)
+                    ESP_LOGE(TAG, "wake FAILED");
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+                websocket_flush(conn);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                websocket_read(conn);
         }
-        if(i == MAX_SOCKETS)
-        {
-            ESP_LOGI(TAG, "Rejected connection from %s, too many connections!", inet_ntoa(remote.sin_addr));
-        }
+        websocket_expire(shard);
+#ifdef WS_USE_HANDOFF
+        if (websocket_handing_off() && websocket_park(shard))
+            break;
+#endif
     }
 
-    close(listenSocket);
-
-    vTaskDelete(NULL);
-}
-
-static void websocket_select(void *pvParameters)
-{
-    while(1)
+exit:
+#else
+    FD_ZERO(&shard->readSet);
+    FD_SET(listenSocket, &shard->readSet);
+#ifdef WS_USE_HANDOFF
+    websocket_adopt(shard);
+#endif
+    while (1)
     {
-        vTaskDelay(10 / portTICK_PERIOD_MS);
-
-        fd_set rdfs;
-        struct timeval tv;
-        int ndfs = 0;
+        fd_set rdfs = shard->readSet;
+        fd_set wrfs;
+        int ndfs = listenSocket;
+        // other tasks may queue data meanwhile, look at the queues again now and then
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+        int waitTime = websocket_wait_time(shard);
+        if (waitTime >= 0 && waitTime < 100)
+            tv.tv_usec = waitTime * 1000;
 
-        FD_ZERO(&rdfs);
-
-        for(int i = 0; i < MAX_SOCKETS; i++)
+        // only the write set depends on the queues, it is the one built anew
+        FD_ZERO(&wrfs);
+        for (struct ws_connection *conn = shard->openConnections; conn != NULL; conn = conn->next)
         {
-            if(sockets[i] != 0)
+            if (conn->out.head != NULL)
+                FD_SET(conn->socket, &wrfs);
+#ifdef WS_TLS
+            else if (conn->tls.wantWrite)
+                FD_SET(conn->socket, &wrfs);
+#endif
+            if (conn->socket > ndfs)
             {
-                FD_SET(sockets[i], &rdfs);
-                if(sockets[i] > ndfs) 
-                {
-                    ndfs = sockets[i]; // ndfs takes the highest-numbered fd, and adds one
-                }
+                ndfs = conn->socket; // ndfs takes the highest-numbered fd, and adds one
             }
         }
 
-        tv.tv_usec = 50;
-
-        int retval = select(ndfs + 1, &rdfs, NULL, NULL, &tv);
-
-        if(retval == -1)
+        int retval = select(ndfs + 1, &rdfs, &wrfs, NULL, &tv);
+        if (retval == -1)
         {
+            if (errno == EINTR)
+                continue;
             ESP_LOGE(TAG, "select failed!");
             break;
         }
-        else if(retval)
+        shard->now = websocket_clock();
+
+        if (FD_ISSET(listenSocket, &rdfs))
+        {
+            websocket_accept(shard);
+        }
+        // connections accepted just now are not in the sets, closing one only unlinks itself
+        struct ws_connection *next;
+        for (struct ws_connection *conn = shard->openConnections; conn != NULL; conn = next)
         {
-            for(int i = 0; i < MAX_SOCKETS; i++)
+            int clientSocket = conn->socket;
+            next = conn->next;
+            if (FD_ISSET(clientSocket, &wrfs))
             {
-                if(FD_ISSET(sockets[i], &rdfs))
-                {
-                    sockets_ready[i] = 1;
-                }
+                websocket_flush(conn);
+            }
+            if (conn->socket == clientSocket && FD_ISSET(clientSocket, &rdfs))
+            {
+                websocket_read(conn);
             }
         }
+        websocket_expire(shard);
+#ifdef WS_USE_HANDOFF
+        if (websocket_handing_off() && websocket_park(shard))
+            break;
+#endif
     }
+#endif
+    close(listenSocket);
+    shard->listenSocket = -1;
+    ws_pool_destroy(&shard->pool);
 
+#ifdef ESP_PLATFORM
     vTaskDelete(NULL);
+#endif
 }
 
-static void websocket_manage(void *pvParameters)
+static void websocket_accept(struct ws_shard *shard)
 {
-    int clientSocket;
-    void (*onRecv)() = pvParameters;
-
-    uint8_t gBuffer[BUF_LEN];
-    char* resource = NULL;
+    while (1)
+    {
+        struct sockaddr_in remote;
+        socklen_t sockaddrLen = sizeof(remote);
+        int clientSocket = accept(shard->listenSocket, (struct sockaddr*)&remote, &sockaddrLen);
+        if (clientSocket == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                ESP_LOGE(TAG, "accept FAILED");
+            return;
+        }
 
-    memset(gBuffer, 0, BUF_LEN);
-    size_t readedLength[MAX_SOCKETS] = { 0 };
-    size_t frameSize = BUF_LEN;
-    enum wsState state[MAX_SOCKETS] = { WS_STATE_OPENING };
-    uint8_t *data = NULL;
-    size_t dataSize = 0;
-    enum wsFrameType frameType[MAX_SOCKETS] = { WS_INCOMPLETE_FRAME };
-    struct handshake hs;
-    nullHandshake(&hs);
-    
-    #define prepareBuffer frameSize = BUF_LEN; memset(gBuffer, 0, BUF_LEN);
-    #define initNewFrame frameType[i] = WS_INCOMPLETE_FRAME; readedLength[i] = 0; memset(gBuffer, 0, BUF_LEN);
-    #define closeSocket sockets[i] = 0; close(clientSocket); state[i] = WS_STATE_OPENING; initNewFrame;
-    
-    while (1) {
-        vTaskDelay(10 / portTICK_PERIOD_MS);
-
-        for(int i = 0; i < MAX_SOCKETS; i++)
-        {
-            if(sockets[i] != 0 && sockets_ready[i])
-            {
-                sockets_ready[i] = 0;
-                clientSocket = sockets[i];
+        if (websocket_set_nonblocking(clientSocket) == -1)
+        {
+            ESP_LOGE(TAG, "fcntl FAILED");
+            close(clientSocket);
+            shard->stats.rejected++;
+            continue;
+        }
+        struct ws_connection *conn = websocket_open(shard, clientSocket, &remote);
+        if (conn == NULL)
+            continue;
 
-                ssize_t readed = recv(clientSocket, gBuffer+readedLength[i], BUF_LEN-readedLength[i], 0);
-                if (!readed) {
-                    ESP_LOGE(TAG, "recv failed");
-                    closeSocket;
-                }
-                #ifdef PACKET_DUMP
-                ESP_LOGI(TAG, "in packet:\n%s", gBuffer);
-                #endif
-                readedLength[i] += readed;
-                assert(readedLength[i] <= BUF_LEN);
-                
-                if (state[i] == WS_STATE_OPENING) {
-                    frameType[i] = wsParseHandshake(gBuffer, readedLength[i], &hs);
-                } else {
-                    frameType[i] = wsParseInputFrame(gBuffer, readedLength[i], &data, &dataSize);
-                }
-                
-                if ((frameType[i] == WS_INCOMPLETE_FRAME && readedLength[i] == BUF_LEN) || frameType[i] == WS_ERROR_FRAME) {
-                    if (frameType[i] == WS_INCOMPLETE_FRAME) {
-                        ESP_LOGE(TAG, "buffer too small");
-                    }
-                    else {
-                        ESP_LOGE(TAG, "error in incoming frame\n");
-                    }
-                    
-                    if (state[i] == WS_STATE_OPENING) {
-                        prepareBuffer;
-                        frameSize = sprintf((char *)gBuffer,
-                                            "HTTP/1.1 400 Bad Request\r\n"
-                                            "%s%s\r\n\r\n",
-                                            versionField,
-                                            version);
-                        safeSend(clientSocket, gBuffer, frameSize);
-                        closeSocket;
-                    } else {
-                        prepareBuffer;
-                        wsMakeFrame(NULL, 0, gBuffer, &frameSize, WS_CLOSING_FRAME);
-                        if (safeSend(clientSocket, gBuffer, frameSize) == EXIT_FAILURE)
-                            break;
-                        state[i] = WS_STATE_CLOSING;
-                        initNewFrame;
-                    }
-                }
-                
-                if (state[i] == WS_STATE_OPENING) {
-                    assert(frameType[i] == WS_OPENING_FRAME);
-                    if (frameType[i] == WS_OPENING_FRAME) {
-                        // if resource is right, generate answer handshake and send it
-                        int ret = 0;
-                        onRecv(clientSocket, hs.resource, NULL, 0, &ret);
-                        if (ret == EXIT_FAILURE) {
-                            frameSize = sprintf((char *)gBuffer, "HTTP/1.1 404 Not Found\r\n\r\n");
-                            safeSend(clientSocket, gBuffer, frameSize);
-                            closeSocket;
-                        }
-                        
-                        if (resource != NULL)
-                            free(resource);
-                        resource = malloc(strlen(hs.resource) + 1);
-                        memcpy(resource, hs.resource, strlen(hs.resource) + 1);
-
-                        prepareBuffer;
-                        wsGetHandshakeAnswer(&hs, gBuffer, &frameSize);
-                        freeHandshake(&hs);
-                        if (safeSend(clientSocket, gBuffer, frameSize) == EXIT_FAILURE)
-                        {
-                            closeSocket;
-                        }
-                        state[i] = WS_STATE_NORMAL;
-                        initNewFrame;
-                    }
-                } else {
-                    if (frameType[i] == WS_CLOSING_FRAME) {
-                        if (state[i] == WS_STATE_CLOSING) {
-                            closeSocket;
-                        } else {
-                            prepareBuffer;
-                            wsMakeFrame(NULL, 0, gBuffer, &frameSize, WS_CLOSING_FRAME);
-                            safeSend(clientSocket, gBuffer, frameSize);
-                            closeSocket;
-                        }
-                    } else if (frameType[i] == WS_TEXT_FRAME) {
-                        uint8_t *receivedString = NULL;
-                        receivedString = malloc(dataSize+1);
-                        assert(receivedString);
-                        memcpy(receivedString, data, dataSize);
-                        receivedString[ dataSize ] = 0;
-
-                        int ret = 0;
-                        onRecv(clientSocket, resource, receivedString, dataSize, &ret);
-                        
-                        initNewFrame;
-                    }
-                }
-            }
+#ifdef WS_USE_EPOLL
+        // EPOLLOUT only reports the edge after a write hit EAGAIN, when the queue needs flushing
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+        if (epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, clientSocket, &event) == -1)
+        {
+            ESP_LOGE(TAG, "epoll_ctl FAILED");
+            websocket_close(conn, WS_CLOSE_RESOURCE);
+            continue;
         }
-    } // read/write cycle
+        // data may already be queued behind the handshake, edge-triggered mode won't report it again
+        websocket_read(conn);
+#endif
+    }
+}
 
-    vTaskDelete(NULL);
+// false while the ring may still complete requests of the previous connection
+static int websocket_slot_free(const struct ws_connection *conn)
+{
+#ifdef WS_USE_URING
+    if (conn->receiving || conn->sending)
+        return FALSE;
+#endif
+    return conn->socket == -1;
 }
 
-int websocket_send(int clientSocket, const char *buffer, size_t bufferSize)
+/*
+ * A closed connection of the shard that the ring is done with, or a new one.
+ * Connections stay allocated for good, other threads may still hold one
+ * they found a moment ago.
+ */
+static struct ws_connection *websocket_connection(struct ws_shard *shard)
 {
-    uint8_t gBuffer[BUF_LEN];
-    size_t frameSize = BUF_LEN;
-    memset(gBuffer, 0, BUF_LEN);
+    struct ws_connection **link = &shard->freeConnections;
+    while (*link != NULL && !websocket_slot_free(*link))
+        link = &(*link)->next;
+    struct ws_connection *conn = *link;
+    if (conn != NULL)
+    {
+        *link = conn->next;
+        return conn;
+    }
+
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL)
+        return NULL;
+    conn->socket = -1;
+    conn->shard = shard;
+    pthread_mutex_init(&conn->sendLock, NULL);
+    ws_queue_init(&conn->out);
+    return conn;
+}
 
-    wsMakeFrame((uint8_t*)buffer, bufferSize, gBuffer, &frameSize, WS_TEXT_FRAME);
-    if (safeSend(clientSocket, gBuffer, frameSize) == EXIT_FAILURE)
+/*
+ * Gives an accepted, non-blocking socket a connection. Closes it and
+ * returns NULL if the server is full or out of memory.
+ */
+static struct ws_connection *websocket_open(struct ws_shard *shard, int clientSocket,
+                                            const struct sockaddr_in *remote)
+{
+    ESP_LOGI(TAG, "connected %s:%d", inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
+
+    struct ws_connection *conn = NULL;
+    if (__atomic_add_fetch(&openConnections, 1, __ATOMIC_RELAXED) > serverConfig.maxConnections)
     {
-        ESP_LOGE(TAG, "Send FAILED");
-        return EXIT_FAILURE;
+        ESP_LOGI(TAG, "Rejected connection from %s, too many connections!", inet_ntoa(remote->sin_addr));
+        goto reject;
+    }
+#ifndef WS_USE_EPOLL
+    if (clientSocket >= FD_SETSIZE)
+    {
+        ESP_LOGI(TAG, "Rejected connection from %s, socket beyond FD_SETSIZE", inet_ntoa(remote->sin_addr));
+        goto reject;
+    }
+#endif
+    conn = websocket_connection(shard);
+    // the entry is published before the socket is set, until then lookups ignore it
+    if (conn == NULL
+        || ws_ringbuf_init(&conn->rx, &shard->pool, serverConfig.bufferSize, serverConfig.maxBufferSize) == -1
+#ifdef WS_TLS
+        || (tlsContext.ctx != NULL && ws_tls_open(&conn->tls, &tlsContext, clientSocket) == -1)
+#endif
+        || ws_fdtable_set(&connectionTable, clientSocket, conn) == -1)
+    {
+        ESP_LOGE(TAG, "out of memory");
+        goto reject;
     }
 
-    return EXIT_SUCCESS;
+    int noDelay = 1;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    // other threads only send once the socket is set
+    memset(&conn->stats, 0, sizeof(conn->stats));
+    conn->recvAt = 0;
+    conn->sentAt = 0;
+    conn->socket = clientSocket;
+    shard->stats.accepted++;
+    shard->stats.connections++;
+#ifndef WS_USE_EPOLL
+    conn->prev = NULL;
+    conn->next = shard->openConnections;
+    if (conn->next != NULL)
+        conn->next->prev = conn;
+    shard->openConnections = conn;
+    FD_SET(clientSocket, &shard->readSet);
+#endif
+    conn->state = WS_STATE_OPENING;
+    conn->frameType = WS_INCOMPLETE_FRAME;
+    conn->callbacks = &callbacks;
+    conn->context = callbacks.context;
+    conn->route.params = 0;
+    conn->established = FALSE;
+#ifdef WS_USE_HANDOFF
+    conn->handedOff = FALSE;
+    conn->adopted = FALSE;
+#endif
+    wsInitFrameParser(&conn->parser, serverConfig.maxBufferSize);
+    conn->parser.validateUtf8 = validateUtf8;
+    conn->maxMessageSize = serverConfig.maxMessageSize;
+    conn->streaming = FALSE;
+    conn->streamOffset = 0;
+    conn->congested = FALSE;
+    conn->lastSeen = shard->now;
+    conn->lastPing = shard->now;
+    conn->opened = shard->now;
+    websocket_arm(conn);
+#ifdef WS_DEFLATE
+    memset(&conn->deflate, 0, sizeof(conn->deflate));
+#endif
+    return conn;
+
+reject:
+    if (conn != NULL)
+    {
+        ws_ringbuf_free(&conn->rx);
+#ifdef WS_TLS
+        ws_tls_close(&conn->tls);
+#endif
+        conn->next = shard->freeConnections;
+        shard->freeConnections = conn;
+    }
+    close(clientSocket);
+    __atomic_sub_fetch(&openConnections, 1, __ATOMIC_RELAXED);
+    shard->stats.rejected++;
+    return NULL;
 }
 
-int safeSend(int clientSocket, const uint8_t *buffer, size_t bufferSize)
+#ifdef WS_TLS
+/*
+ * Takes the TLS handshake a step further whenever the socket is ready
+ * either way. TRUE once the connection carries websocket data.
+ */
+static int websocket_tls_ready(struct ws_connection *conn)
 {
-    #ifdef PACKET_DUMP
-    ESP_LOGI(TAG, "out packet:\n%s", buffer);
-    #endif
+    struct ws_shard *shard = conn->shard;
+    if (conn->tls.ssl == NULL || conn->tls.established)
+        return TRUE;
 
-    ssize_t written = send(clientSocket, buffer, bufferSize, 0);
-    if (written == -1) {
-        close(clientSocket);
-        ESP_LOGE(TAG, "send failed");
-        return EXIT_FAILURE;
+    pthread_mutex_lock(&conn->sendLock);
+    int ret = ws_tls_handshake(&conn->tls);
+    pthread_mutex_unlock(&conn->sendLock);
+    if (ret == 0)
+        return FALSE;
+    if (ret == -1)
+    {
+        ESP_LOGI(TAG, "TLS handshake failed");
+        shard->stats.handshakeFailures++;
+        websocket_close(conn, WS_CLOSE_PROTOCOL);
+        return FALSE;
     }
-    if (written != bufferSize) {
-        close(clientSocket);
-        ESP_LOGE(TAG, "written not all bytes");
-        return EXIT_FAILURE;
+    shard->stats.tlsHandshakes++;
+    shard->stats.tlsResumed += conn->tls.resumed;
+    shard->stats.tlsKernel += conn->tls.ktlsSend;
+    return TRUE;
+}
+#endif
+
+// sendLock is taken for TLS only, plain sockets may be read while others send
+static ssize_t websocket_recv(struct ws_connection *conn, void *buffer, size_t length)
+{
+#ifdef WS_TLS
+    if (conn->tls.ssl != NULL)
+    {
+        pthread_mutex_lock(&conn->sendLock);
+        ssize_t readed = ws_tls_read(&conn->tls, buffer, length);
+        pthread_mutex_unlock(&conn->sendLock);
+        return readed;
     }
-    
+#endif
+    return recv(conn->socket, buffer, length, 0);
+}
+
+// sendLock held
+static ssize_t websocket_sendmsg(struct ws_connection *conn, int clientSocket, const struct msghdr *msg)
+{
+#ifdef WS_TLS
+    // with kTLS every write to the socket becomes records, it takes the buffers as they are
+    if (conn->tls.ssl != NULL && !conn->tls.ktlsSend)
+        return ws_tls_writev(&conn->tls, msg->msg_iov, msg->msg_iovlen);
+#else
+    (void)conn;
+#endif
+    return sendmsg(clientSocket, msg, MSG_NOSIGNAL);
+}
+
+static void websocket_read(struct ws_connection *conn)
+{
+#ifdef WS_TLS
+    if (!websocket_tls_ready(conn))
+        return;
+#endif
+    while (conn->socket != -1)
+    {
+        size_t space = 0;
+        uint8_t *writePtr = ws_ringbuf_write_ptr(&conn->rx, &space);
+        if (space == 0)
+        {
+            ESP_LOGE(TAG, "buffer too small");
+            websocket_close(conn, WS_CLOSE_TOO_BIG);
+            return;
+        }
+
+        ssize_t readed = websocket_recv(conn, writePtr, space);
+        if (readed == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                ESP_LOGE(TAG, "recv failed");
+                websocket_close(conn, WS_CLOSE_HANGUP);
+            }
+            return;
+        }
+        if (readed == 0)
+        {
+            websocket_close(conn, WS_CLOSE_HANGUP);
+            return;
+        }
+        ws_ringbuf_commit(&conn->rx, readed);
+        conn->shard->stats.bytesIn += readed;
+        conn->stats.bytesIn += readed;
+        conn->lastSeen = conn->shard->now;
+
+        websocket_received(conn);
+        websocket_manage(conn);
+        websocket_replied(conn);
+    }
+}
+
+// reason is ignored once the server started the closing handshake, why it did counts
+static void websocket_close(struct ws_connection *conn, enum websocket_close_reason reason)
+{
+    if (conn->state == WS_STATE_CLOSING)
+        reason = conn->closeReason;
+    // while the socket number is still this connection's
+    if (conn->established) {
+        conn->established = FALSE;
+        if (conn->callbacks->onClose)
+            conn->callbacks->onClose(conn->socket, conn->context, reason);
+    }
+#ifdef WS_USE_URING
+    // replies still waiting for the next submission, e.g. a closing frame, go out first
+    if (conn->shard->uring && !conn->sending)
+        websocket_flush(conn);
+#endif
+    // before the socket number can be handed out again
+    ws_fdtable_clear(&connectionTable, conn->socket, conn);
+    // after, a subscribe from another thread doesn't find it anymore
+    websocket_unsubscribe_all(conn);
+    pthread_mutex_lock(&conn->sendLock);
+#ifdef WS_USE_URING
+    // ends the multishot recv, the ring holds its own reference to the socket
+    if (conn->receiving)
+        shutdown(conn->socket, SHUT_RDWR);
+#endif
+#ifndef WS_USE_EPOLL
+    FD_CLR(conn->socket, &conn->shard->readSet);
+#endif
+#ifdef WS_TLS
+    ws_tls_close(&conn->tls);
+#endif
+    close(conn->socket);
+    conn->socket = -1;
+#ifdef WS_USE_URING
+    // a send in flight still points into the queue, its completion clears it
+    if (!conn->sending)
+        ws_queue_clear(&conn->out);
+#else
+    ws_queue_clear(&conn->out);
+#endif
+    pthread_mutex_unlock(&conn->sendLock);
+    ws_timer_cancel(&conn->shard->timers, &conn->timer);
+    conn->state = WS_STATE_OPENING;
+    conn->frameType = WS_INCOMPLETE_FRAME;
+    ws_ringbuf_free(&conn->rx);
+    ws_buffer_release(&conn->shard->pool, &conn->message);
+    ws_buffer_release(&conn->shard->pool, &conn->resource);
+    conn->shard->stats.closed++;
+    conn->shard->stats.closeReasons[reason]++;
+    conn->shard->stats.connections--;
+    __atomic_sub_fetch(&openConnections, 1, __ATOMIC_RELAXED);
+#ifdef WS_DEFLATE
+    ws_deflate_free(&conn->deflate);
+#endif
+#ifndef WS_USE_EPOLL
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        conn->shard->openConnections = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+#endif
+    conn->next = conn->shard->freeConnections;
+    conn->shard->freeConnections = conn;
+}
+
+size_t websocket_queued(int clientSocket)
+{
+    size_t queued = 0;
+    struct ws_connection *conn = websocket_find(clientSocket);
+    if (conn == NULL)
+        return 0;
+    pthread_mutex_lock(&conn->sendLock);
+    if (conn->socket == clientSocket)
+        queued = conn->out.bytes;
+    pthread_mutex_unlock(&conn->sendLock);
+    return queued;
+}
+
+int websocket_set_max_message(int clientSocket, size_t maxMessageSize)
+{
+    struct ws_connection *conn = websocket_find(clientSocket);
+    if (conn == NULL)
+        return EXIT_FAILURE;
+    // the event loop reads it while messages come in
+    __atomic_store_n(&conn->maxMessageSize, maxMessageSize, __ATOMIC_RELAXED);
+    return EXIT_SUCCESS;
+}
+
+static void websocket_fail(struct ws_connection *conn, enum websocket_close_reason reason)
+{
+    struct ws_shard *shard = conn->shard;
+    int clientSocket = conn->socket;
+    size_t frameSize = BUF_LEN;
+
+    if (conn->state == WS_STATE_OPENING) {
+        frameSize = sprintf((char *)shard->buffer,
+                            "HTTP/1.1 400 Bad Request\r\n"
+                            "%s%s\r\n\r\n",
+                            versionField,
+                            version);
+        safeSend(clientSocket, shard->buffer, frameSize);
+        freeHandshake(&shard->hs);
+        shard->stats.handshakeFailures++;
+        websocket_close(conn, reason);
+        return;
+    }
+    if (reason == WS_CLOSE_PROTOCOL)
+        shard->stats.parseErrors++;
+
+    wsMakeFrame(NULL, 0, shard->buffer, &frameSize, WS_CLOSING_FRAME);
+    if (safeSend(clientSocket, shard->buffer, frameSize) == EXIT_FAILURE) {
+        websocket_close(conn, reason);
+        return;
+    }
+    // drop whatever is buffered and wait for the peer's closing frame
+    conn->state = WS_STATE_CLOSING;
+    conn->closeReason = reason;
+    websocket_arm(conn);
+    conn->frameType = WS_INCOMPLETE_FRAME;
+    conn->streaming = FALSE;
+    wsInitFrameParser(&conn->parser, serverConfig.maxBufferSize);
+    ws_ringbuf_consume(&conn->rx, ws_ringbuf_used(&conn->rx));
+    ws_buffer_release(&shard->pool, &conn->message);
+}
+
+/*
+ * Sets the timer to the next deadline of the connection's state. Incoming
+ * data doesn't move it: when it fires, the time data was last seen decides.
+ */
+static void websocket_arm(struct ws_connection *conn)
+{
+    struct ws_shard *shard = conn->shard;
+    uint64_t deadline = UINT64_MAX;
+
+    if (conn->state != WS_STATE_NORMAL) {
+        if (handshakeTimeout)
+            deadline = shard->now + handshakeTimeout;
+    } else {
+        if (pingInterval)
+            deadline = (conn->lastSeen > conn->lastPing ? conn->lastSeen : conn->lastPing) + pingInterval;
+        if (idleTimeout && conn->lastSeen + idleTimeout < deadline)
+            deadline = conn->lastSeen + idleTimeout;
+    }
+
+    if (deadline == UINT64_MAX)
+        ws_timer_cancel(&shard->timers, &conn->timer);
+    else
+        ws_timer_add(&shard->timers, &conn->timer, deadline);
+}
+
+static void websocket_timeout(struct ws_connection *conn)
+{
+    struct ws_shard *shard = conn->shard;
+    uint64_t silent = shard->now - conn->lastSeen;
+
+    if (conn->state != WS_STATE_NORMAL) {
+        ESP_LOGI(TAG, "%s handshake timed out", conn->state == WS_STATE_OPENING ? "opening" : "closing");
+        if (conn->state == WS_STATE_OPENING)
+            shard->stats.handshakeFailures++;
+        websocket_close(conn, WS_CLOSE_TIMEOUT);
+        return;
+    }
+    if (idleTimeout && silent >= idleTimeout) {
+        ESP_LOGI(TAG, "no data for %llu ms, closing", (unsigned long long)silent);
+        websocket_close(conn, WS_CLOSE_TIMEOUT);
+        return;
+    }
+    if (pingInterval && silent >= pingInterval && shard->now - conn->lastPing >= pingInterval) {
+        // a dead peer makes the send fail sooner or later, even without an idle limit
+        conn->lastPing = shard->now;
+        websocket_sendv_fragment(conn->socket, WS_PING_FRAME, TRUE, 0, NULL, 0);
+    }
+    websocket_arm(conn);
+}
+
+// event loop, after shard->now was read
+static void websocket_expire(struct ws_shard *shard)
+{
+    struct ws_timer *timer;
+    while ((timer = ws_timer_expire(&shard->timers, shard->now)) != NULL)
+        websocket_timeout((struct ws_connection *)((uint8_t *)timer - offsetof(struct ws_connection, timer)));
+}
+
+// event loop, before the data of one recv is handled
+static void websocket_received(struct ws_connection *conn)
+{
+    __atomic_store_n(&conn->sentAt, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&conn->recvAt, websocket_clock_ns(), __ATOMIC_RELAXED);
+}
+
+// event loop, after it was handled: the first send meanwhile answered it
+static void websocket_replied(struct ws_connection *conn)
+{
+    uint64_t recvAt = conn->recvAt;
+    __atomic_store_n(&conn->recvAt, 0, __ATOMIC_RELAXED);
+    uint64_t sentAt = __atomic_exchange_n(&conn->sentAt, 0, __ATOMIC_RELAXED);
+    if (sentAt >= recvAt && sentAt != 0)
+        ws_histogram_record(&conn->shard->replyLatency, sentAt - recvAt);
+}
+
+// appends to a pooled buffer, -1 if out of memory
+static int websocket_printf(struct ws_pool *pool, struct ws_buffer *out, const char *format, ...)
+{
+    va_list args;
+
+    while (1)
+    {
+        size_t space = out->capacity - out->length;
+        va_start(args, format);
+        int length = vsnprintf(space ? (char *)out->data + out->length : NULL, space, format, args);
+        va_end(args);
+        if (length < 0)
+            return -1;
+        if ((size_t)length < space)
+        {
+            out->length += length;
+            return 0;
+        }
+        if (ws_buffer_reserve(pool, out, out->length + length + 1) == -1)
+            return -1;
+    }
+}
+
+static int websocket_print_summary(struct ws_pool *pool, struct ws_buffer *out, const char *name,
+                                   const char *help, const struct ws_histogram *histogram)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    if (websocket_printf(pool, out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name) == -1)
+        return -1;
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    {
+        if (websocket_printf(pool, out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[i],
+                             ws_histogram_quantile(histogram, quantiles[i]) / 1e9) == -1)
+            return -1;
+    }
+    return websocket_printf(pool, out, "%s_sum %.9f\n%s_count %llu\n", name, histogram->sum / 1e9,
+                            name, (unsigned long long)histogram->count);
+}
+
+// Prometheus text format, counters by shard
+static int websocket_metrics_text(struct ws_pool *pool, struct ws_buffer *out,
+                                  const struct websocket_metrics *metrics)
+{
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        { "websocket_accepted_total", "Connections accepted.", offsetof(struct websocket_shard_stats, accepted) },
+        { "websocket_rejected_total", "Connections refused, table full or out of memory.",
+          offsetof(struct websocket_shard_stats, rejected) },
+        { "websocket_messages_total", "Messages passed to onMessage.", offsetof(struct websocket_shard_stats, messages) },
+        { "websocket_frames_received_total", "Frames received.", offsetof(struct websocket_shard_stats, framesIn) },
+        { "websocket_received_bytes_total", "Bytes received.", offsetof(struct websocket_shard_stats, bytesIn) },
+        { "websocket_frames_sent_total", "Frames sent or queued.", offsetof(struct websocket_shard_stats, framesOut) },
+        { "websocket_sent_bytes_total", "Bytes sent or queued.", offsetof(struct websocket_shard_stats, bytesOut) },
+        { "websocket_handshake_failures_total", "Opening handshakes that failed, were refused or timed out.",
+          offsetof(struct websocket_shard_stats, handshakeFailures) },
+        { "websocket_parse_errors_total", "Malformed frames and compressed messages.",
+          offsetof(struct websocket_shard_stats, parseErrors) },
+        { "websocket_tls_handshakes_total", "TLS handshakes completed.",
+          offsetof(struct websocket_shard_stats, tlsHandshakes) },
+        { "websocket_tls_resumed_total", "TLS handshakes that resumed a session.",
+          offsetof(struct websocket_shard_stats, tlsResumed) },
+        { "websocket_tls_kernel_total", "TLS connections whose records the kernel encrypts.",
+          offsetof(struct websocket_shard_stats, tlsKernel) }
+    };
+    struct websocket_shard_stats stats;
+    struct ws_pool_stats memory;
+    int s;
+
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++)
+    {
+        if (websocket_printf(pool, out, "# HELP %s %s\n# TYPE %s counter\n",
+                             counters[c].name, counters[c].help, counters[c].name) == -1)
+            return -1;
+        for (s = 0; s < shardCount; s++)
+        {
+            websocket_shard_stats(s, &stats);
+            uint64_t value = *(const uint64_t *)((const uint8_t *)&stats + counters[c].offset);
+            if (websocket_printf(pool, out, "%s{shard=\"%d\"} %llu\n", counters[c].name, s,
+                                 (unsigned long long)value) == -1)
+                return -1;
+        }
+    }
+
+    if (websocket_printf(pool, out, "# HELP websocket_closed_total Connections closed, by reason.\n"
+                                    "# TYPE websocket_closed_total counter\n") == -1)
+        return -1;
+    for (s = 0; s < shardCount; s++)
+    {
+        websocket_shard_stats(s, &stats);
+        for (int r = 0; r < WS_CLOSE_REASONS; r++)
+        {
+            if (websocket_printf(pool, out, "websocket_closed_total{shard=\"%d\",reason=\"%s\"} %llu\n",
+                                 s, closeReasonNames[r], (unsigned long long)stats.closeReasons[r]) == -1)
+                return -1;
+        }
+    }
+
+    if (websocket_printf(pool, out, "# HELP websocket_connections Open connections.\n"
+                                    "# TYPE websocket_connections gauge\n") == -1)
+        return -1;
+    for (s = 0; s < shardCount; s++)
+    {
+        websocket_shard_stats(s, &stats);
+        if (websocket_printf(pool, out, "websocket_connections{shard=\"%d\"} %d\n", s, stats.connections) == -1)
+            return -1;
+    }
+
+    ws_pool_stats(&memory);
+    if (websocket_printf(pool, out,
+                         "# HELP websocket_queued_bytes Bytes waiting in send queues.\n"
+                         "# TYPE websocket_queued_bytes gauge\n"
+                         "websocket_queued_bytes %zu\n"
+                         "# HELP websocket_queued_max_bytes Longest send queue of one connection.\n"
+                         "# TYPE websocket_queued_max_bytes gauge\n"
+                         "websocket_queued_max_bytes %zu\n"
+                         "# HELP websocket_pool_bytes Buffer pool memory.\n"
+                         "# TYPE websocket_pool_bytes gauge\n"
+                         "websocket_pool_bytes{state=\"used\"} %zu\n"
+                         "websocket_pool_bytes{state=\"cached\"} %zu\n",
+                         metrics->queued, metrics->maxQueued, memory.used, memory.cached) == -1)
+        return -1;
+
+    if (websocket_print_summary(pool, out, "websocket_callback_seconds", "Time spent in onRecv and onChunk.",
+                                &metrics->callbackLatency) == -1)
+        return -1;
+    return websocket_print_summary(pool, out, "websocket_reply_seconds",
+                                   "Time from a recv to the first send while its data was handled.",
+                                   &metrics->replyLatency);
+}
+
+// event loop, the handshake parser refused a complete request
+static int websocket_metrics_requested(struct ws_shard *shard)
+{
+    const struct wsSlice *resource = &shard->hs.resource;
+    // only GET requests get as far as the empty line
+    return metricsPath != NULL && shard->hs.length != 0
+           && resource->length == strlen(metricsPath)
+           && memcmp(resource->data, metricsPath, resource->length) == 0;
+}
+
+static void websocket_metrics_answer(struct ws_connection *conn)
+{
+    struct ws_shard *shard = conn->shard;
+    int clientSocket = conn->socket;
+    struct ws_buffer body = { NULL, 0, 0 };
+    // a few kilobytes, too big for the stack of an ESP32 task
+    struct websocket_metrics *metrics = malloc(sizeof(*metrics));
+
+    freeHandshake(&shard->hs);
+    ws_ringbuf_consume(&conn->rx, ws_ringbuf_used(&conn->rx));
+    if (metrics == NULL || websocket_metrics(metrics) == EXIT_FAILURE
+        || websocket_metrics_text(&shard->pool, &body, metrics) == -1)
+    {
+        ESP_LOGE(TAG, "out of memory");
+        free(metrics);
+        ws_buffer_release(&shard->pool, &body);
+        websocket_close(conn, WS_CLOSE_RESOURCE);
+        return;
+    }
+    free(metrics);
+
+    int headerSize = snprintf((char *)shard->buffer, BUF_LEN,
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n",
+                              body.length);
+    struct iovec iov[2] = {
+        { .iov_base = shard->buffer, .iov_len = headerSize },
+        { .iov_base = body.data, .iov_len = body.length }
+    };
+    int sent = safeSendv(clientSocket, iov, 2);
+    ws_buffer_release(&shard->pool, &body);
+    if (sent == EXIT_FAILURE || websocket_queued(clientSocket) == 0)
+    {
+        websocket_close(conn, sent == EXIT_FAILURE ? WS_CLOSE_HANGUP : WS_CLOSE_NORMAL);
+        return;
+    }
+    // the rest goes out as the socket takes it, the client closes once it has read it all
+    conn->state = WS_STATE_CLOSING;
+    conn->closeReason = WS_CLOSE_NORMAL;
+    websocket_arm(conn);
+}
+
+// refuses the handshake, before any of the upgrade is done
+static void websocket_not_found(struct ws_connection *conn)
+{
+    struct ws_shard *shard = conn->shard;
+    int length = sprintf((char *)shard->buffer, "HTTP/1.1 404 Not Found\r\n\r\n");
+    safeSend(conn->socket, shard->buffer, length);
+    freeHandshake(&shard->hs);
+    shard->stats.handshakeFailures++;
+    websocket_close(conn, WS_CLOSE_NOT_FOUND);
+}
+
+static void websocket_manage(struct ws_connection *conn)
+{
+    struct ws_shard *shard = conn->shard;
+    int clientSocket = conn->socket;
+    uint8_t *data = NULL;
+    size_t dataSize = 0;
+    size_t frameSize = BUF_LEN;
+    size_t inputLength = 0;
+    size_t consumed = 0;
+
+    #define prepareBuffer frameSize = BUF_LEN;
+
+    // a single recv may carry several frames, or a frame and the start of the next one
+    while (conn->socket != -1 && ws_ringbuf_used(&conn->rx) > 0) {
+        uint8_t *input = ws_ringbuf_linearize(&conn->rx, &inputLength);
+        uint8_t reassembled = FALSE;
+
+        #ifdef PACKET_DUMP
+        ESP_LOGI(TAG, "in packet:\n%s", input);
+        #endif
+
+        if (conn->state == WS_STATE_OPENING) {
+            conn->frameType = wsParseHandshake(input, inputLength, &shard->hs);
+            consumed = 0;
+            if (conn->frameType == WS_OPENING_FRAME)
+                consumed = shard->hs.length;
+        } else {
+            size_t frameConsumed = 0;
+            conn->frameType = wsParseFrameHeader(&conn->parser, input, inputLength, &consumed);
+
+            if (conn->frameType == WS_TEXT_FRAME || conn->frameType == WS_BINARY_FRAME) {
+                // a message is streamed or buffered as a whole, decided by its first frame
+                conn->messageType = conn->frameType;
+                // compressed messages are always inflated into the message buffer
+                conn->streaming = conn->callbacks->onChunk && conn->parser.payloadLength > streamThreshold
+                                  && !conn->parser.compressed;
+            }
+
+            if ((conn->frameType == WS_TEXT_FRAME || conn->frameType == WS_BINARY_FRAME
+                 || conn->frameType == WS_CONTINUATION_FRAME) && conn->streaming) {
+                struct wsFrameChunk chunk;
+                conn->frameType = wsParseFrameChunk(&conn->parser, input + consumed, inputLength - consumed,
+                                                    &frameConsumed, &chunk);
+                consumed += frameConsumed;
+                if (conn->frameType != WS_INCOMPLETE_FRAME && conn->frameType != WS_ERROR_FRAME) {
+                    ws_ringbuf_consume(&conn->rx, consumed);
+                    // total of a fragmented message is known once its last fragment starts
+                    uint64_t total = conn->parser.fin ? conn->streamOffset + chunk.total : 0;
+                    uint64_t start = websocket_clock_ns();
+                    conn->callbacks->onChunk(clientSocket, conn->context, conn->messageType, chunk.data,
+                                             chunk.length, conn->streamOffset + chunk.offset, total);
+                    ws_histogram_record(&shard->callbackLatency, websocket_clock_ns() - start);
+                    if (chunk.offset + chunk.length == chunk.total) {
+                        conn->stats.framesIn++;
+                        shard->stats.framesIn++;
+                        conn->streamOffset += chunk.total;
+                        if (conn->parser.fin) {
+                            conn->streaming = FALSE;
+                            conn->streamOffset = 0;
+                        }
+                    }
+                    continue;
+                }
+            } else if (conn->frameType != WS_INCOMPLETE_FRAME && conn->frameType != WS_ERROR_FRAME) {
+                conn->frameType = wsParseFrame(&conn->parser, input + consumed, inputLength - consumed,
+                                               &frameConsumed, &data, &dataSize);
+                consumed += frameConsumed;
+            }
+        }
+        // payload stays where it is until the next recv, consuming only moves the parse cursor
+        if (conn->frameType != WS_ERROR_FRAME)
+            ws_ringbuf_consume(&conn->rx, consumed);
+
+        if (conn->frameType == WS_INCOMPLETE_FRAME && ws_ringbuf_used(&conn->rx) < conn->rx.maxCapacity)
+            return;
+
+        if (conn->state == WS_STATE_OPENING && conn->frameType == WS_ERROR_FRAME && websocket_metrics_requested(shard)) {
+            websocket_metrics_answer(conn);
+            return;
+        }
+
+        if (conn->frameType == WS_INCOMPLETE_FRAME || conn->frameType == WS_ERROR_FRAME) {
+            if (conn->frameType == WS_INCOMPLETE_FRAME) {
+                ESP_LOGE(TAG, "buffer too small");
+                websocket_fail(conn, WS_CLOSE_TOO_BIG);
+            }
+            else {
+                ESP_LOGE(TAG, "error in incoming frame");
+                websocket_fail(conn, WS_CLOSE_PROTOCOL);
+            }
+            return;
+        }
+
+        if (conn->state != WS_STATE_OPENING) {
+            conn->stats.framesIn++;
+            shard->stats.framesIn++;
+        }
+
+        if (conn->state == WS_STATE_OPENING) {
+            // if resource is right, generate answer handshake and send it
+            int ret = 0;
+            const struct wsSlice *resource = &shard->hs.resource;
+            // resolved once, the connection keeps the route's callbacks for every message
+            if (router.count) {
+                const struct websocket_callbacks *routed = ws_router_match(&router, resource->data,
+                                                                           resource->length, &conn->route);
+                if (routed == NULL) {
+                    websocket_not_found(conn);
+                    return;
+                }
+                conn->callbacks = routed;
+            }
+            if (ws_buffer_reserve(&shard->pool, &conn->resource, resource->length + 1) == -1) {
+                ESP_LOGE(TAG, "out of memory");
+                websocket_fail(conn, WS_CLOSE_RESOURCE);
+                return;
+            }
+            memcpy(conn->resource.data, resource->data, resource->length);
+            conn->resource.length = resource->length;
+            conn->resource.data[conn->resource.length] = '\0';
+            conn->context = conn->callbacks->context;
+            if (conn->callbacks->onOpen)
+                ret = conn->callbacks->onOpen(clientSocket, (char *)conn->resource.data, &conn->context);
+            if (ret == EXIT_FAILURE) {
+                websocket_not_found(conn);
+                return;
+            }
+
+            conn->established = TRUE;
+            websocket_subscribe(clientSocket, (char *)conn->resource.data);
+
+#ifdef WS_DEFLATE
+            // senders on other threads look at the compressor under sendLock
+            pthread_mutex_lock(&conn->sendLock);
+            if (wsNegotiateDeflate(&shard->hs, &deflateLimits)
+                && ws_deflate_init(&conn->deflate, &shard->hs.deflate, deflateMemLevel, deflateBudget) == -1) {
+                // over the memory budget: go on without compression
+                ESP_LOGI(TAG, "permessage-deflate declined");
+                ws_deflate_free(&conn->deflate);
+                shard->hs.deflate.enabled = FALSE;
+            }
+            pthread_mutex_unlock(&conn->sendLock);
+            if (shard->hs.deflate.enabled)
+                conn->parser.rsvAllowed = 0x40;
+#endif
+
+            prepareBuffer;
+            wsGetHandshakeAnswer(&shard->hs, shard->buffer, &frameSize);
+            freeHandshake(&shard->hs);
+            if (safeSend(clientSocket, shard->buffer, frameSize) == EXIT_FAILURE) {
+                websocket_close(conn, WS_CLOSE_HANGUP);
+                return;
+            }
+            conn->state = WS_STATE_NORMAL;
+            websocket_arm(conn);
+            continue;
+        }
+
+        if (conn->frameType == WS_CLOSING_FRAME) {
+            if (conn->state != WS_STATE_CLOSING) {
+                prepareBuffer;
+                wsMakeFrame(NULL, 0, shard->buffer, &frameSize, WS_CLOSING_FRAME);
+                safeSend(clientSocket, shard->buffer, frameSize);
+            }
+            websocket_close(conn, WS_CLOSE_NORMAL);
+            return;
+        }
+
+        if (conn->frameType == WS_PING_FRAME) {
+            // control frames carry at most 125 bytes, the pong echoes them
+            struct iovec iov = { .iov_base = data, .iov_len = dataSize };
+            websocket_sendv_fragment(clientSocket, WS_PONG_FRAME, TRUE, 0, &iov, 1);
+            continue;
+        }
+        if (conn->frameType == WS_PONG_FRAME)
+            continue;
+
+#ifdef WS_DEFLATE
+        if (conn->parser.compressed && conn->frameType != WS_PING_FRAME && conn->frameType != WS_PONG_FRAME) {
+            // every frame of a compressed message is inflated as it comes in
+            size_t inflated = conn->message.length;
+            if (ws_deflate_decompress(&conn->deflate, &shard->pool, data, dataSize, conn->parser.fin,
+                                      __atomic_load_n(&conn->maxMessageSize, __ATOMIC_RELAXED),
+                                      &conn->message) == -1) {
+                ESP_LOGE(TAG, "bad compressed message");
+                websocket_fail(conn, WS_CLOSE_PROTOCOL);
+                return;
+            }
+            // the parser can't see the text, its state continues here while the new bytes are hot
+            if (conn->parser.validateUtf8 && conn->messageType == WS_TEXT_FRAME
+                && (!wsUnmaskUtf8(&conn->parser.utf8, conn->message.data + inflated,
+                                  conn->message.length - inflated, NULL, 0)
+                    || (conn->parser.fin && !wsUtf8Complete(&conn->parser.utf8)))) {
+                ESP_LOGE(TAG, "invalid UTF-8");
+                websocket_fail(conn, WS_CLOSE_PROTOCOL);
+                return;
+            }
+            if (!conn->parser.fin)
+                continue;
+            reassembled = TRUE;
+            data = conn->message.data;
+            dataSize = conn->message.length;
+            conn->frameType = conn->messageType;
+        } else
+#endif
+        if (conn->frameType == WS_CONTINUATION_FRAME || !conn->parser.fin) {
+            // fragment: collect in a pooled buffer, control frames in between are handled as usual
+            if (conn->message.length + dataSize > __atomic_load_n(&conn->maxMessageSize, __ATOMIC_RELAXED)) {
+                ESP_LOGE(TAG, "message too big");
+                websocket_fail(conn, WS_CLOSE_TOO_BIG);
+                return;
+            }
+            if (ws_buffer_append(&shard->pool, &conn->message, data, dataSize) == -1) {
+                ESP_LOGE(TAG, "out of memory");
+                websocket_fail(conn, WS_CLOSE_RESOURCE);
+                return;
+            }
+            if (!conn->parser.fin)
+                continue;
+            reassembled = TRUE;
+            data = conn->message.data;
+            dataSize = conn->message.length;
+            conn->frameType = conn->messageType;
+        }
+
+        if (reassembled) {
+            // room for the terminator, the ring has it behind its last byte
+            if (ws_buffer_reserve(&shard->pool, &conn->message, conn->message.length + 1) == -1) {
+                ESP_LOGE(TAG, "out of memory");
+                websocket_fail(conn, WS_CLOSE_RESOURCE);
+                return;
+            }
+            data = conn->message.data;
+        }
+
+        if ((conn->frameType == WS_TEXT_FRAME || conn->frameType == WS_BINARY_FRAME) && conn->callbacks->onMessage) {
+            // terminated in place, the byte behind the payload belongs to the next frame or is spare
+            uint8_t saved = data[dataSize];
+            if (conn->frameType == WS_TEXT_FRAME)
+                data[dataSize] = '\0';
+
+            shard->stats.messages++;
+            uint64_t start = websocket_clock_ns();
+            conn->callbacks->onMessage(clientSocket, conn->context, conn->frameType, data, dataSize);
+            ws_histogram_record(&shard->callbackLatency, websocket_clock_ns() - start);
+            data[dataSize] = saved;
+        }
+        if (reassembled)
+            ws_buffer_release(&shard->pool, &conn->message);
+    }
+}
+
+int websocket_send(int clientSocket, const char *buffer, size_t bufferSize)
+{
+    struct iovec iov = { .iov_base = (void*)buffer, .iov_len = bufferSize };
+    return websocket_sendv(clientSocket, WS_TEXT_FRAME, &iov, 1);
+}
+
+#ifdef WS_DEFLATE
+/*
+ * Compresses and writes under sendLock: senders on other threads share the
+ * compressor, and the peer inflates the messages in the order they go out.
+ * The output comes from malloc, the shard's pool belongs to its event loop.
+ */
+static int websocket_send_compressed(struct ws_connection *conn, int clientSocket, enum wsFrameType frameType,
+                                     const struct iovec *iov, int iovcnt)
+{
+    uint8_t header[WS_MAX_FRAME_HEADER];
+    struct ws_buffer compressed = { NULL, 0, 0 };
+    struct iovec frame[2];
+    int crossed = 0;
+    int ret = EXIT_FAILURE;
+
+    pthread_mutex_lock(&conn->sendLock);
+    // closed meanwhile, its compressor may already be gone
+    if (conn->socket != clientSocket)
+    {
+        pthread_mutex_unlock(&conn->sendLock);
+        return EXIT_FAILURE;
+    }
+    if (!conn->deflate.params.enabled)
+    {
+        pthread_mutex_unlock(&conn->sendLock);
+        return websocket_sendv_fragment(clientSocket, frameType, TRUE, 0, iov, iovcnt);
+    }
+    if (ws_deflate_compress(&conn->deflate, NULL, iov, iovcnt, &compressed) == -1)
+    {
+        ESP_LOGE(TAG, "deflate FAILED");
+    }
+    else
+    {
+        frame[0].iov_base = header;
+        frame[0].iov_len = wsMakeFragmentHeader(compressed.length, header, frameType, TRUE);
+        header[0] |= 0x40;
+        frame[1].iov_base = compressed.data;
+        frame[1].iov_len = compressed.length;
+        ret = websocket_write_locked(conn, clientSocket, frame, 2, NULL, &crossed);
+    }
+    size_t queued = conn->out.bytes;
+    pthread_mutex_unlock(&conn->sendLock);
+    ws_buffer_release(NULL, &compressed);
+    websocket_watermark_notify(conn, clientSocket, crossed, queued);
+    return ret;
+}
+#endif
+
+int websocket_sendv(int clientSocket, enum wsFrameType frameType, const struct iovec *iov, int iovcnt)
+{
+#ifdef WS_DEFLATE
+    struct ws_connection *conn = websocket_find(clientSocket);
+    // whether the connection negotiated compression is only known under sendLock
+    if (conn && deflateLimits.enabled
+        && (frameType == WS_TEXT_FRAME || frameType == WS_BINARY_FRAME))
+    {
+        size_t dataLength = 0;
+        for (int i = 0; i < iovcnt; i++)
+            dataLength += iov[i].iov_len;
+
+        // small messages don't win enough to pay for the compressor
+        if (dataLength >= deflateThreshold)
+            return websocket_send_compressed(conn, clientSocket, frameType, iov, iovcnt);
+    }
+#endif
+    return websocket_sendv_fragment(clientSocket, frameType, TRUE, 0, iov, iovcnt);
+}
+
+int websocket_send_fragment(int clientSocket, enum wsFrameType frameType, int fin,
+                            const uint8_t *data, size_t dataSize)
+{
+    struct iovec iov = { .iov_base = (void*)data, .iov_len = dataSize };
+    return websocket_sendv_fragment(clientSocket, frameType, fin, 0, &iov, 1);
+}
+
+int websocket_send_fragmented(int clientSocket, enum wsFrameType frameType,
+                              const uint8_t *data, size_t dataSize, size_t fragmentSize)
+{
+    size_t offset = 0;
+    assert(fragmentSize > 0);
+
+    // every fragment is its own write, so other frames for this client can go in between
+    do {
+        size_t length = dataSize - offset < fragmentSize ? dataSize - offset : fragmentSize;
+        int fin = offset + length == dataSize;
+        if (websocket_send_fragment(clientSocket, offset ? WS_CONTINUATION_FRAME : frameType,
+                                    fin, data + offset, length) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        offset += length;
+    } while (offset < dataSize);
+
+    return EXIT_SUCCESS;
+}
+
+static int websocket_sendv_fragment(int clientSocket, enum wsFrameType frameType, int fin,
+                                    uint8_t rsv, const struct iovec *iov, int iovcnt)
+{
+    uint8_t header[WS_MAX_FRAME_HEADER];
+    struct iovec frame[MAX_IOV + 1];
+    size_t dataLength = 0;
+
+    if (iovcnt > MAX_IOV)
+    {
+        ESP_LOGE(TAG, "too many buffers");
+        return EXIT_FAILURE;
+    }
+
+    // header goes in front of the caller's buffers, the payload is never copied
+    for (int i = 0; i < iovcnt; i++)
+    {
+        dataLength += iov[i].iov_len;
+        frame[i + 1] = iov[i];
+    }
+    frame[0].iov_base = header;
+    frame[0].iov_len = wsMakeFragmentHeader(dataLength, header, frameType, fin);
+    header[0] |= rsv;
+
+    if (safeSendv(clientSocket, frame, iovcnt + 1) == EXIT_FAILURE)
+    {
+        ESP_LOGE(TAG, "Send FAILED");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * sendLock held: 1 if the queue just went above the high watermark, -1 if it
+ * just drained to the low one, 0 if neither.
+ */
+static int websocket_watermark_crossed(struct ws_connection *conn)
+{
+    if (highWatermark == 0)
+        return 0;
+    if (!conn->congested && conn->out.bytes > highWatermark) {
+        conn->congested = TRUE;
+        return 1;
+    }
+    if (conn->congested && conn->out.bytes <= lowWatermark) {
+        conn->congested = FALSE;
+        return -1;
+    }
+    return 0;
+}
+
+// sendLock released, the callback may send
+static void websocket_watermark_notify(struct ws_connection *conn, int clientSocket, int crossed, size_t queued)
+{
+    if (crossed != 0 && conn->callbacks->onWatermark)
+        conn->callbacks->onWatermark(clientSocket, conn->context, crossed > 0, queued);
+}
+
+// event loop, sendLock released: the queue of clientSocket just ran empty
+static void websocket_writable(struct ws_connection *conn, int clientSocket)
+{
+    if (conn->callbacks->onWritable && conn->established && conn->state == WS_STATE_NORMAL
+        && conn->socket == clientSocket)
+        conn->callbacks->onWritable(clientSocket, conn->context);
+}
+
+/*
+ * Writes iov without blocking. What the socket doesn't take is queued
+ * behind anything queued before and goes out when it turns writable.
+ * If shared is given it holds exactly the bytes of iov and is queued by
+ * reference, otherwise the rest is copied. sendLock held, crossed returns
+ * what websocket_watermark_crossed() found.
+ */
+static int websocket_write_locked(struct ws_connection *conn, int clientSocket, struct iovec *iov, int iovcnt,
+                                  struct ws_shared *shared, int *crossed)
+{
+    size_t total = 0;
+    size_t written = 0;
+
+    #ifdef PACKET_DUMP
+    for (int i = 0; i < iovcnt; i++)
+        ESP_LOGI(TAG, "out packet:\n%.*s", (int)iov[i].iov_len, (const char *)iov[i].iov_base);
+    #endif
+
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+#ifdef WS_USE_HANDOFF
+    // the successor writes to the socket now, this process must not anymore
+    if (conn->handedOff)
+        return EXIT_FAILURE;
+#endif
+    if (conn->socket != clientSocket)
+        return EXIT_FAILURE;
+
+    int direct = conn->out.head == NULL;
+#ifdef WS_USE_URING
+    // sends of the event loop itself are batched into its next submission
+    if (conn->shard->uring && pthread_equal(pthread_self(), conn->shard->thread))
+        direct = FALSE;
+#endif
+    if (direct) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t sent;
+        do {
+            sent = websocket_sendmsg(conn, clientSocket, &msg);
+        } while (sent == -1 && errno == EINTR);
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            goto fail;
+        if (sent > 0)
+            written = sent;
+    }
+
+    if (written < total) {
+        if (shared) {
+            if (ws_queue_push(&conn->out, shared, written) == -1)
+                goto fail;
+        } else if (ws_queue_copy(&conn->out, iov, iovcnt, written) == -1) {
+            goto fail;
+        }
+#ifdef WS_USE_URING
+        if (conn->shard->uring)
+            websocket_uring_schedule(conn);
+#endif
+        *crossed = websocket_watermark_crossed(conn);
+    }
+
+    // the shard's own counters are shared with the other senders
+    conn->stats.bytesOut += total;
+    __atomic_add_fetch(&conn->shard->stats.bytesOut, total, __ATOMIC_RELAXED);
+    if (conn->state != WS_STATE_OPENING) {
+        conn->stats.framesOut++;
+        __atomic_add_fetch(&conn->shard->stats.framesOut, 1, __ATOMIC_RELAXED);
+    }
+    if (__atomic_load_n(&conn->recvAt, __ATOMIC_RELAXED) != 0 && __atomic_load_n(&conn->sentAt, __ATOMIC_RELAXED) == 0)
+        __atomic_store_n(&conn->sentAt, websocket_clock_ns(), __ATOMIC_RELAXED);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+
+fail:
+    // the event loop owns the descriptor and closes it on the resulting hangup
+    shutdown(clientSocket, SHUT_RDWR);
+    ESP_LOGE(TAG, "send failed");
+    return EXIT_FAILURE;
+}
+
+static int websocket_write(struct ws_connection *conn, int clientSocket, struct iovec *iov, int iovcnt,
+                           struct ws_shared *shared)
+{
+    int crossed = 0;
+
+    pthread_mutex_lock(&conn->sendLock);
+    int ret = websocket_write_locked(conn, clientSocket, iov, iovcnt, shared, &crossed);
+    size_t queued = conn->out.bytes;
+    pthread_mutex_unlock(&conn->sendLock);
+    websocket_watermark_notify(conn, clientSocket, crossed, queued);
+    return ret;
+}
+
+static void websocket_flush(struct ws_connection *conn)
+{
+    struct iovec iov[MAX_IOV];
+
+    pthread_mutex_lock(&conn->sendLock);
+    int clientSocket = conn->socket;
+    int drained = conn->out.head != NULL;
+    while (conn->socket != -1 && conn->out.head != NULL) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = ws_queue_iov(&conn->out, iov, MAX_IOV);
+
+        ssize_t written = websocket_sendmsg(conn, conn->socket, &msg);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                shutdown(conn->socket, SHUT_RDWR);
+                ws_queue_clear(&conn->out);
+                ESP_LOGE(TAG, "send failed");
+            }
+            drained = FALSE;
+            break;
+        }
+        ws_queue_consume(&conn->out, written);
+    }
+    int crossed = websocket_watermark_crossed(conn);
+    size_t queued = conn->out.bytes;
+    pthread_mutex_unlock(&conn->sendLock);
+    websocket_watermark_notify(conn, clientSocket, crossed, queued);
+    if (drained)
+        websocket_writable(conn, clientSocket);
+#ifdef WS_TLS
+    // the handshake, or a read, waits for the socket to take data
+    if (conn->tls.ssl != NULL && (!conn->tls.established || conn->tls.wantWrite))
+        websocket_read(conn);
+#endif
+}
+
+#ifdef WS_USE_URING
+/*
+ * io_uring event loop: accept and recv are multishot requests that stay
+ * armed, received data arrives in buffers the kernel picks from the shard's
+ * provided buffer ring, and the sends of a whole batch of completions go in
+ * with the one system call that waits for the next batch. Connections and
+ * callbacks are the same as with epoll.
+ */
+
+// low bits of user_data, the rest is the connection
+enum wsUringRequest {
+    WS_URING_ACCEPT = 0,
+    WS_URING_WAKE = 1,
+    WS_URING_RECV = 2,
+    WS_URING_SEND = 3,
+    WS_URING_CANCEL = 4
+};
+#define WS_URING_REQUEST 7 // mask of the request in user_data, connections are aligned to more
+
+static void websocket_uring_accept(struct ws_shard *shard)
+{
+    struct io_uring_sqe *sqe = ws_uring_sqe(&shard->ring);
+    if (sqe == NULL)
+    {
+        ESP_LOGE(TAG, "io_uring full, not accepting");
+        return;
+    }
+    ws_uring_prep_accept(sqe, shard->listenSocket, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    sqe->user_data = WS_URING_ACCEPT;
+    shard->accepting = TRUE;
+    shard->inflight++;
+}
+
+static void websocket_uring_wait_wake(struct ws_shard *shard)
+{
+    struct io_uring_sqe *sqe = ws_uring_sqe(&shard->ring);
+    if (sqe == NULL)
+    {
+        ESP_LOGE(TAG, "io_uring full, sends of other threads are delayed");
+        return;
+    }
+    ws_uring_prep_read(sqe, shard->wakeFd, &shard->wakeValue, sizeof(shard->wakeValue));
+    sqe->user_data = WS_URING_WAKE;
+}
+
+static void websocket_uring_recv(struct ws_connection *conn)
+{
+    struct io_uring_sqe *sqe = ws_uring_sqe(&conn->shard->ring);
+    if (sqe == NULL)
+    {
+        ESP_LOGE(TAG, "io_uring full");
+        websocket_close(conn, WS_CLOSE_RESOURCE);
+        return;
+    }
+    ws_uring_prep_recv(sqe, conn->socket);
+    sqe->user_data = (uintptr_t)conn | WS_URING_RECV;
+    conn->receiving = TRUE;
+    conn->shard->inflight++;
+}
+
+// sendLock held, the queue goes out as one sendmsg
+static void websocket_uring_send(struct ws_connection *conn)
+{
+    struct ws_shard *shard = conn->shard;
+
+    // a handoff waits for the ring to be quiet, the queue goes to the successor or out later
+    if (conn->socket == -1 || conn->out.head == NULL || websocket_handing_off())
+        return;
+    struct io_uring_sqe *sqe = ws_uring_sqe(&shard->ring);
+    if (sqe == NULL)
+    {
+        // tried again after the next wait
+        pthread_mutex_lock(&shard->pendingLock);
+        conn->pendingFlush = TRUE;
+        conn->nextPending = shard->pending;
+        shard->pending = conn;
+        pthread_mutex_unlock(&shard->pendingLock);
+        return;
+    }
+    memset(&conn->sendMsg, 0, sizeof(conn->sendMsg));
+    conn->sendMsg.msg_iov = conn->sendIov;
+    conn->sendMsg.msg_iovlen = ws_queue_iov(&conn->out, conn->sendIov, MAX_IOV);
+    ws_uring_prep_sendmsg(sqe, conn->socket, &conn->sendMsg, MSG_NOSIGNAL);
+    sqe->user_data = (uintptr_t)conn | WS_URING_SEND;
+    conn->sending = TRUE;
+    shard->inflight++;
+}
+
+// sendLock held, called when data was queued
+static void websocket_uring_schedule(struct ws_connection *conn)
+{
+    struct ws_shard *shard = conn->shard;
+
+    // an unfinished send or the pending list picks the new data up
+    if (conn->sending || conn->pendingFlush)
+        return;
+
+    pthread_mutex_lock(&shard->pendingLock);
+    int wake = shard->pending == NULL;
+    conn->pendingFlush = TRUE;
+    conn->nextPending = shard->pending;
+    shard->pending = conn;
+    pthread_mutex_unlock(&shard->pendingLock);
+
+    // the event loop looks at the list before it waits, only other threads have to wake it
+    if (wake && !pthread_equal(pthread_self(), shard->thread))
+        websocket_wake(shard);
+}
+
+static void websocket_uring_flush(struct ws_shard *shard)
+{
+    pthread_mutex_lock(&shard->pendingLock);
+    struct ws_connection *conn = shard->pending;
+    shard->pending = NULL;
+    pthread_mutex_unlock(&shard->pendingLock);
+
+    while (conn != NULL)
+    {
+        struct ws_connection *next = conn->nextPending;
+        pthread_mutex_lock(&conn->sendLock);
+        conn->pendingFlush = FALSE;
+        if (!conn->sending)
+            websocket_uring_send(conn);
+        pthread_mutex_unlock(&conn->sendLock);
+        conn = next;
+    }
+}
+
+static void websocket_uring_sent(struct ws_connection *conn, int result)
+{
+    int crossed = 0;
+    int drained = FALSE;
+
+    pthread_mutex_lock(&conn->sendLock);
+    int clientSocket = conn->socket;
+    conn->sending = FALSE;
+    conn->shard->inflight--;
+    if (conn->socket == -1)
+    {
+        // closed meanwhile
+        ws_queue_clear(&conn->out);
+    }
+    // cancelled for a handoff before anything was written: the queue stays as it is
+    else if (result < 0 && result != -EAGAIN && result != -EINTR && result != -ECANCELED)
+    {
+        // the recv ends on the resulting hangup and closes the connection
+        shutdown(conn->socket, SHUT_RDWR);
+        ws_queue_clear(&conn->out);
+        ESP_LOGE(TAG, "send failed");
+    }
+    else
+    {
+        if (result > 0)
+            ws_queue_consume(&conn->out, result);
+        drained = conn->out.head == NULL;
+        // the rest, and whatever was queued meanwhile
+        websocket_uring_send(conn);
+        crossed = websocket_watermark_crossed(conn);
+    }
+    size_t queued = conn->out.bytes;
+    pthread_mutex_unlock(&conn->sendLock);
+    websocket_watermark_notify(conn, clientSocket, crossed, queued);
+    if (drained)
+        websocket_writable(conn, clientSocket);
+#ifdef WS_TLS
+    // the handshake, or a read, waits for the socket to take data
+    if (conn->tls.ssl != NULL && (!conn->tls.established || conn->tls.wantWrite))
+        websocket_read(conn);
+#endif
+}
+
+static void websocket_uring_received(struct ws_connection *conn, const struct io_uring_cqe *cqe)
+{
+    struct ws_uring *ring = &conn->shard->ring;
+
+    if (conn->socket != -1)
+    {
+        if (cqe->res > 0)
+        {
+            // copied behind what is left of the previous recv, frames may span both
+            const uint8_t *data = ws_uring_buffer(ring, cqe);
+            size_t length = cqe->res;
+            conn->shard->stats.bytesIn += length;
+            conn->stats.bytesIn += length;
+            conn->lastSeen = conn->shard->now;
+            websocket_received(conn);
+            while (length > 0 && conn->socket != -1)
+            {
+                size_t space = 0;
+                uint8_t *writePtr = ws_ringbuf_write_ptr(&conn->rx, &space);
+                if (space == 0)
+                {
+                    ESP_LOGE(TAG, "buffer too small");
+                    websocket_close(conn, WS_CLOSE_TOO_BIG);
+                    break;
+                }
+                if (space > length)
+                    space = length;
+                memcpy(writePtr, data, space);
+                ws_ringbuf_commit(&conn->rx, space);
+                data += space;
+                length -= space;
+                websocket_manage(conn);
+            }
+            websocket_replied(conn);
+        }
+        else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+        {
+            if (cqe->res < 0)
+                ESP_LOGE(TAG, "recv failed");
+            websocket_close(conn, WS_CLOSE_HANGUP);
+        }
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+        ws_uring_buffer_recycle(ring, cqe);
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        conn->receiving = FALSE;
+        conn->shard->inflight--;
+        // the kernel ended it, e.g. out of buffers, while the connection is still open
+        if (conn->socket != -1 && !websocket_handing_off())
+            websocket_uring_recv(conn);
+    }
+}
+
+static void websocket_uring_accepted(struct ws_shard *shard, const struct io_uring_cqe *cqe)
+{
+    if (cqe->res >= 0)
+    {
+        struct sockaddr_in remote;
+        socklen_t sockaddrLen = sizeof(remote);
+        memset(&remote, 0, sizeof(remote));
+        getpeername(cqe->res, (struct sockaddr*)&remote, &sockaddrLen);
+        struct ws_connection *conn = websocket_open(shard, cqe->res, &remote);
+        // accepted while a handoff quiets the ring: handed over, or armed when it resumes
+        if (conn != NULL && !websocket_handing_off())
+            websocket_uring_recv(conn);
+    }
+    else if (cqe->res != -ECANCELED)
+    {
+        ESP_LOGE(TAG, "accept FAILED");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        shard->accepting = FALSE;
+        shard->inflight--;
+        if (!websocket_handing_off())
+            websocket_uring_accept(shard);
+    }
+}
+
+static int websocket_uring_cancel_request(struct ws_shard *shard, uint64_t request)
+{
+    struct io_uring_sqe *sqe = ws_uring_sqe(&shard->ring);
+    if (sqe == NULL)
+        return -1;
+    ws_uring_prep_cancel(sqe, request);
+    sqe->user_data = WS_URING_CANCEL;
+    return 0;
+}
+
+/*
+ * Handoff: ends the requests that would otherwise wait for the peers, a
+ * send to one that doesn't read included; their completions still come.
+ * With the ring full it is tried again on the next turn, cancelling twice
+ * does no harm.
+ */
+static void websocket_uring_cancel(struct ws_shard *shard)
+{
+    if (shard->accepting && websocket_uring_cancel_request(shard, WS_URING_ACCEPT) == -1)
+        return;
+    int end = ws_fdtable_end(&connectionTable);
+    for (int clientSocket = 0; clientSocket < end; clientSocket++)
+    {
+        struct ws_connection *conn = websocket_find(clientSocket);
+        if (conn == NULL || conn->shard != shard)
+            continue;
+        if ((conn->receiving && websocket_uring_cancel_request(shard, (uintptr_t)conn | WS_URING_RECV) == -1)
+            || (conn->sending && websocket_uring_cancel_request(shard, (uintptr_t)conn | WS_URING_SEND) == -1))
+            return;
+    }
+    // closed ones may still be sending what they had queued
+    for (struct ws_connection *conn = shard->freeConnections; conn != NULL; conn = conn->next)
+    {
+        if (conn->sending && websocket_uring_cancel_request(shard, (uintptr_t)conn | WS_URING_SEND) == -1)
+            return;
+    }
+    shard->cancelled = TRUE;
+}
+
+// the handoff failed: accept, recv and send again as before it
+static void websocket_uring_resume(struct ws_shard *shard)
+{
+    shard->cancelled = FALSE;
+    if (!shard->accepting)
+        websocket_uring_accept(shard);
+    int end = ws_fdtable_end(&connectionTable);
+    for (int clientSocket = 0; clientSocket < end; clientSocket++)
+    {
+        struct ws_connection *conn = websocket_find(clientSocket);
+        if (conn == NULL || conn->shard != shard)
+            continue;
+        if (!conn->receiving)
+            websocket_uring_recv(conn);
+        pthread_mutex_lock(&conn->sendLock);
+        if (!conn->sending)
+            websocket_uring_send(conn);
+        pthread_mutex_unlock(&conn->sendLock);
+    }
+}
+
+/*
+ * Runs the shard on io_uring. Returns -1 right away if the kernel doesn't
+ * support it, the caller goes on with epoll then.
+ */
+static int websocket_uring_loop(struct ws_shard *shard)
+{
+#ifdef WS_TLS
+    // OpenSSL reads and writes the sockets itself
+    if (tlsContext.ctx != NULL)
+    {
+        ESP_LOGI(TAG, "io_uring doesn't carry TLS, using epoll");
+        return -1;
+    }
+#endif
+    int ret = ws_uring_init(&shard->ring, URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE);
+    if (ret < 0)
+    {
+        ESP_LOGI(TAG, "io_uring not available (%s), using epoll", strerror(-ret));
+        return -1;
+    }
+    shard->thread = pthread_self();
+    shard->uring = TRUE;
+
+    websocket_uring_accept(shard);
+    websocket_uring_wait_wake(shard);
+    websocket_adopt(shard);
+    while (1)
+    {
+        if (websocket_handing_off())
+        {
+            if (!shard->cancelled)
+                websocket_uring_cancel(shard);
+            if (shard->inflight == 0)
+            {
+                if (websocket_park(shard))
+                    return 0;
+                websocket_uring_resume(shard);
+            }
+        }
+        websocket_uring_flush(shard);
+        ret = ws_uring_submit(&shard->ring, 1, websocket_wait_time(shard));
+        if (ret < 0 && ret != -EINTR)
+        {
+            ESP_LOGE(TAG, "io_uring_enter failed!");
+            break;
+        }
+        shard->now = websocket_clock();
+
+        struct io_uring_cqe *next;
+        while ((next = ws_uring_cqe(&shard->ring)) != NULL)
+        {
+            struct io_uring_cqe cqe = *next;
+            ws_uring_cqe_seen(&shard->ring);
+
+            struct ws_connection *conn = (struct ws_connection *)(uintptr_t)(cqe.user_data & ~(uint64_t)WS_URING_REQUEST);
+            enum wsUringRequest request = cqe.user_data & WS_URING_REQUEST;
+            if (request == WS_URING_ACCEPT)
+                websocket_uring_accepted(shard, &cqe);
+            else if (request == WS_URING_WAKE)
+                websocket_uring_wait_wake(shard);
+            else if (request == WS_URING_RECV)
+                websocket_uring_received(conn, &cqe);
+            else if (request == WS_URING_SEND)
+                websocket_uring_sent(conn, cqe.res);
+        }
+        websocket_expire(shard);
+    }
+    return 0;
+}
+#endif
+
+static int safeSendv(int clientSocket, struct iovec *iov, int iovcnt)
+{
+    struct ws_connection *conn = websocket_find(clientSocket);
+    if (conn == NULL)
+        return EXIT_FAILURE;
+    return websocket_write(conn, clientSocket, iov, iovcnt, NULL);
+}
+
+// FNV-1a
+static uint32_t websocket_topic_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    return hash;
+}
+
+// topicLock held
+static struct ws_topic *websocket_topic(struct ws_shard *shard, const char *name, uint32_t hash)
+{
+    if (shard->topicBucketCount == 0)
+        return NULL;
+    struct ws_topic *topic = shard->topicBuckets[hash & (shard->topicBucketCount - 1)];
+    while (topic != NULL && (topic->hash != hash || strcmp(topic->name, name) != 0))
+        topic = topic->next;
+    return topic;
+}
+
+// topicLock held, doubles the buckets once there are as many topics; they never shrink
+static struct ws_topic *websocket_topic_add(struct ws_shard *shard, const char *name, uint32_t hash)
+{
+    if (shard->topicCount >= shard->topicBucketCount)
+    {
+        size_t bucketCount = shard->topicBucketCount ? shard->topicBucketCount * 2 : 16;
+        struct ws_topic **buckets = calloc(bucketCount, sizeof(*buckets));
+        if (buckets == NULL)
+            return NULL;
+        for (size_t b = 0; b < shard->topicBucketCount; b++)
+        {
+            struct ws_topic *topic = shard->topicBuckets[b];
+            while (topic != NULL)
+            {
+                struct ws_topic *next = topic->next;
+                topic->next = buckets[topic->hash & (bucketCount - 1)];
+                buckets[topic->hash & (bucketCount - 1)] = topic;
+                topic = next;
+            }
+        }
+        free(shard->topicBuckets);
+        shard->topicBuckets = buckets;
+        shard->topicBucketCount = bucketCount;
+    }
+
+    struct ws_topic *topic = calloc(1, sizeof(*topic));
+    if (topic == NULL || (topic->name = strdup(name)) == NULL)
+    {
+        free(topic);
+        return NULL;
+    }
+    topic->hash = hash;
+    topic->next = shard->topicBuckets[hash & (shard->topicBucketCount - 1)];
+    shard->topicBuckets[hash & (shard->topicBucketCount - 1)] = topic;
+    shard->topicCount++;
+    return topic;
+}
+
+// topicLock held
+static void websocket_topic_free(struct ws_shard *shard, struct ws_topic *topic)
+{
+    struct ws_topic **link = &shard->topicBuckets[topic->hash & (shard->topicBucketCount - 1)];
+    while (*link != topic)
+        link = &(*link)->next;
+    *link = topic->next;
+    shard->topicCount--;
+    free(topic->name);
+    free(topic->subscribers);
+    free(topic);
+}
+
+// topicLock held, the caller unlinks it from its connection; the topic goes once nobody is left
+static void websocket_subscription_free(struct ws_shard *shard, struct ws_subscription *subscription)
+{
+    struct ws_topic *topic = subscription->topic;
+    struct ws_subscription *last = topic->subscribers[--topic->count];
+    topic->subscribers[subscription->index] = last;
+    last->index = subscription->index;
+    if (topic->count == 0)
+        websocket_topic_free(shard, topic);
+    free(subscription);
+}
+
+// topicLock held
+static struct ws_subscription **websocket_subscription(struct ws_connection *conn, const char *name, uint32_t hash)
+{
+    struct ws_subscription **link = &conn->subscriptions;
+    while (*link != NULL && ((*link)->topic->hash != hash || strcmp((*link)->topic->name, name) != 0))
+        link = &(*link)->next;
+    return link;
+}
+
+int websocket_subscribe(int clientSocket, const char *name)
+{
+    struct ws_connection *conn = websocket_find(clientSocket);
+    uint32_t hash = websocket_topic_hash(name);
+    int ret = EXIT_FAILURE;
+
+    if (conn == NULL)
+        return EXIT_FAILURE;
+    struct ws_shard *shard = conn->shard;
+    pthread_mutex_lock(&shard->topicLock);
+    // closed meanwhile: its close drops the subscriptions after this
+    if (websocket_find(clientSocket) != conn)
+        goto exit;
+    if (*websocket_subscription(conn, name, hash) != NULL)
+    {
+        ret = EXIT_SUCCESS;
+        goto exit;
+    }
+
+    struct ws_topic *topic = websocket_topic(shard, name, hash);
+    if (topic == NULL && (topic = websocket_topic_add(shard, name, hash)) == NULL)
+        goto exit;
+    if (topic->count == topic->capacity)
+    {
+        int capacity = topic->capacity ? topic->capacity * 2 : 4;
+        struct ws_subscription **grown = realloc(topic->subscribers, capacity * sizeof(*grown));
+        if (grown != NULL)
+        {
+            topic->subscribers = grown;
+            topic->capacity = capacity;
+        }
+    }
+    struct ws_subscription *subscription = topic->count < topic->capacity ? malloc(sizeof(*subscription)) : NULL;
+    if (subscription == NULL)
+    {
+        if (topic->count == 0)
+            websocket_topic_free(shard, topic);
+        goto exit;
+    }
+    subscription->topic = topic;
+    subscription->conn = conn;
+    subscription->socket = clientSocket;
+    subscription->index = topic->count;
+    topic->subscribers[topic->count++] = subscription;
+    subscription->next = conn->subscriptions;
+    conn->subscriptions = subscription;
+    ret = EXIT_SUCCESS;
+
+exit:
+    pthread_mutex_unlock(&shard->topicLock);
+    return ret;
+}
+
+int websocket_unsubscribe(int clientSocket, const char *name)
+{
+    struct ws_connection *conn = websocket_find(clientSocket);
+    uint32_t hash = websocket_topic_hash(name);
+
+    if (conn == NULL)
+        return EXIT_FAILURE;
+    struct ws_shard *shard = conn->shard;
+    pthread_mutex_lock(&shard->topicLock);
+    struct ws_subscription **link = websocket_subscription(conn, name, hash);
+    struct ws_subscription *subscription = *link;
+    if (subscription != NULL)
+    {
+        *link = subscription->next;
+        websocket_subscription_free(shard, subscription);
+    }
+    pthread_mutex_unlock(&shard->topicLock);
+    return subscription != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// touches only the connection's own topics
+static void websocket_unsubscribe_all(struct ws_connection *conn)
+{
+    struct ws_shard *shard = conn->shard;
+
+    pthread_mutex_lock(&shard->topicLock);
+    while (conn->subscriptions != NULL)
+    {
+        struct ws_subscription *subscription = conn->subscriptions;
+        conn->subscriptions = subscription->next;
+        websocket_subscription_free(shard, subscription);
+    }
+    pthread_mutex_unlock(&shard->topicLock);
+}
+
+static struct ws_shared *websocket_frame(enum wsFrameType frameType, const uint8_t *data, size_t dataSize)
+{
+    struct ws_shared *frame = ws_shared_alloc(WS_MAX_FRAME_HEADER + dataSize);
+    if (frame == NULL)
+        return NULL;
+    size_t headerLength = wsMakeFragmentHeader(dataSize, frame->data, frameType, TRUE);
+    if (dataSize)
+        memcpy(frame->data + headerLength, data, dataSize);
+    frame->length = headerLength + dataSize;
+    return frame;
+}
+
+static int websocket_send_shared(struct ws_connection *conn, int clientSocket, struct ws_shared *frame)
+{
+    if (conn->state != WS_STATE_NORMAL)
+        return EXIT_FAILURE;
+    struct iovec iov = { .iov_base = frame->data, .iov_len = frame->length };
+    return websocket_write(conn, clientSocket, &iov, 1, frame);
+}
+
+int websocket_publish(const char *name, enum wsFrameType frameType, const uint8_t *data, size_t dataSize)
+{
+    int reached = 0;
+
+    // framed once, every subscriber queues the same buffer
+    struct ws_shared *frame = websocket_frame(frameType, data, dataSize);
+    if (frame == NULL)
+        return -1;
+
+    /*
+     * Shard by shard, the subscribers are copied and sent to without the
+     * lock: a send may call onWatermark, which may subscribe or publish
+     * itself, and the shard's handshakes and closes wait for the lock.
+     */
+    struct ws_subscriber {
+        struct ws_connection *conn;
+        int socket;
+    } stackSubscribers[PUBLISH_STACK];
+    struct ws_subscriber *subscribers = stackSubscribers;
+    int capacity = PUBLISH_STACK;
+    uint32_t hash = websocket_topic_hash(name);
+
+    for (int s = 0; s < shardCount && subscribers != NULL; s++)
+    {
+        struct ws_shard *shard = &shards[s];
+        int count = 0;
+        pthread_mutex_lock(&shard->topicLock);
+        struct ws_topic *topic = websocket_topic(shard, name, hash);
+        if (topic != NULL && topic->count > capacity)
+        {
+            if (subscribers != stackSubscribers)
+                free(subscribers);
+            capacity = topic->count;
+            subscribers = malloc(capacity * sizeof(*subscribers));
+        }
+        for (int i = 0; topic != NULL && subscribers != NULL && i < topic->count; i++)
+        {
+            subscribers[count].conn = topic->subscribers[i]->conn;
+            subscribers[count++].socket = topic->subscribers[i]->socket;
+        }
+        pthread_mutex_unlock(&shard->topicLock);
+
+        // websocket_write() skips a connection closed since, its socket doesn't match anymore
+        for (int i = 0; i < count; i++)
+        {
+            if (websocket_send_shared(subscribers[i].conn, subscribers[i].socket, frame) == EXIT_SUCCESS)
+                reached++;
+        }
+    }
+    if (subscribers == NULL)
+        reached = -1;
+    else if (subscribers != stackSubscribers)
+        free(subscribers);
+
+    ws_shared_unref(frame);
+    return reached;
+}
+
+int websocket_broadcast(enum wsFrameType frameType, const uint8_t *data, size_t dataSize)
+{
+    int reached = 0;
+
+    struct ws_shared *frame = websocket_frame(frameType, data, dataSize);
+    if (frame == NULL)
+        return -1;
+
+    int end = ws_fdtable_end(&connectionTable);
+    for (int clientSocket = 0; clientSocket < end; clientSocket++)
+    {
+        struct ws_connection *conn = websocket_find(clientSocket);
+        if (conn != NULL && websocket_send_shared(conn, clientSocket, frame) == EXIT_SUCCESS)
+            reached++;
+    }
+
+    ws_shared_unref(frame);
+    return reached;
+}
+
+int safeSend(int clientSocket, const uint8_t *buffer, size_t bufferSize)
+{
+    struct iovec iov = { .iov_base = (void*)buffer, .iov_len = bufferSize };
+    return safeSendv(clientSocket, &iov, 1);
+}
+
+#ifdef WS_USE_HANDOFF
+/*
+ * Handoff to another process: the event loops park at the end of their
+ * turn, so the thread handing over owns every connection; the io_uring
+ * loop first cancels its requests and waits for their completions. A
+ * first pass sends the listening sockets and each connection's socket
+ * with what was received and parsed. Once the successor acknowledged it,
+ * a second pass hands over each send queue under sendLock, after which
+ * this process doesn't write to the socket anymore. Until the
+ * acknowledgement the handoff can fail, and everything goes on as before.
+ */
+
+static int websocket_handing_off(void)
+{
+    return __atomic_load_n(&handoffRequested, __ATOMIC_ACQUIRE);
+}
+
+// ends the wait of a shard's event loop, select looks again within 100 ms anyway
+static void websocket_wake(struct ws_shard *shard)
+{
+#ifdef WS_USE_EPOLL
+    uint64_t one = 1;
+    if (write(shard->wakeFd, &one, sizeof(one)) == -1)
+        ESP_LOGE(TAG, "wake FAILED");
+#else
+    (void)shard;
+#endif
+}
+
+// event loop, at the end of its turn: TRUE if the successor took over and the loop ends
+static int websocket_park(struct ws_shard *shard)
+{
+    pthread_mutex_lock(&handoffLock);
+    handoffParked++;
+    pthread_cond_broadcast(&handoffCond);
+    while (websocket_handing_off() && !handoffDone)
+        pthread_cond_wait(&handoffCond, &handoffLock);
+    handoffParked--;
+    int done = handoffDone;
+    pthread_mutex_unlock(&handoffLock);
+    shard->now = websocket_clock();
+    return done;
+}
+
+static void websocket_pause(void)
+{
+    pthread_mutex_lock(&handoffLock);
+    __atomic_store_n(&handoffRequested, TRUE, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&handoffLock);
+    for (int s = 0; s < shardCount; s++)
+        websocket_wake(&shards[s]);
+    pthread_mutex_lock(&handoffLock);
+    while (handoffParked < shardCount)
+        pthread_cond_wait(&handoffCond, &handoffLock);
+    pthread_mutex_unlock(&handoffLock);
+}
+
+// done: the loops end, otherwise they go on
+static void websocket_unpause(int done)
+{
+    pthread_mutex_lock(&handoffLock);
+    handoffDone = done;
+    if (!done)
+        __atomic_store_n(&handoffRequested, FALSE, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&handoffCond);
+    pthread_mutex_unlock(&handoffLock);
+}
+
+// the successor can go on exactly where this process stops
+static int websocket_portable(struct ws_connection *conn)
+{
+#ifdef WS_TLS
+    // keys and record sequence numbers stay inside OpenSSL
+    if (conn->tls.ssl != NULL)
+        return FALSE;
+#endif
+#ifdef WS_DEFLATE
+    // zlib hands out the history, not a stream stopped inside a message
+    if (conn->deflate.params.enabled && conn->parser.compressed && conn->parser.fragmentOpcode)
+        return FALSE;
+#endif
+#if !defined(WS_TLS) && !defined(WS_DEFLATE)
+    (void)conn;
+#endif
+    return TRUE;
+}
+
+// NUL terminated names of the connection's topics, -1 if out of memory
+static int websocket_topic_names(struct ws_connection *conn, struct iovec *names)
+{
+    size_t length = 0;
+
+    pthread_mutex_lock(&conn->shard->topicLock);
+    for (struct ws_subscription *subscription = conn->subscriptions; subscription != NULL; subscription = subscription->next)
+        length += strlen(subscription->topic->name) + 1;
+    names->iov_base = malloc(length > 0 ? length : 1);
+    names->iov_len = 0;
+    for (struct ws_subscription *subscription = conn->subscriptions;
+         names->iov_base != NULL && subscription != NULL; subscription = subscription->next)
+    {
+        size_t nameLength = strlen(subscription->topic->name) + 1;
+        memcpy((uint8_t *)names->iov_base + names->iov_len, subscription->topic->name, nameLength);
+        names->iov_len += nameLength;
+    }
+    pthread_mutex_unlock(&conn->shard->topicLock);
+    return names->iov_base != NULL ? 0 : -1;
+}
+
+static void websocket_handoff_record(const struct ws_connection *conn, struct ws_handoff_connection *record)
+{
+    const struct wsFrameParser *parser = &conn->parser;
+
+    memset(record, 0, sizeof(*record));
+    record->payloadLength = parser->payloadLength;
+    record->payloadUnmasked = parser->payloadUnmasked;
+    record->maxMessageSize = __atomic_load_n(&conn->maxMessageSize, __ATOMIC_RELAXED);
+    record->streamOffset = conn->streamOffset;
+    record->age = conn->shard->now - conn->opened;
+    record->messageLength = conn->message.length;
+    record->resourceLength = conn->resource.data ? conn->resource.length : 0;
+    record->state = conn->state;
+    record->established = conn->established;
+    record->messageType = conn->messageType;
+    record->streaming = conn->streaming;
+    record->congested = conn->congested;
+    record->closeReason = conn->closeReason;
+    memcpy(record->header, parser->header, sizeof(record->header));
+    record->headerLength = parser->headerLength;
+    record->headerNeeded = parser->headerNeeded;
+    record->opcode = parser->opcode;
+    record->fin = parser->fin;
+    record->fragmentOpcode = parser->fragmentOpcode;
+    record->rsvAllowed = parser->rsvAllowed;
+    record->compressed = parser->compressed;
+    record->validateUtf8 = parser->validateUtf8;
+    record->textMessage = parser->textMessage;
+    record->utf8[0] = parser->utf8.needed;
+    record->utf8[1] = parser->utf8.low;
+    record->utf8[2] = parser->utf8.high;
+#ifdef WS_DEFLATE
+    const struct wsDeflateParams *params = &conn->deflate.params;
+    record->deflate[0] = params->enabled;
+    record->deflate[1] = params->serverNoContextTakeover;
+    record->deflate[2] = params->clientNoContextTakeover;
+    record->deflate[3] = params->serverMaxWindowBits;
+    record->deflate[4] = params->clientMaxWindowBits;
+    record->deflate[5] = params->serverWindowBitsOffered;
+    record->deflate[6] = params->clientWindowBitsOffered;
+#endif
+}
+
+/*
+ * First pass, event loops parked: the listening sockets, then the
+ * connections that can be handed over, which are returned in handed.
+ * Returns their number, -1 on failure.
+ */
+static int websocket_handoff_connections(int channel, struct ws_connection ***handed)
+{
+    struct ws_handoff_header header = { WS_HANDOFF_MAGIC, WS_HANDOFF_VERSION, shardCount, 0 };
+    int listeners[WS_HANDOFF_MAX_FDS];
+    int end = ws_fdtable_end(&connectionTable);
+    struct ws_connection **portable = calloc(end > 0 ? end : 1, sizeof(*portable));
+    uint8_t *window = NULL;
+    int ret = -1;
+
+#ifdef WS_DEFLATE
+    window = malloc(WS_DEFLATE_WINDOW);
+    if (window == NULL)
+        goto exit;
+#endif
+    if (portable == NULL || shardCount > WS_HANDOFF_MAX_FDS)
+        goto exit;
+    for (int clientSocket = 0; clientSocket < end; clientSocket++)
+    {
+        struct ws_connection *conn = websocket_find(clientSocket);
+        if (conn != NULL && websocket_portable(conn))
+            portable[header.connections++] = conn;
+    }
+    for (int s = 0; s < shardCount; s++)
+        listeners[s] = shards[s].listenSocket;
+    struct iovec iov[6] = { { .iov_base = &header, .iov_len = sizeof(header) } };
+    if (ws_handoff_send(channel, iov, 1, listeners, shardCount) == -1)
+        goto exit;
+
+    for (uint32_t i = 0; i < header.connections; i++)
+    {
+        struct ws_connection *conn = portable[i];
+        struct ws_handoff_connection record;
+        struct iovec names;
+        size_t rxLength = 0;
+        size_t inflaterLength = 0;
+
+        websocket_handoff_record(conn, &record);
+        uint8_t *rx = ws_ringbuf_linearize(&conn->rx, &rxLength);
+#ifdef WS_DEFLATE
+        if (conn->deflate.params.enabled
+            && ws_deflate_get_window(&conn->deflate, FALSE, window, &inflaterLength) == -1)
+        {
+            ESP_LOGE(TAG, "zlib older than 1.2.9, compressed connections can't be handed over");
+            goto exit;
+        }
+#endif
+        record.rxLength = rxLength;
+        if (websocket_topic_names(conn, &names) == -1)
+            goto exit;
+        record.topicsLength = names.iov_len;
+        record.inflaterLength = inflaterLength;
+        iov[0].iov_base = &record;
+        iov[0].iov_len = sizeof(record);
+        iov[1].iov_base = rx;
+        iov[1].iov_len = rxLength;
+        iov[2].iov_base = conn->message.data;
+        iov[2].iov_len = record.messageLength;
+        iov[3].iov_base = conn->resource.data;
+        iov[3].iov_len = record.resourceLength;
+        iov[4] = names;
+        iov[5].iov_base = window;
+        iov[5].iov_len = inflaterLength;
+        int sent = ws_handoff_send(channel, iov, 6, &conn->socket, 1);
+        free(names.iov_base);
+        if (sent == -1)
+            goto exit;
+    }
+    ret = header.connections;
+
+exit:
+    free(window);
+    if (ret == -1)
+    {
+        free(portable);
+        portable = NULL;
+    }
+    *handed = portable;
+    return ret;
+}
+
+/*
+ * Second pass, acknowledged: the send queues, each under sendLock, with
+ * the compressor's history, which the messages compressed so far built.
+ * From here on the successor writes to the sockets.
+ */
+static void websocket_handoff_queues(int channel, struct ws_connection **handed, int count)
+{
+    struct iovec iov[MAX_IOV + 2];
+    uint8_t *window = NULL;
+    int failed = FALSE;
+
+#ifdef WS_DEFLATE
+    window = malloc(WS_DEFLATE_WINDOW);
+    failed = window == NULL;
+#endif
+    for (int i = 0; i < count; i++)
+    {
+        struct ws_connection *conn = handed[i];
+        struct ws_handoff_queue queue = { 0, 0, 0 };
+        size_t deflaterLength = 0;
+
+        pthread_mutex_lock(&conn->sendLock);
+        conn->handedOff = TRUE;
+#ifdef WS_DEFLATE
+        if (!failed && conn->deflate.params.enabled)
+            ws_deflate_get_window(&conn->deflate, TRUE, window, &deflaterLength);
+#endif
+        queue.queued = conn->out.bytes;
+        queue.deflaterLength = deflaterLength;
+        iov[0].iov_base = &queue;
+        iov[0].iov_len = sizeof(queue);
+        iov[1].iov_base = window;
+        iov[1].iov_len = deflaterLength;
+        failed = failed || ws_handoff_send(channel, iov, 2, NULL, 0) == -1;
+        while (!failed && conn->out.head != NULL)
+        {
+            size_t length = 0;
+            int iovcnt = ws_queue_iov(&conn->out, iov, MAX_IOV);
+            for (int b = 0; b < iovcnt; b++)
+                length += iov[b].iov_len;
+            failed = ws_handoff_send(channel, iov, iovcnt, NULL, 0) == -1;
+            ws_queue_consume(&conn->out, length);
+        }
+        ws_queue_clear(&conn->out);
+        pthread_mutex_unlock(&conn->sendLock);
+    }
+    // too late to go back, connections the successor didn't get all of are lost
+    if (failed)
+        ESP_LOGE(TAG, "handing over the send queues FAILED");
+    free(window);
+}
+
+int websocket_handoff(const char *path)
+{
+    struct ws_connection **handed = NULL;
+    uint8_t ack = FALSE;
+
+    if (shards == NULL || websocket_handing_off())
+        return -1;
+    // a loop that ended has nothing to hand over and wouldn't park
+    for (int s = 0; s < shardCount; s++)
+    {
+        if (shards[s].listenSocket == -1)
+            return -1;
+    }
+    int listenSocket = ws_handoff_listen(path);
+    if (listenSocket == -1)
+    {
+        ESP_LOGE(TAG, "handoff socket %s FAILED", path);
+        return -1;
+    }
+    ESP_LOGI(TAG, "waiting for a successor on %s", path);
+    int channel = ws_handoff_accept(listenSocket);
+    close(listenSocket);
+    unlink(path);
+    if (channel == -1)
+        return -1;
+
+    websocket_pause();
+    int count = websocket_handoff_connections(channel, &handed);
+    if (count == -1 || ws_handoff_recv(channel, &ack, sizeof(ack), NULL, 0) != 0 || ack != TRUE)
+    {
+        ESP_LOGE(TAG, "handoff FAILED, serving on");
+        free(handed);
+        close(channel);
+        websocket_unpause(FALSE);
+        return -1;
+    }
+    websocket_handoff_queues(channel, handed, count);
+    close(channel);
+
+    for (int i = 0; i < count; i++)
+        websocket_close(handed[i], WS_CLOSE_HANDOFF);
+    free(handed);
+    // the rest, as a server going away closes them
+    int end = ws_fdtable_end(&connectionTable);
+    for (int clientSocket = 0; clientSocket < end; clientSocket++)
+    {
+        struct ws_connection *conn = websocket_find(clientSocket);
+        if (conn == NULL)
+            continue;
+        if (conn->state == WS_STATE_NORMAL)
+        {
+            size_t frameSize = BUF_LEN;
+            wsMakeFrame(NULL, 0, conn->shard->buffer, &frameSize, WS_CLOSING_FRAME);
+            safeSend(clientSocket, conn->shard->buffer, frameSize);
+        }
+        websocket_close(conn, WS_CLOSE_HANDOFF);
+    }
+    websocket_unpause(TRUE);
+    ESP_LOGI(TAG, "handed %d connections over", count);
+    return count;
+}
+
+static int websocket_ringbuf_fill(struct ws_ringbuf *rb, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t space = 0;
+        uint8_t *writePtr = ws_ringbuf_write_ptr(rb, &space);
+        if (space == 0)
+            return -1;
+        if (space > length)
+            space = length;
+        memcpy(writePtr, data, space);
+        ws_ringbuf_commit(rb, space);
+        data += space;
+        length -= space;
+    }
+    return 0;
+}
+
+#ifdef WS_DEFLATE
+static int websocket_restore_deflate(struct ws_connection *conn, const struct ws_handoff_connection *record,
+                                     const uint8_t *inflater)
+{
+    struct wsDeflateParams params = {
+        .enabled = record->deflate[0],
+        .serverNoContextTakeover = record->deflate[1],
+        .clientNoContextTakeover = record->deflate[2],
+        .serverMaxWindowBits = record->deflate[3],
+        .clientMaxWindowBits = record->deflate[4],
+        .serverWindowBitsOffered = record->deflate[5],
+        .clientWindowBitsOffered = record->deflate[6]
+    };
+    memset(&conn->deflate, 0, sizeof(conn->deflate));
+    if (!params.enabled)
+        return 0;
+    // the budget let it in before, it isn't turned away now
+    if (ws_deflate_init(&conn->deflate, &params, deflateMemLevel, 0) == -1
+        || ws_deflate_set_window(&conn->deflate, FALSE, inflater, record->inflaterLength) == -1)
+        return -1;
+    return 0;
+}
+#endif
+
+/*
+ * Takeover, before the event loops start: a connection as the previous
+ * process left it. Closes the socket and returns NULL if it can't be
+ * served here, the client sees a hangup.
+ */
+static struct ws_connection *websocket_restore(struct ws_shard *shard, int clientSocket,
+                                               const struct ws_handoff_connection *record, const uint8_t *sections)
+{
+    const uint8_t *rx = sections;
+    const uint8_t *message = rx + record->rxLength;
+    const uint8_t *resource = message + record->messageLength;
+    const char *names = (const char *)resource + record->resourceLength;
+    const uint8_t *inflater = (const uint8_t *)names + record->topicsLength;
+    struct ws_connection *conn = NULL;
+
+    __atomic_add_fetch(&openConnections, 1, __ATOMIC_RELAXED);
+#ifndef WS_USE_EPOLL
+    if (clientSocket >= FD_SETSIZE)
+        goto reject;
+#endif
+#ifndef WS_DEFLATE
+    // built without compression, what the client compresses can't be read
+    (void)inflater;
+    if (record->deflate[0])
+        goto reject;
+#endif
+    conn = websocket_connection(shard);
+    if (conn == NULL
+        || ws_ringbuf_init(&conn->rx, &shard->pool, serverConfig.bufferSize, serverConfig.maxBufferSize) == -1
+        || websocket_ringbuf_fill(&conn->rx, rx, record->rxLength) == -1
+        || ws_buffer_append(&shard->pool, &conn->message, message, record->messageLength) == -1
+        || ws_buffer_reserve(&shard->pool, &conn->resource, record->resourceLength + 1) == -1
+#ifdef WS_DEFLATE
+        || websocket_restore_deflate(conn, record, inflater) == -1
+#endif
+        || ws_fdtable_set(&connectionTable, clientSocket, conn) == -1)
+    {
+        ESP_LOGE(TAG, "connection taken over doesn't fit");
+        goto reject;
+    }
+    memcpy(conn->resource.data, resource, record->resourceLength);
+    conn->resource.length = record->resourceLength;
+    conn->resource.data[conn->resource.length] = '\0';
+    if (record->resourceLength == 0)
+        ws_buffer_release(&shard->pool, &conn->resource);
+
+    memset(&conn->stats, 0, sizeof(conn->stats));
+    conn->recvAt = 0;
+    conn->sentAt = 0;
+    conn->socket = clientSocket;
+    shard->stats.connections++;
+#ifndef WS_USE_EPOLL
+    // the set is filled when the loop starts
+    conn->prev = NULL;
+    conn->next = shard->openConnections;
+    if (conn->next != NULL)
+        conn->next->prev = conn;
+    shard->openConnections = conn;
+#endif
+    conn->state = record->state;
+    conn->frameType = WS_INCOMPLETE_FRAME;
+    conn->callbacks = &callbacks;
+    conn->context = callbacks.context;
+    conn->route.params = 0;
+    conn->established = FALSE;
+    conn->handedOff = FALSE;
+    conn->adopted = record->established && conn->resource.data != NULL;
+
+    struct wsFrameParser *parser = &conn->parser;
+    wsInitFrameParser(parser, serverConfig.maxBufferSize);
+    memcpy(parser->header, record->header, sizeof(parser->header));
+    parser->headerLength = record->headerLength;
+    parser->headerNeeded = record->headerNeeded;
+    parser->opcode = record->opcode;
+    parser->fin = record->fin;
+    parser->fragmentOpcode = record->fragmentOpcode;
+    parser->rsvAllowed = record->rsvAllowed;
+    parser->compressed = record->compressed;
+    parser->validateUtf8 = record->validateUtf8;
+    parser->textMessage = record->textMessage;
+    parser->utf8.needed = record->utf8[0];
+    parser->utf8.low = record->utf8[1];
+    parser->utf8.high = record->utf8[2];
+    parser->payloadLength = record->payloadLength;
+    parser->payloadUnmasked = record->payloadUnmasked;
+
+    conn->maxMessageSize = record->maxMessageSize;
+    conn->messageType = record->messageType;
+    conn->streaming = record->streaming;
+    conn->streamOffset = record->streamOffset;
+    conn->congested = record->congested;
+    conn->closeReason = record->closeReason < WS_CLOSE_REASONS ? record->closeReason : WS_CLOSE_NORMAL;
+    // silence and the handshake deadlines start over
+    conn->lastSeen = shard->now;
+    conn->lastPing = shard->now;
+    conn->opened = shard->now > record->age ? shard->now - record->age : 0;
+    websocket_arm(conn);
+
+    if (record->topicsLength > 0 && names[record->topicsLength - 1] == '\0')
+    {
+        for (const char *name = names; name < names + record->topicsLength; name += strlen(name) + 1)
+            websocket_subscribe(clientSocket, name);
+    }
+    return conn;
+
+reject:
+    if (conn != NULL)
+    {
+        ws_fdtable_clear(&connectionTable, clientSocket, conn);
+        ws_ringbuf_free(&conn->rx);
+        ws_buffer_release(&shard->pool, &conn->message);
+        ws_buffer_release(&shard->pool, &conn->resource);
+#ifdef WS_DEFLATE
+        ws_deflate_free(&conn->deflate);
+#endif
+        conn->next = shard->freeConnections;
+        shard->freeConnections = conn;
+    }
+    close(clientSocket);
+    __atomic_sub_fetch(&openConnections, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// first pass of websocket_handoff(), -1 if the stream broke off
+static int websocket_restore_connections(int channel, uint32_t count, struct ws_connection **adopted)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct ws_handoff_connection record;
+        int clientSocket = -1;
+        if (ws_handoff_recv(channel, &record, sizeof(record), &clientSocket, 1) != 1)
+            return -1;
+
+        uint64_t length = (uint64_t)record.rxLength + record.messageLength + record.resourceLength
+                          + record.topicsLength + record.inflaterLength;
+        uint8_t *sections = malloc(length > 0 ? length : 1);
+        if (sections == NULL || ws_handoff_recv(channel, sections, length, NULL, 0) != 0)
+        {
+            free(sections);
+            close(clientSocket);
+            return -1;
+        }
+        adopted[i] = websocket_restore(&shards[i % shardCount], clientSocket, &record, sections);
+        free(sections);
+    }
+    return 0;
+}
+
+// second pass of websocket_handoff(), connections whose queue didn't come through are closed
+static void websocket_restore_queues(int channel, uint32_t count, struct ws_connection **adopted)
+{
+    size_t chunk = 65536;
+    uint8_t *buffer = malloc(chunk);
+    int failed = buffer == NULL;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct ws_connection *conn = adopted[i];
+        struct ws_handoff_queue queue;
+        int complete = !failed && ws_handoff_recv(channel, &queue, sizeof(queue), NULL, 0) == 0
+                       && queue.deflaterLength <= chunk
+                       && ws_handoff_recv(channel, buffer, queue.deflaterLength, NULL, 0) == 0;
+        failed = !complete;
+#ifdef WS_DEFLATE
+        if (complete && conn != NULL && conn->deflate.params.enabled
+            && ws_deflate_set_window(&conn->deflate, TRUE, buffer, queue.deflaterLength) == -1)
+            complete = FALSE;
+#endif
+        for (uint64_t received = 0; !failed && received < queue.queued; )
+        {
+            size_t length = queue.queued - received < chunk ? queue.queued - received : chunk;
+            struct iovec iov = { .iov_base = buffer, .iov_len = length };
+            failed = ws_handoff_recv(channel, buffer, length, NULL, 0) != 0;
+            if (failed || (conn != NULL && ws_queue_copy(&conn->out, &iov, 1, 0) == -1))
+                complete = FALSE;
+            received += length;
+        }
+        if (conn != NULL && (!complete || failed))
+        {
+            ESP_LOGE(TAG, "send queue of a connection taken over lost");
+            websocket_close(conn, WS_CLOSE_RESOURCE);
+            adopted[i] = NULL;
+        }
+    }
+    free(buffer);
+}
+
+// the takeover failed before any loop started: no server at all, as before
+static void websocket_teardown(uint32_t count, struct ws_connection **adopted)
+{
+    for (uint32_t i = 0; adopted != NULL && i < count; i++)
+    {
+        if (adopted[i] != NULL)
+            websocket_close(adopted[i], WS_CLOSE_HANDOFF);
+    }
+    for (int s = 0; s < shardCount; s++)
+    {
+        struct ws_shard *shard = &shards[s];
+        while (shard->freeConnections != NULL)
+        {
+            struct ws_connection *conn = shard->freeConnections;
+            shard->freeConnections = conn->next;
+            pthread_mutex_destroy(&conn->sendLock);
+            free(conn);
+        }
+        close(shard->listenSocket);
+#ifdef WS_USE_EPOLL
+        close(shard->wakeFd);
+#endif
+        // the closes above emptied the topics
+        free(shard->topicBuckets);
+        pthread_mutex_destroy(&shard->topicLock);
+#ifdef WS_USE_URING
+        pthread_mutex_destroy(&shard->pendingLock);
+#endif
+        ws_pool_destroy(&shard->pool);
+    }
+    free(shards);
+    shards = NULL;
+    shardCount = 0;
+}
+
+int websocket_takeover(const char *path, const struct websocket_config *config,
+                       const struct websocket_callbacks *callbackTable)
+{
+    struct ws_handoff_header header;
+    int listeners[WS_HANDOFF_MAX_FDS];
+    struct ws_connection **adopted = NULL;
+    uint8_t ack = TRUE;
+
+    if (shards != NULL)
+        return EXIT_FAILURE;
+    int channel = ws_handoff_connect(path);
+    if (channel == -1)
+        return EXIT_FAILURE;
+    int count = ws_handoff_recv(channel, &header, sizeof(header), listeners, WS_HANDOFF_MAX_FDS);
+    if (count > 0 && (header.magic != WS_HANDOFF_MAGIC || header.version != WS_HANDOFF_VERSION
+                      || header.listeners != (uint32_t)count))
+    {
+        ESP_LOGE(TAG, "handoff from another version");
+        while (count > 0)
+            close(listeners[--count]);
+    }
+    if (count <= 0 || websocket_setup(config, callbackTable, listeners, count) == EXIT_FAILURE)
+    {
+        close(channel);
+        return EXIT_FAILURE;
+    }
+
+    struct iovec iov = { .iov_base = &ack, .iov_len = sizeof(ack) };
+    adopted = calloc(header.connections > 0 ? header.connections : 1, sizeof(*adopted));
+    if (adopted == NULL || websocket_restore_connections(channel, header.connections, adopted) == -1
+        || ws_handoff_send(channel, &iov, 1, NULL, 0) == -1)
+    {
+        ESP_LOGE(TAG, "takeover from %s FAILED", path);
+        websocket_teardown(header.connections, adopted);
+        free(adopted);
+        close(channel);
+        return EXIT_FAILURE;
+    }
+    websocket_restore_queues(channel, header.connections, adopted);
+    close(channel);
+
+    for (uint32_t i = 0; i < header.connections; i++)
+    {
+        struct ws_connection *conn = adopted[i];
+        if (conn == NULL)
+            continue;
+        conn->nextAdopted = conn->shard->adopted;
+        conn->shard->adopted = conn;
+    }
+    free(adopted);
+    ESP_LOGI(TAG, "took %u connections over", header.connections);
+    return websocket_run();
+}
+
+// event loop: the callbacks of a connection taken over start again with onOpen
+static void websocket_resume(struct ws_connection *conn)
+{
+    int ret = 0;
+
+    if (!conn->adopted)
+        return;
+    conn->adopted = FALSE;
+    if (router.count)
+    {
+        const struct websocket_callbacks *routed = ws_router_match(&router, (const char *)conn->resource.data,
+                                                                   conn->resource.length, &conn->route);
+        if (routed == NULL)
+            ret = EXIT_FAILURE;
+        else
+            conn->callbacks = routed;
+    }
+    if (ret != EXIT_FAILURE)
+    {
+        conn->context = conn->callbacks->context;
+        if (conn->callbacks->onOpen)
+            ret = conn->callbacks->onOpen(conn->socket, (char *)conn->resource.data, &conn->context);
+    }
+    if (ret == EXIT_FAILURE)
+    {
+        ESP_LOGI(TAG, "connection taken over refused");
+        if (conn->state == WS_STATE_NORMAL)
+            websocket_fail(conn, WS_CLOSE_NOT_FOUND);
+        else
+            websocket_close(conn, WS_CLOSE_NOT_FOUND);
+        return;
+    }
+    conn->established = TRUE;
+}
+
+// event loop, before its first wait: serves the connections websocket_takeover() restored
+static void websocket_adopt(struct ws_shard *shard)
+{
+    struct ws_connection *conn;
+
+    while ((conn = shard->adopted) != NULL)
+    {
+        int clientSocket = conn->socket;
+        shard->adopted = conn->nextAdopted;
+#ifdef WS_USE_EPOLL
+        int uring = FALSE;
+#endif
+#ifdef WS_USE_URING
+        uring = shard->uring;
+        if (uring)
+            websocket_uring_recv(conn);
+#endif
+#ifdef WS_USE_EPOLL
+        struct epoll_event event = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+        if (!uring && epoll_ctl(shard->epollFd, EPOLL_CTL_ADD, clientSocket, &event) == -1)
+        {
+            ESP_LOGE(TAG, "epoll_ctl FAILED");
+            websocket_close(conn, WS_CLOSE_RESOURCE);
+        }
+#else
+        FD_SET(clientSocket, &shard->readSet);
+#endif
+        if (conn->socket == clientSocket)
+            websocket_resume(conn);
+        if (conn->socket != clientSocket)
+            continue;
+        // what the previous process had queued, and what came in while the processes changed
+#ifdef WS_USE_URING
+        if (uring)
+        {
+            pthread_mutex_lock(&conn->sendLock);
+            if (!conn->sending)
+                websocket_uring_send(conn);
+            pthread_mutex_unlock(&conn->sendLock);
+            continue;
+        }
+#endif
+#ifdef WS_USE_EPOLL
+        websocket_flush(conn);
+        websocket_read(conn);
+#endif
+    }
+}
+#endif